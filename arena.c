@@ -0,0 +1,79 @@
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+#define ARENA_BLOCK_SIZE 16384
+#define ARENA_ALIGNMENT 16
+
+struct arena_block {
+  struct arena_block* next;
+  size_t size;
+  size_t used;
+  char data[];
+};
+
+arena command_arena;
+
+static struct arena_block* new_block(size_t size) {
+  if (size < ARENA_BLOCK_SIZE) size = ARENA_BLOCK_SIZE;
+  struct arena_block* block = malloc(sizeof(struct arena_block) + size);
+  block->next = NULL;
+  block->size = size;
+  block->used = 0;
+  return block;
+}
+
+void* arena_alloc(arena* a, size_t size) {
+  size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+  if (a->current == NULL) a->first = a->current = new_block(size);
+  /* Blocks after the current one are empty, left over from a rewind. */
+  while (a->current->used + size > a->current->size) {
+    struct arena_block* next = a->current->next;
+    if (next == NULL || next->size < size) {
+      struct arena_block* block = new_block(size);
+      block->next = next;
+      a->current->next = block;
+      next = block;
+    }
+    a->current = next;
+    a->current->used = 0;
+  }
+  void* result = a->current->data + a->current->used;
+  a->current->used += size;
+  return result;
+}
+
+char* arena_strdup(arena* a, const char* s) {
+  return arena_strndup(a, s, strlen(s));
+}
+
+char* arena_strndup(arena* a, const char* s, size_t n) {
+  char* result = arena_alloc(a, n + 1);
+  memcpy(result, s, n);
+  result[n] = '\0';
+  return result;
+}
+
+arena_mark arena_save(arena* a) {
+  arena_mark mark = {a->current, a->current ? a->current->used : 0};
+  return mark;
+}
+
+void arena_rewind(arena* a, arena_mark mark) {
+  if (mark.block == NULL) {
+    a->current = a->first;
+    if (a->current) a->current->used = 0;
+  } else {
+    a->current = mark.block;
+    a->current->used = mark.used;
+  }
+}
+
+void arena_dispose(arena* a) {
+  while (a->first != NULL) {
+    struct arena_block* next = a->first->next;
+    free(a->first);
+    a->first = next;
+  }
+  a->current = NULL;
+}
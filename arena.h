@@ -0,0 +1,40 @@
+#pragma once
+#include <stddef.h>
+
+/* Bump allocator for memory that lives as long as one command line: parsed
+ * words, the command struct and temporary strings of the executor. Nothing
+ * is freed one by one. The arena is rewound to a mark instead, which drops
+ * everything allocated after it at once. Blocks are kept for reuse, so a
+ * long running shell doesn't grow. */
+
+struct arena_block;
+
+typedef struct {
+  struct arena_block* first;
+  struct arena_block* current;
+} arena;
+
+/* Position in an arena to rewind to. */
+typedef struct {
+  struct arena_block* block;
+  size_t used;
+} arena_mark;
+
+/* Arena for the command line being run. */
+extern arena command_arena;
+
+void* arena_alloc(arena* a, size_t size);
+
+char* arena_strdup(arena* a, const char* s);
+
+char* arena_strndup(arena* a, const char* s, size_t n);
+
+/* Current position, to be passed to arena_rewind later. */
+arena_mark arena_save(arena* a);
+
+/* Releases everything allocated since mark was saved. Marks must be
+ * rewound in the reverse order they were saved. */
+void arena_rewind(arena* a, arena_mark mark);
+
+/* Frees all blocks. */
+void arena_dispose(arena* a);
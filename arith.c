@@ -0,0 +1,351 @@
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arith.h"
+#include "functions.h"
+
+/* Recursive descent evaluator, one function per precedence level. Values are
+ * computed while parsing, skip is set inside branches that must not have
+ * side effects (right side of && and ||, unused side of ?:). */
+typedef struct {
+  const char* s;
+  size_t length;
+  size_t pos;
+  simple_map* variables;
+  const char* error;
+  int skip;
+} arith;
+
+static int64_t parse_comma(arith* a);
+static int64_t parse_assignment(arith* a);
+
+static char peek(arith* a) {
+  while (a->pos < a->length && isspace(a->s[a->pos])) a->pos++;
+  return a->pos < a->length ? a->s[a->pos] : '\0';
+}
+
+static char peek_at(arith* a, size_t offset) {
+  return a->pos + offset < a->length ? a->s[a->pos + offset] : '\0';
+}
+
+/* Consumes op if it is next and isn't the start of a longer operator. */
+static bool accept(arith* a, const char* op, const char* not_followed) {
+  if (peek(a) != op[0]) return false;
+  size_t n = strlen(op);
+  if (a->pos + n > a->length || strncmp(a->s + a->pos, op, n) != 0) return false;
+  char next = peek_at(a, n);
+  if (next && not_followed && strchr(not_followed, next)) return false;
+  a->pos += n;
+  return true;
+}
+
+static void fail(arith* a, const char* error) {
+  if (a->error == NULL) a->error = error;
+}
+
+static bool is_name_start(char c) { return isalpha(c) || c == '_'; }
+
+/* Reads a variable name at the current position into name. */
+static bool read_name(arith* a, char* name, size_t size) {
+  size_t n = 0;
+  if (peek(a) == '$') {
+    a->pos++;
+    /* $# and $1 are positional parameters */
+    if (peek_at(a, 0) == '#') {
+      a->pos++;
+      strcpy(name, "#");
+      return true;
+    }
+    if (isdigit(peek_at(a, 0))) {
+      while (isdigit(peek_at(a, 0))) {
+        if (n + 1 < size) name[n++] = a->s[a->pos];
+        a->pos++;
+      }
+      name[n] = '\0';
+      return true;
+    }
+  }
+  if (!is_name_start(peek(a))) return false;
+  while (a->pos < a->length &&
+         (isalnum(a->s[a->pos]) || a->s[a->pos] == '_')) {
+    if (n + 1 < size) name[n++] = a->s[a->pos];
+    a->pos++;
+  }
+  name[n] = '\0';
+  return true;
+}
+
+static int64_t get_variable(arith* a, char* name) {
+  if (name[0] == '#') return positional_count();
+  const char* value = isdigit(name[0]) ? positional_get(atoi(name))
+                                       : simple_map_get(a->variables, name);
+  if (value == NULL) return 0;
+  return strtoll(value, NULL, 0);
+}
+
+static void set_variable(arith* a, char* name, int64_t value) {
+  if (a->skip || a->error) return;
+  char buffer[32];
+  sprintf(buffer, "%" PRId64, value);
+  simple_map_set(a->variables, name, buffer);
+}
+
+static int64_t parse_number(arith* a) {
+  const char* start = a->s + a->pos;
+  char* end;
+  int64_t value = (int64_t)strtoull(start, &end, 0);
+  if (*end == '#') { /* base#digits */
+    int base = (int)value;
+    if (base < 2 || base > 36) fail(a, "invalid arithmetic base");
+    value = (int64_t)strtoull(end + 1, &end, base);
+  }
+  a->pos += end - start;
+  if (a->pos < a->length && isalnum(a->s[a->pos]))
+    fail(a, "value too great for base");
+  return value;
+}
+
+static int64_t parse_primary(arith* a) {
+  char c = peek(a);
+  if (c == '(') {
+    a->pos++;
+    int64_t value = parse_comma(a);
+    if (!accept(a, ")", NULL)) fail(a, "missing `)'");
+    return value;
+  }
+  if (isdigit(c)) return parse_number(a);
+
+  char name[256];
+  if (!read_name(a, name, sizeof(name))) {
+    fail(a, c ? "syntax error: operand expected" : "operand expected");
+    return 0;
+  }
+  int64_t value = get_variable(a, name);
+  if (accept(a, "++", NULL))
+    set_variable(a, name, value + 1);
+  else if (accept(a, "--", NULL))
+    set_variable(a, name, value - 1);
+  return value;
+}
+
+static int64_t parse_unary(arith* a) {
+  if (accept(a, "++", NULL) || accept(a, "--", NULL)) {
+    int64_t delta = a->s[a->pos - 1] == '+' ? 1 : -1;
+    char name[256];
+    if (!read_name(a, name, sizeof(name))) {
+      fail(a, "syntax error: variable expected");
+      return 0;
+    }
+    int64_t value = get_variable(a, name) + delta;
+    set_variable(a, name, value);
+    return value;
+  }
+  if (accept(a, "!", "=")) return !parse_unary(a);
+  if (accept(a, "~", NULL)) return ~parse_unary(a);
+  if (accept(a, "-", NULL)) return (int64_t)(0 - (uint64_t)parse_unary(a));
+  if (accept(a, "+", NULL)) return parse_unary(a);
+  return parse_primary(a);
+}
+
+static int64_t parse_power(arith* a) {
+  int64_t base = parse_unary(a);
+  if (!accept(a, "**", NULL)) return base;
+  int64_t exponent = parse_power(a);
+  if (exponent < 0) {
+    fail(a, "exponent less than 0");
+    return 0;
+  }
+  uint64_t result = 1;
+  for (; exponent > 0; exponent--) result *= (uint64_t)base;
+  return (int64_t)result;
+}
+
+static int64_t parse_multiplicative(arith* a) {
+  int64_t left = parse_power(a);
+  while (1) {
+    char op = peek(a);
+    if (accept(a, "*", "*=")) {
+      left = (int64_t)((uint64_t)left * (uint64_t)parse_power(a));
+    } else if (accept(a, "/", "=") || accept(a, "%", "=")) {
+      int64_t right = parse_power(a);
+      if (right == 0) {
+        if (!a->skip) fail(a, "division by 0");
+        left = 0;
+      } else if (right == -1) {
+        left = op == '/' ? (int64_t)(0 - (uint64_t)left) : 0;
+      } else {
+        left = op == '/' ? left / right : left % right;
+      }
+    } else {
+      return left;
+    }
+  }
+}
+
+static int64_t parse_additive(arith* a) {
+  int64_t left = parse_multiplicative(a);
+  while (1) {
+    if (accept(a, "+", "+="))
+      left = (int64_t)((uint64_t)left + (uint64_t)parse_multiplicative(a));
+    else if (accept(a, "-", "-="))
+      left = (int64_t)((uint64_t)left - (uint64_t)parse_multiplicative(a));
+    else
+      return left;
+  }
+}
+
+static int64_t parse_shift(arith* a) {
+  int64_t left = parse_additive(a);
+  while (1) {
+    if (accept(a, "<<", "="))
+      left = (int64_t)((uint64_t)left << (parse_additive(a) & 63));
+    else if (accept(a, ">>", "="))
+      left >>= parse_additive(a) & 63;
+    else
+      return left;
+  }
+}
+
+static int64_t parse_relational(arith* a) {
+  int64_t left = parse_shift(a);
+  while (1) {
+    if (accept(a, "<=", NULL))
+      left = left <= parse_shift(a);
+    else if (accept(a, ">=", NULL))
+      left = left >= parse_shift(a);
+    else if (accept(a, "<", "<"))
+      left = left < parse_shift(a);
+    else if (accept(a, ">", ">"))
+      left = left > parse_shift(a);
+    else
+      return left;
+  }
+}
+
+static int64_t parse_equality(arith* a) {
+  int64_t left = parse_relational(a);
+  while (1) {
+    if (accept(a, "==", NULL))
+      left = left == parse_relational(a);
+    else if (accept(a, "!=", NULL))
+      left = left != parse_relational(a);
+    else
+      return left;
+  }
+}
+
+static int64_t parse_bit_and(arith* a) {
+  int64_t left = parse_equality(a);
+  while (accept(a, "&", "&=")) left &= parse_equality(a);
+  return left;
+}
+
+static int64_t parse_bit_xor(arith* a) {
+  int64_t left = parse_bit_and(a);
+  while (accept(a, "^", "=")) left ^= parse_bit_and(a);
+  return left;
+}
+
+static int64_t parse_bit_or(arith* a) {
+  int64_t left = parse_bit_xor(a);
+  while (accept(a, "|", "|=")) left |= parse_bit_xor(a);
+  return left;
+}
+
+static int64_t parse_logical_and(arith* a) {
+  int64_t left = parse_bit_or(a);
+  while (accept(a, "&&", NULL)) {
+    a->skip += !left;
+    int64_t right = parse_bit_or(a);
+    a->skip -= !left;
+    left = left && right;
+  }
+  return left;
+}
+
+static int64_t parse_logical_or(arith* a) {
+  int64_t left = parse_logical_and(a);
+  while (accept(a, "||", NULL)) {
+    a->skip += !!left;
+    int64_t right = parse_logical_and(a);
+    a->skip -= !!left;
+    left = left || right;
+  }
+  return left;
+}
+
+static int64_t parse_conditional(arith* a) {
+  int64_t condition = parse_logical_or(a);
+  if (!accept(a, "?", NULL)) return condition;
+  a->skip += !condition;
+  int64_t if_true = parse_assignment(a);
+  a->skip -= !condition;
+  if (!accept(a, ":", NULL)) fail(a, "`:' expected for conditional expression");
+  a->skip += !!condition;
+  int64_t if_false = parse_assignment(a);
+  a->skip -= !!condition;
+  return condition ? if_true : if_false;
+}
+
+static int64_t apply(arith* a, const char* op, int64_t left, int64_t right) {
+  uint64_t l = left, r = right;
+  switch (op[0]) {
+    case '*': return op[1] == '*' ? 0 : (int64_t)(l * r);
+    case '+': return (int64_t)(l + r);
+    case '-': return (int64_t)(l - r);
+    case '&': return left & right;
+    case '^': return left ^ right;
+    case '|': return left | right;
+    case '<': return (int64_t)(l << (right & 63));
+    case '>': return left >> (right & 63);
+  }
+  if (right == 0) {
+    if (!a->skip) fail(a, "division by 0");
+    return 0;
+  }
+  if (right == -1) return op[0] == '/' ? (int64_t)(0 - l) : 0;
+  return op[0] == '/' ? left / right : left % right;
+}
+
+static int64_t parse_assignment(arith* a) {
+  static const char* operators[] = {"<<=", ">>=", "*=", "/=", "%=", "+=",
+                                    "-=",  "&=",  "^=", "|=", "="};
+  size_t start = a->pos;
+  char name[256];
+  if (read_name(a, name, sizeof(name))) {
+    for (int i = 0; i < sizeof(operators) / sizeof(char*); i++) {
+      if (!accept(a, operators[i], "=")) continue;
+      int64_t value = parse_assignment(a);
+      if (operators[i][0] != '=')
+        value = apply(a, operators[i], get_variable(a, name), value);
+      set_variable(a, name, value);
+      return value;
+    }
+  }
+  a->pos = start;
+  return parse_conditional(a);
+}
+
+static int64_t parse_comma(arith* a) {
+  int64_t value = parse_assignment(a);
+  while (accept(a, ",", NULL)) value = parse_assignment(a);
+  return value;
+}
+
+int arith_eval(const char* expr, size_t length, simple_map* variables,
+               int64_t* result) {
+  arith a = {expr, length, 0, variables, NULL, 0};
+  *result = 0;
+  if (peek(&a) == '\0') return 0;
+  int64_t value = parse_comma(&a);
+  if (a.error == NULL && peek(&a) != '\0') a.error = "syntax error in expression";
+  if (a.error != NULL) {
+    fprintf(stderr, "%.*s: %s\n", (int)length, expr, a.error);
+    return -1;
+  }
+  *result = value;
+  return 0;
+}
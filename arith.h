@@ -0,0 +1,10 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "simple_map.h"
+
+/* Evaluates an integer expression with C operators and precedence, like
+ * $((...)) and let. Variables are read from and assigned to the map.
+ * Returns 0 on success, -1 on error after printing a message. */
+int arith_eval(const char* expr, size_t length, simple_map* variables,
+               int64_t* result);
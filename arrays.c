@@ -0,0 +1,260 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arith.h"
+#include "arrays.h"
+#include "vector.h"
+
+struct array {
+  char* name;
+  bool associative;
+  vector elements; /* char*, NULL where unset */
+  vector sparse;   /* int64_t indexes past the elements, sorted */
+  size_t count;    /* Elements that are set */
+  int64_t end;     /* Elements from here on are NULL */
+  simple_map keys; /* Keys, or the sparse indexes in decimal */
+};
+
+/* Scripts use a handful of arrays, they are searched by name */
+static vector arrays;
+static bool arrays_ready = false;
+
+static void free_element(void* elem) { free(*(char**)elem); }
+
+static void free_array(void* elem) {
+  struct array* a = *(struct array**)elem;
+  free(a->name);
+  simple_map_dispose(&a->keys);
+  VectorDispose(&a->elements);
+  VectorDispose(&a->sparse);
+  free(a);
+}
+
+static int position_of(const char* name) {
+  if (!arrays_ready) return -1;
+  for (int i = 0; i < VectorLength(&arrays); i++) {
+    struct array* a = *(struct array**)VectorNth(&arrays, i);
+    if (strcmp(a->name, name) == 0) return i;
+  }
+  return -1;
+}
+
+struct array* array_find(const char* name) {
+  int i = position_of(name);
+  return i < 0 ? NULL : *(struct array**)VectorNth(&arrays, i);
+}
+
+struct array* array_declare(const char* name, bool associative) {
+  struct array* a = array_find(name);
+  if (a != NULL) return a;
+  if (!arrays_ready) {
+    VectorNew(&arrays, sizeof(struct array*), free_array, 4);
+    arrays_ready = true;
+  }
+  a = malloc(sizeof(struct array));
+  a->name = strdup(name);
+  a->associative = associative;
+  a->count = 0;
+  a->end = 0;
+  simple_map_new(&a->keys);
+  VectorNew(&a->elements, sizeof(char*), free_element, 8);
+  VectorNew(&a->sparse, sizeof(int64_t), NULL, 4);
+  VectorAppend(&arrays, &a);
+  return a;
+}
+
+void array_unset(const char* name) {
+  int i = position_of(name);
+  if (i >= 0) VectorDelete(&arrays, i);
+}
+
+size_t arrays_count() { return arrays_ready ? VectorLength(&arrays) : 0; }
+
+bool array_is_associative(const struct array* a) { return a->associative; }
+
+/* Position of the first sparse index that isn't below index. */
+static int sparse_position(const struct array* a, int64_t index) {
+  int low = 0, high = VectorLength(&a->sparse);
+  while (low < high) {
+    int middle = (low + high) / 2;
+    if (*(int64_t*)VectorNth(&a->sparse, middle) < index)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return low;
+}
+
+/* Index after the last element that is set. */
+static int64_t end_of(struct array* a) {
+  int sparse = VectorLength(&a->sparse);
+  if (sparse > 0) return *(int64_t*)VectorNth(&a->sparse, sparse - 1) + 1;
+  while (a->end > 0 && *(char**)VectorNth(&a->elements, a->end - 1) == NULL)
+    a->end--;
+  return a->end;
+}
+
+/* Evaluates the subscript of an indexed array. Negative indexes count from
+ * the end, the result is -1 if there is no such position. */
+static int64_t index_of(struct array* a, const char* subscript,
+                        simple_map* variables) {
+  int64_t index;
+  if (arith_eval(subscript, strlen(subscript), variables, &index) < 0)
+    return -1;
+  if (index < 0) index += end_of(a);
+  return index;
+}
+
+/* Removes the sparse element at position and returns its value. */
+static char* take_sparse(struct array* a, int position) {
+  char key[32];
+  sprintf(key, "%" PRId64, *(int64_t*)VectorNth(&a->sparse, position));
+  char* value = strdup(simple_map_get(&a->keys, key));
+  simple_map_remove(&a->keys, key);
+  VectorDelete(&a->sparse, position);
+  return value;
+}
+
+/* Stores value, which the array takes, at index. */
+static void set_index(struct array* a, int64_t index, char* value) {
+  int64_t length = VectorLength(&a->elements);
+  if (index < length) {
+    if (*(char**)VectorNth(&a->elements, index) == NULL) a->count++;
+    VectorReplace(&a->elements, &value, index);
+    if (index >= a->end) a->end = index + 1;
+    return;
+  }
+  /* Indexes far past the elements are kept in the map, so that a[5000000]
+   * doesn't take space for the ones below it */
+  if (index > 2 * length + 16) {
+    char* key = malloc(32);
+    sprintf(key, "%" PRId64, index);
+    if (simple_map_get(&a->keys, key) == NULL) {
+      VectorInsert(&a->sparse, &index, sparse_position(a, index));
+      a->count++;
+    }
+    simple_map_put(&a->keys, key, value);
+    return;
+  }
+  /* The elements grow up to index, taking in the sparse ones on the way */
+  for (; length <= index; length++) {
+    char* element = NULL;
+    if (VectorLength(&a->sparse) > 0 &&
+        *(int64_t*)VectorNth(&a->sparse, 0) == length)
+      element = take_sparse(a, 0);
+    VectorAppend(&a->elements, &element);
+  }
+  if (*(char**)VectorNth(&a->elements, index) == NULL) a->count++;
+  VectorReplace(&a->elements, &value, index);
+  a->end = index + 1;
+}
+
+const char* array_get(struct array* a, const char* subscript,
+                      simple_map* variables) {
+  if (a->associative) return simple_map_get(&a->keys, (char*)subscript);
+  int64_t index = index_of(a, subscript, variables);
+  if (index < 0) return NULL;
+  if (index < VectorLength(&a->elements))
+    return *(char**)VectorNth(&a->elements, index);
+  if (VectorLength(&a->sparse) == 0) return NULL;
+  char key[32];
+  sprintf(key, "%" PRId64, index);
+  return simple_map_get(&a->keys, key);
+}
+
+int array_set(struct array* a, const char* subscript, const char* value,
+              simple_map* variables) {
+  if (a->associative) {
+    simple_map_set(&a->keys, subscript, value);
+    return 0;
+  }
+  int64_t index = index_of(a, subscript, variables);
+  if (index < 0) {
+    fprintf(stderr, "%s[%s]: bad array subscript\n", a->name, subscript);
+    return -1;
+  }
+  set_index(a, index, strdup(value));
+  return 0;
+}
+
+int array_remove(struct array* a, const char* subscript,
+                 simple_map* variables) {
+  if (a->associative) {
+    simple_map_remove(&a->keys, (char*)subscript);
+    return 0;
+  }
+  int64_t index = index_of(a, subscript, variables);
+  if (index < 0) {
+    fprintf(stderr, "%s[%s]: bad array subscript\n", a->name, subscript);
+    return -1;
+  }
+  /* The elements don't shrink, end_of skips the unset ones at the end when
+   * it is needed */
+  if (index < VectorLength(&a->elements)) {
+    char* unset = NULL;
+    if (*(char**)VectorNth(&a->elements, index) != NULL) a->count--;
+    VectorReplace(&a->elements, &unset, index);
+    return 0;
+  }
+  int position = sparse_position(a, index);
+  if (position < VectorLength(&a->sparse) &&
+      *(int64_t*)VectorNth(&a->sparse, position) == index) {
+    free(take_sparse(a, position));
+    a->count--;
+  }
+  return 0;
+}
+
+void array_append(struct array* a, const char* value) {
+  if (a->associative) return;
+  set_index(a, end_of(a), strdup(value));
+}
+
+void array_clear(struct array* a) {
+  simple_map_dispose(&a->keys);
+  simple_map_new(&a->keys);
+  VectorDispose(&a->elements);
+  VectorNew(&a->elements, sizeof(char*), free_element, 8);
+  VectorDispose(&a->sparse);
+  VectorNew(&a->sparse, sizeof(int64_t), NULL, 4);
+  a->count = 0;
+  a->end = 0;
+}
+
+size_t array_count(const struct array* a) {
+  return a->associative ? simple_map_size((simple_map*)&a->keys) : a->count;
+}
+
+size_t array_end(const struct array* a) {
+  if (a->associative) return simple_map_size((simple_map*)&a->keys);
+  return VectorLength(&a->elements) + VectorLength(&a->sparse);
+}
+
+const char* array_at(const struct array* a, size_t position) {
+  char *key, *value, buffer[32];
+  if (a->associative) {
+    simple_map_entry((simple_map*)&a->keys, position, &key, &value);
+    return value;
+  }
+  size_t length = VectorLength(&a->elements);
+  if (position < length) return *(char**)VectorNth(&a->elements, position);
+  return simple_map_get((simple_map*)&a->keys,
+                        (char*)array_key(a, position, buffer));
+}
+
+const char* array_key(const struct array* a, size_t position, char buffer[32]) {
+  char *key, *value;
+  if (a->associative) {
+    simple_map_entry((simple_map*)&a->keys, position, &key, &value);
+    return key;
+  }
+  size_t length = VectorLength(&a->elements);
+  if (position < length)
+    sprintf(buffer, "%zu", position);
+  else
+    sprintf(buffer, "%" PRId64,
+            *(int64_t*)VectorNth(&a->sparse, position - length));
+  return buffer;
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include "simple_map.h"
+
+/* Array variables. Indexed arrays keep their elements in a vector, with NULL
+ * for the unset ones, and the few far past its end in a simple_map, where
+ * associative arrays keep theirs. Reading, assigning and appending an element
+ * costs O(1) amortized. Arrays are kept
+ * apart from the string variables and $a reads the element 0 of array a. */
+
+struct array;
+
+/* The array called name, or NULL. */
+struct array* array_find(const char* name);
+
+/* The array called name, created empty if there is none. */
+struct array* array_declare(const char* name, bool associative);
+
+/* Removes the array called name, does nothing if there is none. */
+void array_unset(const char* name);
+
+/* Number of arrays, for callers that can't keep them. */
+size_t arrays_count();
+
+bool array_is_associative(const struct array* a);
+
+/* The subscript of an indexed array is an arithmetic expression, negative
+ * indexes count from the end. Associative arrays use it as the key. */
+
+/* Value of an element, NULL if it isn't set or the subscript is invalid. */
+const char* array_get(struct array* a, const char* subscript,
+                      simple_map* variables);
+
+/* Returns -1 after printing a message if the subscript is invalid. */
+int array_set(struct array* a, const char* subscript, const char* value,
+              simple_map* variables);
+
+int array_remove(struct array* a, const char* subscript,
+                 simple_map* variables);
+
+/* Adds an element after the last one of an indexed array. */
+void array_append(struct array* a, const char* value);
+
+void array_clear(struct array* a);
+
+/* Number of elements that are set. */
+size_t array_count(const struct array* a);
+
+/* Elements are iterated by position, from 0 to array_end. array_at is NULL
+ * for positions that aren't set. */
+size_t array_end(const struct array* a);
+
+const char* array_at(const struct array* a, size_t position);
+
+/* Key of the element at position, indexes are formatted into buffer. */
+const char* array_key(const struct array* a, size_t position, char buffer[32]);
@@ -0,0 +1,35 @@
+#!/bin/sh
+# Compares the latency of short -c commands, the way build systems run them,
+# with dash. Every command is started RUNS times by each shell.
+#
+# Usage: bench/c_startup.sh [runs]
+
+SHELL_BIN=${SHELL_BIN:-$(pwd)/shell}
+OTHER=${OTHER:-dash}
+RUNS=${1:-1000}
+
+run() {
+  start=$(date +%s%N)
+  i=0
+  while [ $i -lt "$RUNS" ]; do
+    "$@"
+    i=$((i + 1))
+  done
+  end=$(date +%s%N)
+  echo $(( (end - start) / 1000 / RUNS ))
+}
+
+compare() {
+  ours=$(run "$SHELL_BIN" --norc -c "$1")
+  theirs=$(run "$OTHER" -c "$1")
+  printf '%-44s %6s us %6s us\n' "$1" "$ours" "$theirs"
+}
+
+printf '%-44s %9s %9s\n' "command" "shell" "$OTHER"
+compare ':'
+compare 'true'
+compare "echo built > /dev/null"
+compare '/bin/true'
+compare "test -d / && echo yes > /dev/null"
+compare "cat /dev/null | wc -l > /dev/null"
+compare "cd /tmp; ls > /dev/null; echo \$? > /dev/null"
@@ -0,0 +1,38 @@
+#!/bin/sh
+# Compares reading a file line by line and loading it into an array with
+# another shell, from a regular file and from a pipe.
+#
+# Usage: bench/read_lines.sh [lines]
+
+SHELL_BIN=${SHELL_BIN:-$(pwd)/shell}
+OTHER=${OTHER:-bash}
+LINES=${1:-100000}
+FILE=$(mktemp)
+trap 'rm -f "$FILE"' EXIT
+seq 1 "$LINES" > "$FILE"
+
+ms() {
+  start=$(date +%s%N)
+  "$@" > /dev/null
+  end=$(date +%s%N)
+  echo $(( (end - start) / 1000000 ))
+}
+
+compare() {
+  ours=$(ms "$SHELL_BIN" --norc -c "$1")
+  theirs=$(ms "$OTHER" -c "$1")
+  printf '%-52s %6s ms %6s ms\n' "$1" "$ours" "$theirs"
+}
+
+# The same with the file on a pipe
+compare_pipe() {
+  ours=$(ms sh -c "cat $FILE | $SHELL_BIN --norc -c '$1'")
+  theirs=$(ms sh -c "cat $FILE | $OTHER -c '$1'")
+  printf '%-52s %6s ms %6s ms\n' "cat | $1" "$ours" "$theirs"
+}
+
+printf '%-52s %9s %9s\n' "command" "shell" "$OTHER"
+compare "exec < $FILE; while read l; do :; done"
+compare_pipe "while read l; do :; done"
+compare "mapfile -t a < $FILE; echo \${#a[@]}"
+compare_pipe "mapfile -t a; echo \${#a[@]}"
@@ -0,0 +1,36 @@
+#!/bin/sh
+# Measures how long the shell takes to launch short commands with a large
+# heap, with and without the zygote helper.
+#
+# Usage: bench/spawn_latency.sh [commands] [variables]
+
+SHELL_BIN=${SHELL_BIN:-./shell}
+COMMANDS=${1:-2000}
+VARIABLES=${2:-20000}
+
+input=$(mktemp)
+trap 'rm -f "$input"' EXIT
+
+# Grow the shell's heap first, then launch the commands.
+i=0
+while [ $i -lt "$VARIABLES" ]; do
+  echo "variable_$i=$(printf '%0128d' $i)"
+  i=$((i + 1))
+done > "$input"
+i=0
+while [ $i -lt "$COMMANDS" ]; do
+  echo "/bin/true"
+  i=$((i + 1))
+done >> "$input"
+
+run() {
+  start=$(date +%s%N)
+  "$SHELL_BIN" "$@" < "$input" > /dev/null
+  end=$(date +%s%N)
+  echo $(( (end - start) / 1000 ))
+}
+
+fork_us=$(run)
+zygote_us=$(run --zygote)
+echo "fork:   ${fork_us} us total"
+echo "zygote: ${zygote_us} us total"
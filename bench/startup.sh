@@ -0,0 +1,44 @@
+#!/bin/sh
+# Measures startup time of short-lived shells that load an rc file, with
+# and without the rc snapshot.
+#
+# Usage: bench/startup.sh [runs] [variables]
+
+SHELL_BIN=${SHELL_BIN:-$(pwd)/shell}
+RUNS=${1:-1000}
+VARIABLES=${2:-300}
+
+home=$(mktemp -d)
+trap 'rm -rf "$home"' EXIT
+
+# An rc file that sets variables, computes some and looks up programs.
+i=0
+while [ $i -lt "$VARIABLES" ]; do
+  echo "setting_$i=/opt/tool_$i/bin"
+  i=$((i + 1))
+done > "$home/.shellrc"
+cat >> "$home/.shellrc" <<'RC'
+export TOOLS_HOME /opt/tools
+i=0
+while ((i < 200)); do ((i++)); done
+true && uname > /dev/null && id -u > /dev/null
+RC
+
+run() {
+  start=$(date +%s%N)
+  i=0
+  while [ $i -lt "$RUNS" ]; do
+    HOME="$home" "$SHELL_BIN" "$@" -c true
+    i=$((i + 1))
+  done
+  end=$(date +%s%N)
+  echo $(( (end - start) / 1000 / RUNS ))
+}
+
+norc_us=$(run --norc)
+rc_us=$(run)
+HOME="$home" "$SHELL_BIN" --snapshot -c true
+snapshot_us=$(run --snapshot)
+echo "no rc:    ${norc_us} us per shell"
+echo "rc:       ${rc_us} us per shell"
+echo "snapshot: ${snapshot_us} us per shell"
@@ -0,0 +1,303 @@
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "brace.h"
+
+/* A word is a chain of nodes and its expansion works like an odometer: the
+ * last node advances first, and a node that runs out resets the nodes after
+ * it and advances the one before. */
+enum { NODE_TEXT, NODE_LIST, NODE_RANGE };
+
+struct node {
+  int type;
+  struct node* next;
+  /* NODE_TEXT */
+  char* text;
+  char* quoted;
+  size_t length;
+  /* NODE_LIST, alternatives are chains themselves */
+  struct node** alternatives;
+  size_t count;
+  size_t current;
+  /* NODE_RANGE */
+  int64_t first, last, step, value;
+  int width;
+  bool letters;
+};
+
+struct brace {
+  struct node* first;
+  bool started;
+  bool done;
+};
+
+/* Index of the } closing the { at text[open], or 0. */
+static size_t closing_brace(const char* text, const char* quoted,
+                            size_t open, size_t end) {
+  int depth = 0;
+  for (size_t i = open; i < end; i++) {
+    if (quoted[i]) continue;
+    if (text[i] == '{') depth++;
+    if (text[i] == '}' && --depth == 0) return i;
+  }
+  return 0;
+}
+
+static bool parse_number(const char* text, size_t length, int64_t* value,
+                         int* width) {
+  char buffer[32];
+  if (length == 0 || length >= sizeof(buffer)) return false;
+  memcpy(buffer, text, length);
+  buffer[length] = '\0';
+  char* end;
+  *value = strtoll(buffer, &end, 10);
+  if (*end != '\0' || !(isdigit(buffer[0]) || buffer[0] == '-')) return false;
+  /* Leading zeros pad every number to the same width */
+  const char* digits = buffer + (buffer[0] == '-');
+  if (width && digits[0] == '0' && digits[1] != '\0' && length > *width)
+    *width = length;
+  return true;
+}
+
+/* Parses x..y or x..y..step between braces into node. */
+static bool parse_range(const char* text, const char* quoted, size_t length,
+                        struct node* node) {
+  const char* parts[3];
+  size_t lengths[3];
+  size_t count = 0;
+  const char* start = text;
+  for (size_t i = 0; i < length; i++) {
+    if (quoted[i]) return false;
+    if (i + 1 < length && text[i] == '.' && text[i + 1] == '.') {
+      if (count == 2) return false;
+      parts[count] = start;
+      lengths[count++] = text + i - start;
+      start = text + i + 2;
+      i++;
+    }
+  }
+  if (count == 0) return false;
+  parts[count] = start;
+  lengths[count++] = text + length - start;
+
+  node->type = NODE_RANGE;
+  node->width = 0;
+  node->step = 1;
+  if (count == 3 && !parse_number(parts[2], lengths[2], &node->step, NULL))
+    return false;
+  if (node->step < 0) node->step = -node->step;
+  if (node->step == 0) node->step = 1;
+  node->letters = lengths[0] == 1 && lengths[1] == 1 &&
+                  isalpha(parts[0][0]) && isalpha(parts[1][0]);
+  if (node->letters) {
+    node->first = (unsigned char)parts[0][0];
+    node->last = (unsigned char)parts[1][0];
+    return true;
+  }
+  return parse_number(parts[0], lengths[0], &node->first, &node->width) &&
+         parse_number(parts[1], lengths[1], &node->last, &node->width);
+}
+
+static struct node* parse_chain(arena* a, const char* text, const char* quoted,
+                                size_t length);
+
+static struct node* new_node(arena* a) {
+  struct node* node = arena_alloc(a, sizeof(struct node));
+  memset(node, 0, sizeof(struct node));
+  return node;
+}
+
+/* Parses the inside of braces into a list or range node. Returns NULL if it
+ * is neither, then the braces are ordinary characters. */
+static struct node* parse_braces(arena* a, const char* text, const char* quoted,
+                                 size_t length) {
+  struct node* node = new_node(a);
+  if (parse_range(text, quoted, length, node)) return node;
+
+  size_t commas = 0;
+  int depth = 0;
+  for (size_t i = 0; i < length; i++) {
+    if (quoted[i]) continue;
+    if (text[i] == '{') depth++;
+    if (text[i] == '}') depth--;
+    if (text[i] == ',' && depth == 0) commas++;
+  }
+  if (commas == 0) return NULL;
+
+  node->type = NODE_LIST;
+  node->alternatives = arena_alloc(a, sizeof(struct node*) * (commas + 1));
+  size_t start = 0;
+  depth = 0;
+  for (size_t i = 0; i <= length; i++) {
+    if (i < length && !quoted[i]) {
+      if (text[i] == '{') depth++;
+      if (text[i] == '}') depth--;
+    }
+    if (i == length || (text[i] == ',' && !quoted[i] && depth == 0)) {
+      node->alternatives[node->count++] =
+          parse_chain(a, text + start, quoted + start, i - start);
+      start = i + 1;
+    }
+  }
+  return node;
+}
+
+/* Parses a whole word or an alternative. Empty text gives an empty text
+ * node, so every chain has at least one node. */
+static struct node* parse_chain(arena* a, const char* text, const char* quoted,
+                                size_t length) {
+  struct node* first = NULL;
+  struct node** tail = &first;
+  size_t start = 0;
+  for (size_t i = 0; i <= length; i++) {
+    struct node* braces = NULL;
+    size_t close = 0;
+    if (i < length && text[i] == '{' && !quoted[i]) {
+      close = closing_brace(text, quoted, i, length);
+      if (close != 0)
+        braces = parse_braces(a, text + i + 1, quoted + i + 1, close - i - 1);
+    }
+    if (braces == NULL && i < length) continue;
+    if (i > start || first == NULL) {
+      struct node* node = new_node(a);
+      node->type = NODE_TEXT;
+      node->text = arena_strndup(a, text + start, i - start);
+      node->quoted = arena_strndup(a, quoted + start, i - start);
+      node->length = i - start;
+      *tail = node;
+      tail = &node->next;
+    }
+    if (braces != NULL) {
+      *tail = braces;
+      tail = &braces->next;
+      i = close;
+      start = close + 1;
+    }
+  }
+  return first;
+}
+
+struct brace* brace_compile(arena* a, const char* text, const char* quoted,
+                            size_t length) {
+  struct node* first = parse_chain(a, text, quoted, length);
+  bool found = false;
+  for (struct node* node = first; node != NULL; node = node->next)
+    found |= node->type != NODE_TEXT;
+  if (!found) return NULL;
+  struct brace* brace = arena_alloc(a, sizeof(struct brace));
+  brace->first = first;
+  brace->started = false;
+  brace->done = false;
+  return brace;
+}
+
+static size_t multiply(size_t a, size_t b) {
+  return b != 0 && a > SIZE_MAX / b ? SIZE_MAX : a * b;
+}
+
+static size_t chain_count(const struct node* node) {
+  size_t count = 1;
+  for (; node != NULL; node = node->next) {
+    if (node->type == NODE_LIST) {
+      size_t sum = 0;
+      for (size_t i = 0; i < node->count; i++) {
+        size_t n = chain_count(node->alternatives[i]);
+        sum = sum + n < sum ? SIZE_MAX : sum + n;
+      }
+      count = multiply(count, sum);
+    } else if (node->type == NODE_RANGE) {
+      uint64_t distance = node->first <= node->last
+                              ? (uint64_t)node->last - node->first
+                              : (uint64_t)node->first - node->last;
+      count = multiply(count, distance / node->step + 1);
+    }
+  }
+  return count;
+}
+
+size_t brace_count(const struct brace* brace) {
+  return chain_count(brace->first);
+}
+
+static void reset(struct node* node) {
+  for (; node != NULL; node = node->next) {
+    node->current = 0;
+    node->value = node->first;
+    if (node->type == NODE_LIST) reset(node->alternatives[0]);
+  }
+}
+
+static bool advance(struct node* node);
+
+static bool advance_node(struct node* node) {
+  if (node->type == NODE_LIST) {
+    if (advance(node->alternatives[node->current])) return true;
+    if (node->current + 1 == node->count) return false;
+    reset(node->alternatives[++node->current]);
+    return true;
+  }
+  if (node->type == NODE_RANGE) {
+    bool up = node->first <= node->last;
+    if (up ? node->last - node->value < node->step
+           : node->value - node->last < node->step)
+      return false;
+    node->value += up ? node->step : -node->step;
+    return true;
+  }
+  return false;
+}
+
+/* Moves a chain to its next combination, false after the last one. */
+static bool advance(struct node* node) {
+  if (node == NULL) return false;
+  if (advance(node->next)) return true;
+  if (!advance_node(node)) return false;
+  reset(node->next);
+  return true;
+}
+
+static size_t render(const struct node* node, char* text, char* quoted,
+                     size_t length, size_t size) {
+  for (; node != NULL; node = node->next) {
+    if (node->type == NODE_TEXT) {
+      size_t n = node->length < size - length ? node->length : size - length;
+      memcpy(text + length, node->text, n);
+      memcpy(quoted + length, node->quoted, n);
+      length += n;
+    } else if (node->type == NODE_LIST) {
+      length = render(node->alternatives[node->current], text, quoted, length,
+                      size);
+    } else {
+      char number[32];
+      int n = node->letters
+                  ? sprintf(number, "%c", (char)node->value)
+                  : sprintf(number, "%0*" PRId64, node->width, node->value);
+      if (n > size - length) n = size - length;
+      memcpy(text + length, number, n);
+      memset(quoted + length, 0, n);
+      length += n;
+    }
+  }
+  return length;
+}
+
+void brace_rewind(struct brace* brace) {
+  brace->started = false;
+  brace->done = false;
+}
+
+ssize_t brace_next(struct brace* brace, char* text, char* quoted, size_t size) {
+  if (brace->done) return -1;
+  if (!brace->started) {
+    reset(brace->first);
+    brace->started = true;
+  } else if (!advance(brace->first)) {
+    brace->done = true;
+    return -1;
+  }
+  return render(brace->first, text, quoted, 0, size);
+}
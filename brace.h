@@ -0,0 +1,25 @@
+#pragma once
+#include <stddef.h>
+#include <sys/types.h>
+#include "arena.h"
+
+/* Brace expansion: a{b,c}d gives abd acd and {1..10..3} gives 1 4 7 10. The
+ * words are generated one at a time, so {1..1000000} costs nothing until
+ * they are needed. */
+
+struct brace;
+
+/* Compiles the brace expressions of a word in arena. Only characters whose
+ * quoted flag is 0 are syntax. Returns NULL if the word has none. */
+struct brace* brace_compile(arena* a, const char* text, const char* quoted,
+                            size_t length);
+
+/* Number of words the expansion gives, SIZE_MAX if it doesn't fit. */
+size_t brace_count(const struct brace* brace);
+
+/* Starts the expansion over from its first word. */
+void brace_rewind(struct brace* brace);
+
+/* Writes the next word and its quoted flags, at most size characters.
+ * Returns its length, or -1 after the last word. */
+ssize_t brace_next(struct brace* brace, char* text, char* quoted, size_t size);
@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "exports.h"
+
+static simple_map* variables;
+
+/* NAME=value strings followed by NULL */
+static char** envp;
+static size_t envp_length;
+static size_t envp_capacity;
+
+/* Inherited NAME=value strings are used as they are until reassigned */
+static char** inherited_env;
+
+static bool inherited_entry(char* entry) {
+  for (char** e = inherited_env; *e != NULL; e++)
+    if (*e == entry) return true;
+  return false;
+}
+
+static void free_entry(char* entry) {
+  if (!inherited_entry(entry)) free(entry);
+}
+
+/* Index of the entry for name, or -1. */
+static int find(const char* name) {
+  size_t length = strlen(name);
+  for (size_t i = 0; i < envp_length; i++)
+    if (envp[i][0] == name[0] && strncmp(envp[i], name, length) == 0 &&
+        envp[i][length] == '=')
+      return i;
+  return -1;
+}
+
+static char* make_entry(const char* name, const char* value) {
+  char* entry = malloc(strlen(name) + strlen(value) + 2);
+  sprintf(entry, "%s=%s", name, value);
+  return entry;
+}
+
+static void update(char* name, char* value) {
+  int i = find(name);
+  if (i < 0) return;
+  free_entry(envp[i]);
+  envp[i] = make_entry(name, value);
+}
+
+void exports_init(simple_map* map, char** inherited) {
+  variables = map;
+  variables->on_put = update;
+  inherited_env = inherited;
+  size_t count = 0;
+  while (inherited[count] != NULL) count++;
+  envp_capacity = count + 16;
+  envp = malloc(envp_capacity * sizeof(char*));
+  envp[0] = NULL;
+  for (; *inherited != NULL; inherited++) {
+    char* equals = strchr(*inherited, '=');
+    if (equals == NULL) continue;
+    char name[equals - *inherited + 1];
+    memcpy(name, *inherited, equals - *inherited);
+    name[equals - *inherited] = '\0';
+    /* A repeated name updates its first entry through the hook instead */
+    int size = simple_map_size(variables);
+    simple_map_set(variables, name, equals + 1);
+    if (simple_map_size(variables) > size) envp[envp_length++] = *inherited;
+  }
+  envp[envp_length] = NULL;
+}
+
+int exports_add(char* name) {
+  char* value = simple_map_get(variables, name);
+  if (value == NULL) return -1;
+  if (find(name) >= 0) return 0;
+  if (envp_length + 2 > envp_capacity) {
+    envp_capacity *= 2;
+    envp = realloc(envp, envp_capacity * sizeof(char*));
+  }
+  envp[envp_length++] = make_entry(name, value);
+  envp[envp_length] = NULL;
+  return 0;
+}
+
+void exports_remove(char* name) {
+  int i = find(name);
+  if (i < 0) return;
+  free_entry(envp[i]);
+  memmove(envp + i, envp + i + 1, (envp_length - i) * sizeof(char*));
+  envp_length--;
+}
+
+bool exports_contains(char* name) { return find(name) >= 0; }
+
+char** exports_envp() { return envp; }
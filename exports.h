@@ -0,0 +1,24 @@
+#pragma once
+#include <stdbool.h>
+#include "simple_map.h"
+
+/* Exported variables. Their NAME=value strings are kept in an envp array
+ * that is updated whenever an exported variable is assigned, so launching
+ * a program just passes the array to execve. The shell's own environ is
+ * never modified. */
+
+/* Imports the inherited environment into variables, every entry becomes an
+ * exported variable. Assignments to variables keep the array current. */
+void exports_init(simple_map* variables, char** inherited);
+
+/* Exports name with its current value. Returns -1 if it isn't set. */
+int exports_add(char* name);
+
+/* Stops exporting name. */
+void exports_remove(char* name);
+
+/* Whether name is exported. */
+bool exports_contains(char* name);
+
+/* NULL terminated array for execve, valid until exports change. */
+char** exports_envp();
@@ -0,0 +1,396 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "format.h"
+
+enum { PART_TEXT, PART_CONVERSION, PART_STOP, PART_INVALID };
+
+struct part {
+  int type;
+  /* PART_TEXT, with the escapes already replaced */
+  char* text;
+  size_t length;
+  /* PART_CONVERSION, spec takes the width and precision as arguments.
+   * PART_INVALID keeps the directive as written in text. */
+  char conversion;
+  char spec[16];
+  int width;     /* -1 if missing, -2 if it is taken from an argument */
+  int precision; /* the same */
+};
+
+struct format {
+  char* key;
+  struct part* parts;
+  size_t count;
+};
+
+/* Formats are cached by the hash of their text, a new one replaces
+ * whatever was in its slot */
+enum { CACHE_SLOTS = 64 };
+static struct format* cache[CACHE_SLOTS];
+
+static void grow(struct output* out, size_t needed) {
+  if (out->length + needed <= out->size) return;
+  out->size = 2 * (out->length + needed) + 64;
+  out->data = realloc(out->data, out->size);
+}
+
+static void append(struct output* out, const char* data, size_t length) {
+  grow(out, length + 1);
+  memcpy(out->data + out->length, data, length);
+  out->length += length;
+}
+
+static void append_printf(struct output* out, const char* spec, ...) {
+  while (1) {
+    size_t room = out->size - out->length;
+    va_list ap;
+    va_start(ap, spec);
+    int n = vsnprintf(out->data ? out->data + out->length : NULL, room, spec, ap);
+    va_end(ap);
+    if (n < 0) return;
+    if (n < room) {
+      out->length += n;
+      return;
+    }
+    grow(out, n + 1);
+  }
+}
+
+static void append_utf8(struct output* out, uint32_t c) {
+  char bytes[4];
+  size_t n;
+  if (c < 0x80) {
+    bytes[0] = c;
+    n = 1;
+  } else if (c < 0x800) {
+    bytes[0] = 0xc0 | c >> 6;
+    bytes[1] = 0x80 | (c & 0x3f);
+    n = 2;
+  } else if (c < 0x10000) {
+    bytes[0] = 0xe0 | c >> 12;
+    bytes[1] = 0x80 | (c >> 6 & 0x3f);
+    bytes[2] = 0x80 | (c & 0x3f);
+    n = 3;
+  } else {
+    bytes[0] = 0xf0 | (c >> 18 & 0x07);
+    bytes[1] = 0x80 | (c >> 12 & 0x3f);
+    bytes[2] = 0x80 | (c >> 6 & 0x3f);
+    bytes[3] = 0x80 | (c & 0x3f);
+    n = 4;
+  }
+  append(out, bytes, n);
+}
+
+static int digit_value(char c, int base) {
+  int value = c >= '0' && c <= '9'   ? c - '0'
+              : c >= 'a' && c <= 'f' ? c - 'a' + 10
+              : c >= 'A' && c <= 'F' ? c - 'A' + 10
+                                     : 99;
+  return value < base ? value : -1;
+}
+
+/* Reads up to max digits of base at s into value, returns how many. */
+static size_t read_digits(const char* s, int base, size_t max, uint32_t* value) {
+  size_t n = 0;
+  *value = 0;
+  for (int d; n < max && (d = digit_value(s[n], base)) >= 0; n++)
+    *value = *value * base + d;
+  return n;
+}
+
+/* Appends the character of the escape after the \ at s and returns the
+ * number of characters it used. Octal escapes of %b start with 0. Sets
+ * stop for \c. */
+static size_t escape(const char* s, bool b, struct output* out, bool* stop) {
+  static const char plain[] = "\\\\a\ab\be\033f\fn\nr\rt\tv\v\"\"''??";
+  uint32_t value;
+  size_t n;
+  for (const char* p = plain; *p; p += 2) {
+    if (*s == p[0]) {
+      append(out, p + 1, 1);
+      return 1;
+    }
+  }
+  if (*s == 'c') {
+    *stop = true;
+    return 1;
+  }
+  if (b && *s == '0') {
+    n = read_digits(s + 1, 8, 3, &value);
+    char c = value;
+    append(out, &c, 1);
+    return n + 1;
+  }
+  if (!b && (n = read_digits(s, 8, 3, &value)) > 0) {
+    char c = value;
+    append(out, &c, 1);
+    return n;
+  }
+  if (*s == 'x' && (n = read_digits(s + 1, 16, 2, &value)) > 0) {
+    char c = value;
+    append(out, &c, 1);
+    return n + 1;
+  }
+  if ((*s == 'u' || *s == 'U') &&
+      (n = read_digits(s + 1, 16, *s == 'u' ? 4 : 8, &value)) > 0) {
+    append_utf8(out, value);
+    return n + 1;
+  }
+  /* Unknown escapes are printed as they are */
+  append(out, "\\", 1);
+  return 0;
+}
+
+static void add_part(struct format* format, struct part* part) {
+  format->parts = realloc(format->parts,
+                          sizeof(struct part) * (format->count + 1));
+  format->parts[format->count++] = *part;
+}
+
+/* Ends the text collected in buffer as a part. */
+static void add_text(struct format* format, struct output* buffer) {
+  if (buffer->length == 0) return;
+  struct part part = {PART_TEXT};
+  part.text = malloc(buffer->length);
+  memcpy(part.text, buffer->data, buffer->length);
+  part.length = buffer->length;
+  add_part(format, &part);
+  buffer->length = 0;
+}
+
+/* Reads a width or precision at s into value. Returns the characters
+ * used. */
+static size_t read_number(const char* s, int* value) {
+  if (*s == '*') {
+    *value = -2;
+    return 1;
+  }
+  size_t n = 0;
+  *value = -1;
+  for (; s[n] >= '0' && s[n] <= '9'; n++)
+    *value = (*value < 0 ? 0 : *value * 10) + s[n] - '0';
+  return n;
+}
+
+static struct format* compile(const char* text) {
+  struct format* format = calloc(1, sizeof(struct format));
+  format->key = strdup(text);
+  struct output buffer = {NULL, 0, 0};
+  bool stop = false;
+  for (size_t i = 0; text[i] != '\0' && !stop;) {
+    if (text[i] == '\\' && text[i + 1] != '\0') {
+      i += 1 + escape(text + i + 1, false, &buffer, &stop);
+      continue;
+    }
+    if (text[i] != '%' || text[i + 1] == '%') {
+      append(&buffer, text + i, 1);
+      i += text[i] == '%' ? 2 : 1;
+      continue;
+    }
+    add_text(format, &buffer);
+    struct part part = {PART_CONVERSION};
+    size_t start = ++i;
+    while (text[i] != '\0' && strchr("-+ #0", text[i])) i++;
+    char flags[8];
+    snprintf(flags, sizeof(flags), "%.*s", (int)(i - start), text + start);
+    i += read_number(text + i, &part.width);
+    if (text[i] == '.') {
+      i += 1 + read_number(text + i + 1, &part.precision);
+      if (part.precision == -1) part.precision = 0;
+    } else {
+      part.precision = -1;
+    }
+    while (text[i] != '\0' && strchr("hlLjzt", text[i])) i++;
+    part.conversion = text[i];
+    if (part.conversion == '\0' ||
+        strchr("diouxXfFeEgGaAcsbq", part.conversion) == NULL) {
+      part.type = PART_INVALID;
+      part.text = strndup(text + start - 1, i - start + 1 + (text[i] != '\0'));
+      add_part(format, &part);
+      break;
+    }
+    i++;
+    const char* modifier = strchr("diouxX", part.conversion) ? "j"
+                           : strchr("csbq", part.conversion) ? ""
+                                                             : "L";
+    char conversion = strchr("csbq", part.conversion) ? 's' : part.conversion;
+    snprintf(part.spec, sizeof(part.spec), "%%%s*.*%s%c", flags, modifier,
+             conversion);
+    add_part(format, &part);
+  }
+  add_text(format, &buffer);
+  if (stop) {
+    struct part part = {PART_STOP};
+    add_part(format, &part);
+  }
+  free(buffer.data);
+  return format;
+}
+
+static void free_format(struct format* format) {
+  for (size_t i = 0; i < format->count; i++) free(format->parts[i].text);
+  free(format->parts);
+  free(format->key);
+  free(format);
+}
+
+static struct format* lookup(const char* text) {
+  uint32_t h = 2166136261u;
+  for (const char* s = text; *s; s++) h = (h ^ (unsigned char)*s) * 16777619u;
+  struct format** slot = &cache[h % CACHE_SLOTS];
+  if (*slot != NULL && strcmp((*slot)->key, text) == 0) return *slot;
+  if (*slot != NULL) free_format(*slot);
+  *slot = compile(text);
+  return *slot;
+}
+
+static void invalid_number(const char* arg, int* status) {
+  fprintf(stderr, "printf: %s: invalid number\n", arg);
+  *status = 1;
+}
+
+/* Numbers may be written like C constants, or as 'c for the code of c. */
+static intmax_t signed_argument(const char* arg, int* status) {
+  if (arg == NULL || *arg == '\0') return 0;
+  if (arg[0] == '\'' || arg[0] == '"') return (unsigned char)arg[1];
+  char* end;
+  errno = 0;
+  intmax_t value = strtoimax(arg, &end, 0);
+  if (*end != '\0' || errno != 0) invalid_number(arg, status);
+  return value;
+}
+
+static uintmax_t unsigned_argument(const char* arg, int* status) {
+  if (arg == NULL || *arg == '\0') return 0;
+  if (arg[0] == '\'' || arg[0] == '"') return (unsigned char)arg[1];
+  char* end;
+  errno = 0;
+  uintmax_t value = strtoumax(arg, &end, 0);
+  if (*end != '\0' || errno != 0) invalid_number(arg, status);
+  return value;
+}
+
+static long double float_argument(const char* arg, int* status) {
+  if (arg == NULL || *arg == '\0') return 0;
+  if (arg[0] == '\'' || arg[0] == '"') return (unsigned char)arg[1];
+  char* end;
+  errno = 0;
+  long double value = strtold(arg, &end);
+  if (*end != '\0' || errno != 0) invalid_number(arg, status);
+  return value;
+}
+
+/* Quotes arg so the shell reads it back as one word. */
+static void quote(const char* arg, struct output* out) {
+  if (*arg != '\0' && strspn(arg, "abcdefghijklmnopqrstuvwxyz"
+                                  "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                                  "0123456789_./:=,+@%^-") == strlen(arg)) {
+    append(out, arg, strlen(arg));
+    return;
+  }
+  append(out, "'", 1);
+  for (; *arg != '\0'; arg++) {
+    if (*arg == '\'')
+      append(out, "'\\''", 4);
+    else
+      append(out, arg, 1);
+  }
+  append(out, "'", 1);
+}
+
+/* Formats one conversion, returns false if \c of %b ended the output. */
+static bool convert(const struct part* part, char** args, size_t* next,
+                    struct output* out, int* status) {
+  int width = part->width < 0 ? 0 : part->width;
+  int precision = part->precision;
+  if (part->width == -2)
+    width = args[*next] ? signed_argument(args[(*next)++], status) : 0;
+  if (part->precision == -2)
+    precision = args[*next] ? signed_argument(args[(*next)++], status) : -1;
+  const char* arg = args[*next] ? args[(*next)++] : NULL;
+
+  switch (part->conversion) {
+    case 'd':
+    case 'i':
+      append_printf(out, part->spec, width, precision,
+                    signed_argument(arg, status));
+      return true;
+    case 'o':
+    case 'u':
+    case 'x':
+    case 'X':
+      append_printf(out, part->spec, width, precision,
+                    unsigned_argument(arg, status));
+      return true;
+    case 'c': {
+      char c[2] = {arg ? arg[0] : '\0', '\0'};
+      append_printf(out, part->spec, width, 1, c);
+      return true;
+    }
+    case 's':
+      append_printf(out, part->spec, width, precision, arg ? arg : "");
+      return true;
+    case 'b':
+    case 'q': {
+      struct output text = {NULL, 0, 0};
+      bool stop = false;
+      if (part->conversion == 'q') {
+        quote(arg ? arg : "", &text);
+      } else {
+        for (size_t i = 0; arg && arg[i] != '\0' && !stop;) {
+          if (arg[i] == '\\' && arg[i + 1] != '\0') {
+            i += 1 + escape(arg + i + 1, true, &text, &stop);
+          } else {
+            append(&text, arg + i, 1);
+            i++;
+          }
+        }
+      }
+      append(&text, "", 1);
+      append_printf(out, part->spec, width, precision, text.data);
+      free(text.data);
+      return !stop;
+    }
+    default:
+      append_printf(out, part->spec, width, precision,
+                    float_argument(arg, status));
+      return true;
+  }
+}
+
+int format_print(const char* text, char** args, struct output* out) {
+  struct format* format = lookup(text);
+  int status = 0;
+  size_t next = 0;
+  /* The format is used again while there are arguments left */
+  do {
+    size_t first = next;
+    for (size_t i = 0; i < format->count; i++) {
+      struct part* part = &format->parts[i];
+      if (part->type == PART_TEXT) {
+        append(out, part->text, part->length);
+      } else if (part->type == PART_STOP) {
+        return status;
+      } else if (part->type == PART_INVALID) {
+        /* The conversion is reported, not a length modifier before it */
+        if (part->conversion == '\0')
+          fprintf(stderr, "printf: %s: missing conversion character\n",
+                  part->text);
+        else
+          fprintf(stderr, "printf: %s: invalid conversion character %c\n",
+                  part->text, part->conversion);
+        return 1;
+      } else if (!convert(part, args, &next, out, &status)) {
+        return status;
+      }
+    }
+    if (next == first) break;
+  } while (args[next] != NULL);
+  return status;
+}
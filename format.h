@@ -0,0 +1,18 @@
+#pragma once
+#include <stddef.h>
+
+/* The printf builtin. Formats are compiled once into text and conversion
+ * parts and kept in a small cache keyed by the format string, so a printf
+ * in a loop only parses its format the first time. */
+
+/* Growing buffer the output is collected in, to be written at once. */
+struct output {
+  char* data;
+  size_t length;
+  size_t size;
+};
+
+/* Formats args like printf(1): backslash escapes, %b, %q, * widths and
+ * the format reused while arguments are left. Appends to out and returns
+ * 0, or 1 if an argument wasn't a valid number. */
+int format_print(const char* format, char** args, struct output* out);
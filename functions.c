@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "exports.h"
+#include "functions.h"
+#include "vector.h"
+
+/* Calls this deep are a runaway recursion, stop before the stack does */
+static const int max_depth = 4000;
+
+struct function {
+  char* name;
+  script* body;
+};
+
+/* Positional parameters of the running function, or of the shell. words
+ * are the caller's arguments until set replaces them with owned copies. */
+struct positional {
+  char** words;
+  int count;
+  char** owned;
+  struct positional* outer;
+};
+
+/* A running function, its frame lives on the C stack of function_call */
+struct call {
+  struct positional positional;
+  int saved_start; /* First entry of saved made local by this call */
+  struct call* outer;
+};
+
+/* Value a variable had before it was made local, NULL if it was unset */
+struct saved {
+  char* name;
+  char* value;
+};
+
+/* Scripts define a handful of functions, they are searched by name */
+static vector functions;
+static vector saved;
+static bool ready = false;
+
+static struct positional shell_positional = {NULL, 0, NULL, NULL};
+static struct positional* positional = &shell_positional;
+static struct call* running = NULL;
+static int depth = 0;
+static bool returning = false;
+
+static void free_function(void* elem) {
+  struct function* f = elem;
+  free(f->name);
+  script_free(f->body);
+}
+
+static void init() {
+  if (ready) return;
+  VectorNew(&functions, sizeof(struct function), free_function, 4);
+  VectorNew(&saved, sizeof(struct saved), NULL, 8);
+  ready = true;
+}
+
+static int position_of(const char* name) {
+  if (!ready) return -1;
+  for (int i = 0; i < VectorLength(&functions); i++) {
+    struct function* f = VectorNth(&functions, i);
+    if (strcmp(f->name, name) == 0) return i;
+  }
+  return -1;
+}
+
+void function_define(const char* name, script* body) {
+  init();
+  script_hold(body);
+  int i = position_of(name);
+  if (i >= 0) {
+    struct function* f = VectorNth(&functions, i);
+    script_free(f->body);
+    f->body = body;
+    return;
+  }
+  struct function f = {strdup(name), body};
+  VectorAppend(&functions, &f);
+}
+
+script* function_find(const char* name) {
+  int i = position_of(name);
+  return i < 0 ? NULL : ((struct function*)VectorNth(&functions, i))->body;
+}
+
+int function_unset(const char* name) {
+  int i = position_of(name);
+  if (i < 0) return -1;
+  VectorDelete(&functions, i);
+  return 0;
+}
+
+int functions_count() { return ready ? VectorLength(&functions) : 0; }
+
+static void free_words(char** words) {
+  for (int i = 0; words && words[i]; i++) free(words[i]);
+  free(words);
+}
+
+int function_call(script* body, char** args, simple_map* variables) {
+  if (depth >= max_depth) {
+    fprintf(stderr, "%s: maximum function nesting level exceeded (%d)\n",
+            args[0], max_depth);
+    return 1;
+  }
+  init();
+  int count = 0;
+  while (args[count + 1] != NULL) count++;
+  struct call call = {{args + 1, count, NULL, positional},
+                      VectorLength(&saved),
+                      running};
+  running = &call;
+  positional = &call.positional;
+  depth++;
+  /* The body may be redefined while it runs */
+  script_hold(body);
+  int status = script_run(body, variables, false);
+  script_free(body);
+  returning = false;
+
+  /* Locals get their outer values back, the latest saved first */
+  for (int i = VectorLength(&saved) - 1; i >= call.saved_start; i--) {
+    struct saved* s = VectorNth(&saved, i);
+    if (s->value != NULL) {
+      simple_map_set(variables, s->name, s->value);
+    } else {
+      exports_remove(s->name);
+      simple_map_remove(variables, s->name);
+    }
+    free(s->name);
+    free(s->value);
+    VectorDelete(&saved, i);
+  }
+  free_words(call.positional.owned);
+  positional = call.positional.outer;
+  running = call.outer;
+  depth--;
+  return status;
+}
+
+int function_local(simple_map* variables, const char* name) {
+  if (running == NULL) return -1;
+  for (int i = running->saved_start; i < VectorLength(&saved); i++)
+    if (strcmp(((struct saved*)VectorNth(&saved, i))->name, name) == 0)
+      return 0;
+  char* value = simple_map_get(variables, (char*)name);
+  struct saved s = {strdup(name), value ? strdup(value) : NULL};
+  VectorAppend(&saved, &s);
+  return 0;
+}
+
+int function_return() {
+  if (running == NULL) return -1;
+  returning = true;
+  return 0;
+}
+
+bool function_returning() { return returning; }
+
+const char* positional_get(int n) {
+  return n >= 1 && n <= positional->count ? positional->words[n - 1] : NULL;
+}
+
+int positional_count() { return positional->count; }
+
+int positional_shift(int n) {
+  if (n < 0 || n > positional->count) return -1;
+  positional->words += n;
+  positional->count -= n;
+  return 0;
+}
+
+void positional_set(char** words) {
+  int count = 0;
+  while (words[count] != NULL) count++;
+  char** owned = malloc(sizeof(char*) * (count + 1));
+  for (int i = 0; i < count; i++) owned[i] = strdup(words[i]);
+  owned[count] = NULL;
+  free_words(positional->owned);
+  positional->owned = owned;
+  positional->words = owned;
+  positional->count = count;
+}
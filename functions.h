@@ -0,0 +1,50 @@
+#pragma once
+#include <stdbool.h>
+#include "script.h"
+#include "simple_map.h"
+
+/* Shell functions. A body is compiled once with the script that defines it
+ * and every call runs it in the shell process, with its own positional
+ * parameters. Locals are scoped dynamically: the outer value is saved when
+ * a variable becomes local and put back when the function returns, so
+ * variables stay a single simple_map and reading one costs the same inside
+ * a function as outside. */
+
+/* Defines or replaces function name, the body is kept referenced. */
+void function_define(const char* name, script* body);
+
+/* The body of function name, or NULL. */
+script* function_find(const char* name);
+
+/* Removes function name. Returns -1 if there is no such function. */
+int function_unset(const char* name);
+
+/* How many functions are defined. */
+int functions_count();
+
+/* Calls body with args[1..] as positional parameters. Returns the status of
+ * the last command or the one given to return. */
+int function_call(script* body, char** args, simple_map* variables);
+
+/* Makes name local to the running function, saving its current value.
+ * Returns -1 outside of a function. */
+int function_local(simple_map* variables, const char* name);
+
+/* Makes the running function return after the current command. Returns -1
+ * outside of a function. */
+int function_return();
+
+/* Whether a return is leaving the running function. */
+bool function_returning();
+
+/* Positional parameter n, from 1, or NULL if it isn't set. */
+const char* positional_get(int n);
+
+/* How many positional parameters there are, $#. */
+int positional_count();
+
+/* Drops the first n positional parameters. Returns -1 if there are fewer. */
+int positional_shift(int n);
+
+/* Replaces the positional parameters with copies of words. */
+void positional_set(char** words);
@@ -0,0 +1,77 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "ipc.h"
+
+int write_all(int fd, const void* buffer, size_t length) {
+  const char* p = buffer;
+  while (length > 0) {
+    ssize_t written = write(fd, p, length);
+    if (written < 0 && errno == EINTR) continue;
+    if (written <= 0) return -1;
+    p += written;
+    length -= written;
+  }
+  return 0;
+}
+
+int read_all(int fd, void* buffer, size_t length) {
+  char* p = buffer;
+  while (length > 0) {
+    ssize_t got = read(fd, p, length);
+    if (got < 0 && errno == EINTR) continue;
+    if (got <= 0) return -1;
+    p += got;
+    length -= got;
+  }
+  return 0;
+}
+
+int send_with_fds(int sock, const void* header, size_t length, const int* fds,
+                  int count) {
+  char control[CMSG_SPACE(count * sizeof(int))];
+  memset(control, 0, sizeof(control));
+  struct iovec iov = {(void*)header, length};
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+
+  ssize_t sent;
+  do {
+    sent = sendmsg(sock, &msg, 0);
+  } while (sent < 0 && errno == EINTR);
+  return sent == (ssize_t)length ? 0 : -1;
+}
+
+int receive_with_fds(int sock, void* header, size_t length, int* fds,
+                     int count) {
+  struct iovec iov = {header, length};
+  char control[CMSG_SPACE(count * sizeof(int))];
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  ssize_t got;
+  do {
+    got = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  } while (got < 0 && errno == EINTR);
+  if (got != (ssize_t)length) return -1;
+
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(count * sizeof(int)))
+    return -1;
+  memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+  return 0;
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include <stddef.h>
+
+/* Socket helpers shared by the zygote and the command server. A message is
+ * a fixed size header sent together with descriptors, followed by a payload
+ * written with write_all. */
+
+/* Writes or reads all of buffer, retrying after signals. Return -1 on error
+ * or end of file. */
+int write_all(int fd, const void* buffer, size_t length);
+
+int read_all(int fd, void* buffer, size_t length);
+
+/* Sends header with count descriptors in one message. */
+int send_with_fds(int sock, const void* header, size_t length, const int* fds,
+                  int count);
+
+/* Receives a header of length bytes and exactly count descriptors, which
+ * are close-on-exec. */
+int receive_with_fds(int sock, void* header, size_t length, int* fds,
+                     int count);
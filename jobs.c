@@ -0,0 +1,277 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "jobs.h"
+#include "jobserver.h"
+#include "vector.h"
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+/* Process slot states besides an open pidfd */
+#define NO_PIDFD -1 /* Kernel without pidfd, process is polled */
+#define REAPED -2
+
+struct job {
+  int id;
+  size_t count;
+  size_t remaining;
+  size_t last; /* Slot of the process giving the job its status */
+  pid_t* pids;
+  int* pidfds;
+  int* statuses;
+  char* command;
+  int token; /* Jobserver token, given back when all processes exit */
+};
+
+static vector jobs;
+static int epoll_fd = -1;
+
+static void free_job(void* elem) {
+  struct job* job = elem;
+  for (size_t i = 0; i < job->count; i++)
+    if (job->pidfds[i] >= 0) close(job->pidfds[i]);
+  free(job->pids);
+  free(job->pidfds);
+  free(job->statuses);
+  free(job->command);
+}
+
+static void init_jobs() {
+  if (epoll_fd != -1) return;
+  VectorNew(&jobs, sizeof(struct job), free_job, 4);
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+}
+
+int exit_status(int wait_status) {
+  if (WIFEXITED(wait_status)) return WEXITSTATUS(wait_status);
+  if (WIFSIGNALED(wait_status)) return 128 + WTERMSIG(wait_status);
+  if (WIFSTOPPED(wait_status)) return 128 + WSTOPSIG(wait_status);
+  return wait_status;
+}
+
+/* Puts process pid in slot of job, watched through a pidfd when possible. */
+static void track(struct job* job, size_t slot, pid_t pid) {
+  job->pids[slot] = pid;
+  job->pidfds[slot] = syscall(SYS_pidfd_open, pid, 0);
+  if (job->pidfds[slot] < 0) {
+    job->pidfds[slot] = NO_PIDFD;
+    return;
+  }
+  fcntl(job->pidfds[slot], F_SETFD, FD_CLOEXEC);
+  struct epoll_event event = {EPOLLIN, {.u64 = (uint64_t)pid}};
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, job->pidfds[slot], &event);
+}
+
+int jobs_add(pid_t* pids, size_t count, const char* command, int token) {
+  init_jobs();
+  struct job job;
+  job.id = 1;
+  for (int i = 0; i < VectorLength(&jobs); i++) {
+    struct job* other = VectorNth(&jobs, i);
+    if (other->id >= job.id) job.id = other->id + 1;
+  }
+  job.count = job.remaining = count;
+  job.last = count - 1;
+  job.pids = malloc(sizeof(pid_t) * count);
+  job.pidfds = malloc(sizeof(int) * count);
+  job.statuses = calloc(count, sizeof(int));
+  job.command = strdup(command);
+  job.token = token;
+  for (size_t i = 0; i < count; i++) track(&job, i, pids[i]);
+  VectorAppend(&jobs, &job);
+  return job.id;
+}
+
+int jobs_attach(int id, pid_t* pids, size_t count) {
+  if (epoll_fd == -1) return -1;
+  for (int i = 0; i < VectorLength(&jobs); i++) {
+    struct job* job = VectorNth(&jobs, i);
+    if (job->id != id) continue;
+    size_t total = job->count + count;
+    job->pids = realloc(job->pids, sizeof(pid_t) * total);
+    job->pidfds = realloc(job->pidfds, sizeof(int) * total);
+    job->statuses = realloc(job->statuses, sizeof(int) * total);
+    for (size_t j = job->count; j < total; j++) {
+      job->statuses[j] = 0;
+      track(job, j, pids[j - job->count]);
+    }
+    job->count = total;
+    job->remaining += count;
+    return 0;
+  }
+  return -1;
+}
+
+void jobs_forget() {
+  if (epoll_fd == -1) return;
+  /* The tokens belong to the parent, which gives them back */
+  VectorDispose(&jobs);
+  close(epoll_fd);
+  epoll_fd = -1;
+}
+
+/* Finds job and slot of the process, returns job index or -1. */
+static int find_process(pid_t pid, size_t* slot) {
+  if (epoll_fd == -1) return -1;
+  for (int i = 0; i < VectorLength(&jobs); i++) {
+    struct job* job = VectorNth(&jobs, i);
+    for (size_t j = 0; j < job->count; j++) {
+      if (job->pids[j] == pid) {
+        if (slot) *slot = j;
+        return i;
+      }
+    }
+  }
+  return -1;
+}
+
+/* Reaps the process if it has exited. */
+static void reap(struct job* job, size_t slot) {
+  int status;
+  if (job->pidfds[slot] == REAPED) return;
+  pid_t got = waitpid(job->pids[slot], &status, WNOHANG);
+  if (got == 0 || (got < 0 && errno != ECHILD)) return;
+  /* A process that isn't our child can never be waited for */
+  if (got < 0) status = 127 << 8;
+  if (job->pidfds[slot] >= 0) close(job->pidfds[slot]);
+  job->pidfds[slot] = REAPED;
+  job->statuses[slot] = exit_status(status);
+  if (--job->remaining == 0) {
+    jobserver_release(job->token);
+    job->token = JOBSERVER_NONE;
+  }
+}
+
+/* Whether some process has no pidfd and must be polled. */
+static bool needs_polling() {
+  for (int i = 0; i < VectorLength(&jobs); i++) {
+    struct job* job = VectorNth(&jobs, i);
+    for (size_t j = 0; j < job->count; j++)
+      if (job->pidfds[j] == NO_PIDFD) return true;
+  }
+  return false;
+}
+
+/* Handles exits of job processes, waits up to timeout milliseconds (-1
+ * blocks) for the first one. */
+static void collect(int timeout) {
+  bool polling = false;
+  for (int i = 0; i < VectorLength(&jobs); i++) {
+    struct job* job = VectorNth(&jobs, i);
+    for (size_t j = 0; j < job->count; j++) {
+      if (job->pidfds[j] != NO_PIDFD) continue;
+      reap(job, j);
+      polling |= job->pidfds[j] == NO_PIDFD;
+    }
+  }
+  if (polling && (timeout < 0 || timeout > 20)) timeout = 20;
+
+  struct epoll_event events[16];
+  int ready = epoll_wait(epoll_fd, events, 16, timeout);
+  for (int i = 0; i < ready; i++) {
+    size_t slot;
+    int index = find_process((pid_t)events[i].data.u64, &slot);
+    if (index >= 0) reap(VectorNth(&jobs, index), slot);
+  }
+}
+
+bool jobs_contains(pid_t pid) { return find_process(pid, NULL) >= 0; }
+
+pid_t jobs_find(int id) {
+  if (epoll_fd == -1) return -1;
+  for (int i = 0; i < VectorLength(&jobs); i++) {
+    struct job* job = VectorNth(&jobs, i);
+    if (job->id == id) return job->pids[job->last];
+  }
+  return -1;
+}
+
+/* Index of a job whose processes have all exited, or -1. */
+static int find_finished() {
+  for (int i = 0; i < VectorLength(&jobs); i++)
+    if (((struct job*)VectorNth(&jobs, i))->remaining == 0) return i;
+  return -1;
+}
+
+/* Status of a job is the status of its last process. */
+static int job_status(int index) {
+  struct job* job = VectorNth(&jobs, index);
+  return job->statuses[job->last];
+}
+
+int jobs_wait_any(int* status) {
+  if (epoll_fd == -1) return -1;
+  while (VectorLength(&jobs) > 0) {
+    int index = find_finished();
+    if (index >= 0) {
+      *status = job_status(index);
+      VectorDelete(&jobs, index);
+      return 0;
+    }
+    collect(-1);
+  }
+  return -1;
+}
+
+int jobs_wait_pid(pid_t pid, int* status) {
+  size_t slot;
+  int index = find_process(pid, &slot);
+  if (index < 0) return -1;
+  struct job* job = VectorNth(&jobs, index);
+  while (job->pidfds[slot] != REAPED) {
+    collect(-1);
+    job = VectorNth(&jobs, index);
+  }
+  *status = job->statuses[slot];
+  if (job->remaining == 0) VectorDelete(&jobs, index);
+  return 0;
+}
+
+void jobs_wait_all() {
+  int status;
+  while (jobs_wait_any(&status) == 0)
+    ;
+}
+
+void jobs_notify(FILE* out) {
+  if (epoll_fd == -1 || VectorLength(&jobs) == 0) return;
+  collect(0);
+  int index;
+  while ((index = find_finished()) >= 0) {
+    struct job* job = VectorNth(&jobs, index);
+    if (out != NULL) {
+      int status = job_status(index);
+      if (status == 0)
+        fprintf(out, "[%d]+  Done                    %s\n", job->id, job->command);
+      else
+        fprintf(out, "[%d]+  Exit %-3d                %s\n", job->id, status,
+                job->command);
+    }
+    VectorDelete(&jobs, index);
+  }
+}
+
+int jobs_acquire_token() {
+  int token;
+  init_jobs();
+  while ((token = jobserver_try_acquire()) == JOBSERVER_BUSY) {
+    /* Our own jobs may be the ones holding the tokens */
+    struct pollfd fds[2] = {{jobserver_fd(), POLLIN, 0}, {epoll_fd, POLLIN, 0}};
+    poll(fds, 2, needs_polling() ? 20 : -1);
+    collect(0);
+  }
+  return token;
+}
+
+size_t jobs_count() { return epoll_fd == -1 ? 0 : VectorLength(&jobs); }
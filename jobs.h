@@ -0,0 +1,50 @@
+#pragma once
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/* Background jobs. Every process of a job is tracked with a pidfd registered
+ * in one epoll set, so finished jobs are noticed without SIGCHLD handlers and
+ * can be waited for one at a time. */
+
+/* Converts status from waitpid to an exit code, 128 + N for signal N. */
+int exit_status(int wait_status);
+
+/* Registers pipeline processes started in background, returns job id.
+ * token comes from jobs_acquire_token and is given back on reap. */
+int jobs_add(pid_t* pids, size_t count, const char* command, int token);
+
+/* Adds processes to job id that it waits for without taking their status,
+ * like the process substitutions of a background command. Returns -1 if
+ * there is no such job. */
+int jobs_attach(int id, pid_t* pids, size_t count);
+
+/* Drops all jobs without waiting for them, in a forked child whose jobs
+ * belong to its parent. */
+void jobs_forget();
+
+/* Takes a jobserver token for a background job about to start, reaping
+ * finished jobs while waiting for one. */
+int jobs_acquire_token();
+
+/* Whether pid belongs to a job that hasn't been waited for. */
+bool jobs_contains(pid_t pid);
+
+/* Pid of the last process of job with given id, or -1. */
+pid_t jobs_find(int id);
+
+/* Waits until some job finishes, returns -1 if there are no jobs. */
+int jobs_wait_any(int* status);
+
+/* Waits until the job of process pid finishes, returns -1 if unknown. */
+int jobs_wait_pid(pid_t pid, int* status);
+
+/* Waits for all jobs. */
+void jobs_wait_all();
+
+/* Collects finished jobs without blocking. Prints "Done" lines to out
+ * unless it is NULL. */
+void jobs_notify(FILE* out);
+
+/* Number of jobs that haven't been waited for. */
+size_t jobs_count();
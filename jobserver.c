@@ -0,0 +1,117 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "jobserver.h"
+
+/* Private non-blocking descriptor to read tokens and one to return them */
+static int read_fd = -1;
+static int write_fd = -1;
+static bool implicit_free = true;
+
+/* Descriptors inherited by nested makes when the shell is the server */
+static int served_fd = -1;
+
+/* Path of the fifo when the shell is the server, removed at exit */
+static char fifo_path[64];
+static char makeflags[128];
+
+static void remove_fifo() { unlink(fifo_path); }
+
+static void leave() {
+  if (read_fd >= 0) close(read_fd);
+  if (write_fd >= 0 && write_fd != read_fd) close(write_fd);
+  if (served_fd >= 0) close(served_fd);
+  read_fd = write_fd = served_fd = -1;
+}
+
+void jobserver_join(const char* flags) {
+  const char* auth = NULL;
+  /* make uses the last option when there are several */
+  for (const char* p = flags; p && (p = strstr(p, "--jobserver-")); p++) {
+    if (strncmp(p, "--jobserver-auth=", 17) == 0) auth = p + 17;
+    if (strncmp(p, "--jobserver-fds=", 16) == 0) auth = p + 16;
+  }
+  if (auth == NULL) return;
+
+  leave();
+  if (strncmp(auth, "fifo:", 5) == 0) {
+    char path[256];
+    size_t length = strcspn(auth + 5, " ");
+    if (length >= sizeof(path)) return;
+    memcpy(path, auth + 5, length);
+    path[length] = '\0';
+    read_fd = write_fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    return;
+  }
+  int r, w;
+  if (sscanf(auth, "%d,%d", &r, &w) != 2 || r < 0 || w < 0) return;
+  if (fcntl(r, F_GETFD) < 0 || fcntl(w, F_GETFD) < 0) return;
+  /* The pipe is shared with make, so it can't be made non-blocking itself.
+   * Reopening it gives a description of our own. */
+  char path[64];
+  sprintf(path, "/proc/self/fd/%d", r);
+  read_fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  write_fd = read_fd >= 0 ? w : -1;
+}
+
+const char* jobserver_serve(int jobs) {
+  if (jobs < 1) return NULL;
+  leave();
+  if (fifo_path[0] == '\0') {
+    const char* tmp = getenv("TMPDIR");
+    snprintf(fifo_path, sizeof(fifo_path), "%s/shell-jobserver.%d",
+             tmp ? tmp : "/tmp", (int)getpid());
+    atexit(remove_fifo);
+  }
+  unlink(fifo_path);
+  if (mkfifo(fifo_path, 0600) != 0) return NULL;
+  /* Nested makes inherit these two, ours reads without blocking */
+  int r = open(fifo_path, O_RDONLY | O_NONBLOCK);
+  int w = open(fifo_path, O_WRONLY);
+  read_fd = open(fifo_path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  write_fd = w;
+  served_fd = r;
+  if (r < 0 || w < 0 || read_fd < 0) {
+    leave();
+    return NULL;
+  }
+  fcntl(r, F_SETFL, 0);
+  for (int i = 1; i < jobs; i++) write(w, "+", 1);
+  snprintf(makeflags, sizeof(makeflags), " -j%d --jobserver-auth=%d,%d", jobs,
+           r, w);
+  return makeflags;
+}
+
+bool jobserver_active() { return read_fd >= 0; }
+
+bool jobserver_serving() { return served_fd >= 0; }
+
+int jobserver_fd() { return read_fd; }
+
+int jobserver_try_acquire() {
+  if (read_fd < 0) return JOBSERVER_NONE;
+  if (implicit_free) {
+    implicit_free = false;
+    return JOBSERVER_IMPLICIT;
+  }
+  unsigned char token;
+  ssize_t n;
+  while ((n = read(read_fd, &token, 1)) < 0 && errno == EINTR)
+    ;
+  return n == 1 ? token : JOBSERVER_BUSY;
+}
+
+void jobserver_release(int token) {
+  if (token == JOBSERVER_IMPLICIT) {
+    implicit_free = true;
+  } else if (token >= 0 && write_fd >= 0) {
+    unsigned char byte = token;
+    while (write(write_fd, &byte, 1) < 0 && errno == EINTR)
+      ;
+  }
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include <stdbool.h>
+
+/* GNU make jobserver. Background jobs take a token from the jobserver
+ * before they start and give it back when they are reaped, so jobs of the
+ * shell and of nested makes share one limit. Like any make job, the shell
+ * owns one implicit token that isn't in the pipe. */
+
+/* Token values besides the bytes read from the pipe */
+#define JOBSERVER_NONE -1     /* No jobserver, nothing to give back */
+#define JOBSERVER_BUSY -2     /* All tokens are taken */
+#define JOBSERVER_IMPLICIT -3 /* The shell's own token */
+
+/* Joins the jobserver described by MAKEFLAGS (--jobserver-auth=R,W or
+ * fifo:PATH), if any. */
+void jobserver_join(const char* makeflags);
+
+/* Starts a jobserver with jobs tokens in a fifo. Returns the value for
+ * MAKEFLAGS, or NULL on error. */
+const char* jobserver_serve(int jobs);
+
+bool jobserver_active();
+
+/* Whether the shell started the jobserver, its fifo is removed at exit. */
+bool jobserver_serving();
+
+/* Descriptor that becomes readable when a token may be available. */
+int jobserver_fd();
+
+/* Takes a token without blocking: a token, JOBSERVER_BUSY or
+ * JOBSERVER_NONE. */
+int jobserver_try_acquire();
+
+/* Gives back a token from jobserver_try_acquire. */
+void jobserver_release(int token);
@@ -0,0 +1,145 @@
+#define MEMSTAT_IMPLEMENTATION
+#include "memstat.h"
+
+#ifdef MEMSTAT
+#include <stdint.h>
+#include <unistd.h>
+
+#undef malloc
+#undef calloc
+#undef realloc
+#undef strdup
+#undef strndup
+#undef free
+
+#define MEMSTAT_SITES 1024
+#define MEMSTAT_MAGIC 0x6d656d73
+
+struct site {
+  const char* file;
+  int line;
+  size_t allocations;
+  size_t frees;
+  size_t live;
+  size_t peak;
+};
+
+/* Placed before every block, keeps the block 16 byte aligned. */
+struct header {
+  uint32_t magic;
+  uint32_t site;
+  size_t size;
+};
+
+static struct site sites[MEMSTAT_SITES];
+static size_t live, peak, allocations, commands;
+static pid_t owner;
+
+static void report_at_exit() {
+  /* Children forked by the shell exit too */
+  if (getpid() != owner) return;
+  fflush(stdout);
+  memstat_report(stderr);
+}
+
+static uint32_t find_site(const char* file, int line) {
+  uint32_t i = ((uintptr_t)file * 31 + line) % MEMSTAT_SITES;
+  while (sites[i].file != NULL &&
+         (sites[i].file != file || sites[i].line != line))
+    i = (i + 1) % MEMSTAT_SITES;
+  if (sites[i].file == NULL) {
+    if (owner == 0) {
+      owner = getpid();
+      atexit(report_at_exit);
+    }
+    sites[i].file = file;
+    sites[i].line = line;
+  }
+  return i;
+}
+
+static void* track(struct header* h, size_t size, uint32_t site) {
+  if (h == NULL) return NULL;
+  h->magic = MEMSTAT_MAGIC;
+  h->site = site;
+  h->size = size;
+  struct site* s = &sites[site];
+  s->allocations++;
+  s->live += size;
+  if (s->live > s->peak) s->peak = s->live;
+  allocations++;
+  live += size;
+  if (live > peak) peak = live;
+  return h + 1;
+}
+
+/* Header of a block from memstat_malloc, NULL for other blocks. */
+static struct header* untrack(void* pointer) {
+  struct header* h = (struct header*)pointer - 1;
+  if (h->magic != MEMSTAT_MAGIC) return NULL;
+  h->magic = 0;
+  sites[h->site].frees++;
+  sites[h->site].live -= h->size;
+  live -= h->size;
+  return h;
+}
+
+void* memstat_malloc(size_t size, const char* file, int line) {
+  return track(malloc(sizeof(struct header) + size), size,
+               find_site(file, line));
+}
+
+void* memstat_calloc(size_t count, size_t size, const char* file, int line) {
+  return track(calloc(1, sizeof(struct header) + count * size), count * size,
+               find_site(file, line));
+}
+
+void* memstat_realloc(void* pointer, size_t size, const char* file, int line) {
+  if (pointer == NULL) return memstat_malloc(size, file, line);
+  struct header* h = untrack(pointer);
+  if (h == NULL) return realloc(pointer, size);
+  struct header* moved = realloc(h, sizeof(struct header) + size);
+  if (moved == NULL) {
+    track(h, h->size, h->site);
+    return NULL;
+  }
+  return track(moved, size, find_site(file, line));
+}
+
+char* memstat_strdup(const char* s, const char* file, int line) {
+  return memstat_strndup(s, strlen(s), file, line);
+}
+
+char* memstat_strndup(const char* s, size_t n, const char* file, int line) {
+  size_t length = strnlen(s, n);
+  char* copy = memstat_malloc(length + 1, file, line);
+  memcpy(copy, s, length);
+  copy[length] = '\0';
+  return copy;
+}
+
+void memstat_free(void* pointer) {
+  if (pointer == NULL) return;
+  struct header* h = untrack(pointer);
+  free(h != NULL ? h : pointer);
+}
+
+void memstat_command() { commands++; }
+
+void memstat_report(FILE* out) {
+  fprintf(out, "%-20s %10s %10s %10s %10s %9s\n", "site", "allocs", "frees",
+          "live", "peak", "per cmd");
+  for (int i = 0; i < MEMSTAT_SITES; i++) {
+    struct site* s = &sites[i];
+    if (s->file == NULL || s->allocations == 0) continue;
+    char name[64];
+    snprintf(name, sizeof(name), "%s:%d", s->file, s->line);
+    fprintf(out, "%-20s %10zu %10zu %10zu %10zu %9.2f\n", name,
+            s->allocations, s->frees, s->live, s->peak,
+            commands ? (double)s->allocations / commands : 0.0);
+  }
+  fprintf(out, "total: %zu allocations, %zu bytes live, %zu bytes peak, "
+          "%zu commands\n", allocations, live, peak, commands);
+}
+
+#endif
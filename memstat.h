@@ -0,0 +1,45 @@
+#pragma once
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* Included before the sources define it */
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Allocation accounting, built with make MEMSTAT=1. Every source file then
+ * includes this header first, and malloc, calloc, realloc, strdup, strndup
+ * and free are replaced with versions counting allocations, frees, live
+ * and peak bytes for each call site. Without MEMSTAT the hooks do
+ * nothing. */
+
+#ifdef MEMSTAT
+
+void* memstat_malloc(size_t size, const char* file, int line);
+void* memstat_calloc(size_t count, size_t size, const char* file, int line);
+void* memstat_realloc(void* pointer, size_t size, const char* file, int line);
+char* memstat_strdup(const char* s, const char* file, int line);
+char* memstat_strndup(const char* s, size_t n, const char* file, int line);
+void memstat_free(void* pointer);
+
+/* Counts one more command line, for allocations per command. */
+void memstat_command();
+
+/* Prints the counters of every call site that allocated. */
+void memstat_report(FILE* out);
+
+#ifndef MEMSTAT_IMPLEMENTATION
+#undef strdup
+#undef strndup
+#define malloc(size) memstat_malloc(size, __FILE__, __LINE__)
+#define calloc(count, size) memstat_calloc(count, size, __FILE__, __LINE__)
+#define realloc(pointer, size) memstat_realloc(pointer, size, __FILE__, __LINE__)
+#define strdup(s) memstat_strdup(s, __FILE__, __LINE__)
+#define strndup(s, n) memstat_strndup(s, n, __FILE__, __LINE__)
+#define free(pointer) memstat_free(pointer)
+#endif
+
+#else
+
+#define memstat_command()
+
+#endif
@@ -0,0 +1,374 @@
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "pattern.h"
+
+enum { OP_END, OP_CHAR, OP_ANY, OP_STAR, OP_CLASS };
+
+struct op {
+  unsigned char type;
+  unsigned char c;      /* OP_CHAR */
+  unsigned short index; /* OP_CLASS, bitmap in classes */
+};
+
+/* Ops end with OP_END, class bitmaps follow them in the same allocation. */
+struct pattern {
+  size_t min_length;    /* Number of ops other than * */
+  size_t suffix;        /* Index of the OP_CHARs after the last * */
+  size_t suffix_length; /* compared before anything else */
+  bool star;
+  unsigned char (*classes)[32];
+  struct op ops[];
+};
+
+static const struct {
+  const char* name;
+  int (*test)(int);
+} named_classes[] = {
+    {"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank},
+    {"cntrl", iscntrl}, {"digit", isdigit}, {"graph", isgraph},
+    {"lower", islower}, {"print", isprint}, {"punct", ispunct},
+    {"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit},
+};
+
+static void set_bit(unsigned char* bits, unsigned char c) {
+  bits[c >> 3] |= 1 << (c & 7);
+}
+
+/* Index of the class text starts with, like "alpha:]", or -1. */
+static int named_class(const char* text, size_t length) {
+  for (int k = 0; k < sizeof(named_classes) / sizeof(named_classes[0]); k++) {
+    size_t n = strlen(named_classes[k].name);
+    if (n + 2 <= length && strncmp(text, named_classes[k].name, n) == 0 &&
+        text[n] == ':' && text[n + 1] == ']')
+      return k;
+  }
+  return -1;
+}
+
+/* Parses the bracket expression at text[i] into bits. Returns the index
+ * after its closing ], or 0 if it isn't closed. */
+static size_t parse_class(const char* text, size_t length, size_t i,
+                          unsigned char* bits) {
+  memset(bits, 0, 32);
+  i++;
+  bool negate = i < length && (text[i] == '!' || text[i] == '^');
+  if (negate) i++;
+  size_t first = i;
+  while (i < length && (text[i] != ']' || i == first)) {
+    if (text[i] == '[' && i + 1 < length && text[i + 1] == ':') {
+      int k = named_class(text + i + 2, length - i - 2);
+      if (k >= 0) {
+        for (int c = 1; c < 256; c++)
+          if (named_classes[k].test(c)) set_bit(bits, c);
+        i += strlen(named_classes[k].name) + 4;
+        continue;
+      }
+    }
+    if (text[i] == '\\' && i + 1 < length) i++;
+    unsigned char low = text[i++], high = low;
+    if (i + 1 < length && text[i] == '-' && text[i + 1] != ']') {
+      i++;
+      if (text[i] == '\\' && i + 1 < length) i++;
+      high = text[i++];
+    }
+    for (int c = low; c <= high; c++) set_bit(bits, c);
+  }
+  if (i >= length) return 0;
+  if (negate)
+    for (int k = 0; k < 32; k++) bits[k] = ~bits[k];
+  return i + 1;
+}
+
+/* Translates text into ops, or only counts them when pattern is NULL. */
+static void translate(const char* text, size_t length, struct pattern* pattern,
+                      size_t* ops, size_t* classes) {
+  unsigned char scratch[32];
+  *ops = *classes = 0;
+  for (size_t i = 0; i < length;) {
+    struct op op = {OP_CHAR, text[i], 0};
+    if (text[i] == '*') {
+      op.type = OP_STAR;
+      while (i < length && text[i] == '*') i++;
+    } else if (text[i] == '?') {
+      op.type = OP_ANY;
+      i++;
+    } else if (text[i] == '[') {
+      /* An unclosed [ has no bitmap of its own to write to */
+      size_t end = parse_class(text, length, i, scratch);
+      if (end != 0) {
+        if (pattern) memcpy(pattern->classes[*classes], scratch, 32);
+        op.type = OP_CLASS;
+        op.index = (*classes)++;
+        i = end;
+      } else {
+        i++;
+      }
+    } else if (text[i] == '\\' && i + 1 < length) {
+      op.c = text[i + 1];
+      i += 2;
+    } else {
+      i++;
+    }
+    if (pattern) pattern->ops[*ops] = op;
+    (*ops)++;
+  }
+  if (pattern) pattern->ops[*ops].type = OP_END;
+}
+
+struct pattern* pattern_compile(const char* text, size_t length) {
+  size_t ops, classes;
+  translate(text, length, NULL, &ops, &classes);
+  size_t size = sizeof(struct pattern) + sizeof(struct op) * (ops + 1);
+  size = (size + 31) & ~(size_t)31;
+  struct pattern* pattern = malloc(size + 32 * classes);
+  pattern->classes = (void*)((char*)pattern + size);
+  translate(text, length, pattern, &ops, &classes);
+
+  pattern->star = false;
+  pattern->min_length = 0;
+  pattern->suffix = 0;
+  for (size_t i = 0; i < ops; i++) {
+    if (pattern->ops[i].type == OP_STAR) pattern->star = true;
+    if (pattern->ops[i].type != OP_STAR) pattern->min_length++;
+    if (pattern->ops[i].type != OP_CHAR) pattern->suffix = i + 1;
+  }
+  pattern->suffix_length = ops - pattern->suffix;
+  if (!pattern->star) pattern->suffix_length = 0;
+  return pattern;
+}
+
+void pattern_free(struct pattern* pattern) { free(pattern); }
+
+bool pattern_is_literal(const struct pattern* pattern) {
+  for (const struct op* op = pattern->ops; op->type != OP_END; op++)
+    if (op->type != OP_CHAR) return false;
+  return true;
+}
+
+bool pattern_match(const struct pattern* pattern, const char* text,
+                   size_t length) {
+  if (length < pattern->min_length) return false;
+  if (!pattern->star && length != pattern->min_length) return false;
+  /* A literal tail like the .o of *.o rejects most names cheaply */
+  if (pattern->suffix_length > 0) {
+    const struct op* tail = pattern->ops + pattern->suffix;
+    const char* end = text + length - pattern->suffix_length;
+    for (size_t i = 0; i < pattern->suffix_length; i++)
+      if ((unsigned char)end[i] != tail[i].c) return false;
+  }
+
+  /* Backtracks only to the last *, each other op matches one character */
+  const struct op* op = pattern->ops;
+  const struct op* star = NULL;
+  size_t i = 0, star_i = 0;
+  while (i < length) {
+    unsigned char c = text[i];
+    if (op->type == OP_STAR) {
+      star = ++op;
+      star_i = i;
+      continue;
+    }
+    if ((op->type == OP_CHAR && op->c == c) || op->type == OP_ANY ||
+        (op->type == OP_CLASS &&
+         pattern->classes[op->index][c >> 3] & (1 << (c & 7)))) {
+      op++;
+      i++;
+    } else if (star != NULL) {
+      op = star;
+      i = ++star_i;
+    } else {
+      return false;
+    }
+  }
+  while (op->type == OP_STAR) op++;
+  return op->type == OP_END;
+}
+
+/* getdents64 is used directly to read directories with a large buffer and
+ * to see entry types without a stat per entry. */
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+#define DIRECTORY_BUFFER (128 * 1024)
+#define MAX_DEPTH 64
+
+struct segment {
+  struct pattern* pattern; /* NULL for literal components */
+  char* text;              /* Quoting removed when literal */
+  size_t length;
+  bool globstar;
+};
+
+struct expansion {
+  struct segment* segments;
+  size_t count;
+  char path[PATH_MAX];
+  char* matches; /* NUL separated */
+  size_t used, capacity, found;
+  char* buffers[MAX_DEPTH]; /* One per directory being read */
+};
+
+static void add_match(struct expansion* e, size_t length) {
+  if (e->used + length + 1 > e->capacity) {
+    e->capacity = (e->used + length + 1) * 2;
+    e->matches = realloc(e->matches, e->capacity);
+  }
+  memcpy(e->matches + e->used, e->path, length);
+  e->matches[e->used + length] = '\0';
+  e->used += length + 1;
+  e->found++;
+}
+
+/* Appends name and maybe a slash to the path, returns the new length or 0
+ * if it doesn't fit. */
+static size_t append(struct expansion* e, size_t length, const char* name,
+                     size_t n, bool slash) {
+  if (length + n + 2 > PATH_MAX) return 0;
+  memcpy(e->path + length, name, n);
+  length += n;
+  if (slash) e->path[length++] = '/';
+  e->path[length] = '\0';
+  return length;
+}
+
+/* Whether the entry just appended to the path is a directory. Symbolic
+ * links are followed unless recursing for **. */
+static bool is_directory(struct expansion* e, unsigned char type, bool follow) {
+  if (type == DT_DIR) return true;
+  if (type != DT_UNKNOWN && (type != DT_LNK || !follow)) return false;
+  struct stat st;
+  int flags = follow ? 0 : AT_SYMLINK_NOFOLLOW;
+  return fstatat(AT_FDCWD, e->path, &st, flags) == 0 && S_ISDIR(st.st_mode);
+}
+
+static void expand_segment(struct expansion* e, size_t length, size_t index,
+                           int depth) {
+  struct segment* s = &e->segments[index];
+  bool last = index + 1 == e->count;
+  if (s->pattern == NULL) {
+    size_t n = append(e, length, s->text, s->length, !last);
+    struct stat st;
+    if (n == 0) return;
+    if (!last)
+      expand_segment(e, n, index + 1, depth);
+    else if (fstatat(AT_FDCWD, e->path, &st, AT_SYMLINK_NOFOLLOW) == 0)
+      add_match(e, n);
+    return;
+  }
+  /* ** matching no directory at all */
+  if (s->globstar && !last) expand_segment(e, length, index + 1, depth);
+  if (depth >= MAX_DEPTH) return;
+
+  e->path[length] = '\0';
+  int dir = open(length ? e->path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir < 0) return;
+  if (e->buffers[depth] == NULL) e->buffers[depth] = malloc(DIRECTORY_BUFFER);
+  char* buffer = e->buffers[depth];
+  bool dot = s->pattern->ops[0].type == OP_CHAR && s->pattern->ops[0].c == '.';
+  long got;
+  while ((got = syscall(SYS_getdents64, dir, buffer, DIRECTORY_BUFFER)) > 0) {
+    for (long offset = 0; offset < got;) {
+      struct linux_dirent64* entry = (void*)(buffer + offset);
+      offset += entry->d_reclen;
+      const char* name = entry->d_name;
+      /* Hidden names only match a pattern starting with a dot */
+      if (name[0] == '.' && (!dot || s->globstar || name[1] == '\0' ||
+                             (name[1] == '.' && name[2] == '\0')))
+        continue;
+      size_t name_length = strlen(name);
+      if (!s->globstar && !pattern_match(s->pattern, name, name_length))
+        continue;
+      size_t n = append(e, length, name, name_length, false);
+      if (n == 0) continue;
+      if (s->globstar) {
+        if (last) add_match(e, n);
+        if (is_directory(e, entry->d_type, false))
+          expand_segment(e, append(e, n, "", 0, true), index, depth + 1);
+      } else if (last) {
+        add_match(e, n);
+      } else if (is_directory(e, entry->d_type, true)) {
+        expand_segment(e, append(e, n, "", 0, true), index + 1, depth + 1);
+      }
+    }
+  }
+  close(dir);
+}
+
+static int compare_paths(const void* a, const void* b) {
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/* Removes backslash quoting from a literal component. */
+static size_t unquote(char* text, size_t length) {
+  size_t n = 0;
+  for (size_t i = 0; i < length; i++) {
+    if (text[i] == '\\' && i + 1 < length) i++;
+    text[n++] = text[i];
+  }
+  return n;
+}
+
+size_t pattern_expand(const char* text, void (*add)(const char* path, void* data),
+                      void* data) {
+  size_t count = 1;
+  for (const char* p = text; *p; p++) count += *p == '/';
+  struct segment segments[count];
+  char copy[strlen(text) + 1];
+  strcpy(copy, text);
+
+  bool magic = false;
+  char* start = copy;
+  for (size_t i = 0; i < count; i++) {
+    char* slash = strchrnul(start, '/');
+    struct segment* s = &segments[i];
+    s->text = start;
+    s->length = slash - start;
+    s->globstar = s->length == 2 && strncmp(start, "**", 2) == 0;
+    s->pattern = pattern_compile(start, s->length);
+    if (pattern_is_literal(s->pattern)) {
+      pattern_free(s->pattern);
+      s->pattern = NULL;
+      s->length = unquote(start, s->length);
+    } else {
+      magic = true;
+    }
+    start = slash + 1;
+  }
+
+  size_t found = 0;
+  if (magic) {
+    struct expansion* e = calloc(1, sizeof(struct expansion));
+    e->segments = segments;
+    e->count = count;
+    expand_segment(e, 0, 0, 0);
+
+    char** paths = malloc(sizeof(char*) * (e->found + 1));
+    char* p = e->matches;
+    for (size_t i = 0; i < e->found; i++, p += strlen(p) + 1) paths[i] = p;
+    qsort(paths, e->found, sizeof(char*), compare_paths);
+    for (size_t i = 0; i < e->found; i++) add(paths[i], data);
+    found = e->found;
+
+    free(paths);
+    free(e->matches);
+    for (int i = 0; i < MAX_DEPTH; i++) free(e->buffers[i]);
+    free(e);
+  }
+  for (size_t i = 0; i < count; i++)
+    if (segments[i].pattern) pattern_free(segments[i].pattern);
+  return found;
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Shell patterns: *, ? and [...] with \ quoting the next character. They are
+ * compiled once and then matched without allocating. */
+
+struct pattern;
+
+/* Compiles length bytes of text. A [ without a closing ] is an ordinary
+ * character, so compiling never fails. */
+struct pattern* pattern_compile(const char* text, size_t length);
+
+void pattern_free(struct pattern* pattern);
+
+/* Whether the pattern has no *, ? or [...] and only matches its own text. */
+bool pattern_is_literal(const struct pattern* pattern);
+
+/* Whether all length bytes of text match. */
+bool pattern_match(const struct pattern* pattern, const char* text,
+                   size_t length);
+
+/* Pathname expansion of text. Calls add with every existing path matching it
+ * in sorted order and returns their number. ** as a whole component matches
+ * any number of directories. Returns 0 without touching the file system when
+ * no component is a pattern. */
+size_t pattern_expand(const char* text, void (*add)(const char* path, void* data),
+                      void* data);
@@ -0,0 +1,237 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "pipemon.h"
+
+/* A pipe counts as full above this part of its capacity */
+#define PIPEMON_FULL 0.9
+
+struct stage {
+  pid_t pid;
+  bool done;
+  int status;
+  long ticks;         /* CPU time at the previous sample */
+  double cpu;         /* Share of a CPU over the last interval */
+  double cpu_seconds; /* Total, from wait4 when the stage exits */
+  double wall;        /* Seconds from the start of monitoring to its exit */
+};
+
+struct pipe_stats {
+  int fd;
+  int capacity;
+  int bytes; /* At the last sample */
+  size_t full_samples;
+  double total_bytes;
+};
+
+int pipemon_parse(char** args, struct pipemon_options* options) {
+  options->interval_ms = 0;
+  options->live = false;
+  if (args[0] == NULL || strcmp(args[0], "pipemon") != 0) return 0;
+  options->interval_ms = 1000;
+  int i = 1;
+  for (; args[i] != NULL && args[i][0] == '-'; i++) {
+    if (strcmp(args[i], "-l") == 0) {
+      options->live = true;
+    } else if (strcmp(args[i], "-i") == 0 && args[i + 1] != NULL) {
+      char* end;
+      double seconds = strtod(args[++i], &end);
+      if (end == args[i] || *end != '\0' || !(seconds > 0 && seconds < 1e6)) {
+        fprintf(stderr, "pipemon: -i %s: interval must be a positive number "
+                        "of seconds\n", args[i]);
+        options->interval_ms = 0;
+        return -1;
+      }
+      options->interval_ms = seconds * 1000;
+      if (options->interval_ms < 1) options->interval_ms = 1;
+    } else {
+      break;
+    }
+  }
+  if (args[i] == NULL) {
+    fprintf(stderr, "pipemon: usage: pipemon [-i SECONDS] [-l] pipeline\n");
+    return -1;
+  }
+  size_t length = 0;
+  while (args[i + length] != NULL) length++;
+  memmove(args, args + i, (length + 1) * sizeof(char*));
+  return 0;
+}
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* User and system time of pid in clock ticks, or -1. */
+static long read_ticks(pid_t pid) {
+  char path[64], buffer[1024];
+  sprintf(path, "/proc/%d/stat", (int)pid);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return -1;
+  ssize_t n = read(fd, buffer, sizeof(buffer) - 1);
+  close(fd);
+  if (n <= 0) return -1;
+  buffer[n] = '\0';
+  /* The command name may contain spaces, fields are counted after it */
+  char* p = strrchr(buffer, ')');
+  unsigned long utime, stime;
+  if (p == NULL ||
+      sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+             &utime, &stime) != 2)
+    return -1;
+  return utime + stime;
+}
+
+static void sample(struct stage* stages, struct pipe_stats* pipes,
+                   size_t count, double elapsed) {
+  long hz = sysconf(_SC_CLK_TCK);
+  for (size_t i = 0; i < count; i++) {
+    if (stages[i].done) {
+      stages[i].cpu = 0;
+      continue;
+    }
+    long ticks = read_ticks(stages[i].pid);
+    if (ticks < 0) continue;
+    stages[i].cpu = elapsed > 0 ? (ticks - stages[i].ticks) / (hz * elapsed) : 0;
+    stages[i].ticks = ticks;
+  }
+  for (size_t i = 0; i + 1 < count; i++) {
+    struct pipe_stats* p = &pipes[i];
+    p->bytes = 0;
+    if (p->fd >= 0) ioctl(p->fd, FIONREAD, &p->bytes);
+    p->total_bytes += p->bytes;
+    if (p->bytes >= p->capacity * PIPEMON_FULL) p->full_samples++;
+  }
+}
+
+/* Stage that limits the pipeline: the reader of the last pipe that was
+ * full in at least half of the samples, else the first stage. */
+static size_t limiter(struct pipe_stats* pipes, size_t count, size_t samples) {
+  size_t result = 0;
+  for (size_t i = 0; i + 1 < count; i++)
+    if (samples > 0 && pipes[i].full_samples * 2 >= samples) result = i + 1;
+  return result;
+}
+
+static void stage_name(struct command* pipeline, size_t i, char* name,
+                       size_t size) {
+  char** args = command_get_cmd(pipeline, i);
+  size_t length = 0;
+  name[0] = '\0';
+  for (int j = 0; args[j] != NULL && length < size; j++)
+    length += snprintf(name + length, size - length, "%s%s", j ? " " : "",
+                       args[j]);
+}
+
+static void live_line(struct stage* stages, struct pipe_stats* pipes,
+                      size_t count, double elapsed, FILE* out) {
+  fprintf(out, "pipemon %7.1fs:", elapsed);
+  for (size_t i = 0; i < count; i++) {
+    fprintf(out, " [%zu] %3.0f%%", i + 1, stages[i].cpu * 100);
+    if (i + 1 < count)
+      fprintf(out, " |%3.0f%%|", 100.0 * pipes[i].bytes / pipes[i].capacity);
+  }
+  fprintf(out, "\n");
+}
+
+/* The CPU time of a stage includes starting it, before the monitor's
+ * clock began, so the share is taken over the stage's own run time but at
+ * least one interval. A stage that exits at once isn't shown using many
+ * CPUs then. */
+static void report(struct command* pipeline, struct stage* stages,
+                   struct pipe_stats* pipes, size_t count, size_t samples,
+                   double elapsed, double interval, FILE* out) {
+  size_t slowest = limiter(pipes, count, samples);
+  fprintf(out, "pipemon: %zu stages, %.2fs, %zu samples\n", count, elapsed,
+          samples);
+  fprintf(out, "  stage    cpu  out pipe avg  full  command\n");
+  for (size_t i = 0; i < count; i++) {
+    char name[256];
+    stage_name(pipeline, i, name, sizeof(name));
+    double wall = stages[i].wall > interval ? stages[i].wall : interval;
+    double cpu = wall > 0 ? stages[i].cpu_seconds / wall : 0;
+    fprintf(out, "%c %5zu %5.0f%%", i == slowest ? '*' : ' ', i + 1, cpu * 100);
+    if (i + 1 < count && samples > 0)
+      fprintf(out, "  %10.0fB %4.0f%%", pipes[i].total_bytes / samples,
+              100.0 * pipes[i].full_samples / samples);
+    else
+      fprintf(out, "  %11s %5s", "-", "-");
+    fprintf(out, "  %s\n", name);
+  }
+  char name[256];
+  stage_name(pipeline, slowest, name, sizeof(name));
+  fprintf(out, "pipemon: stage %zu (%s) limits the pipeline\n", slowest + 1,
+          name);
+}
+
+int pipemon_wait(struct command* pipeline, pid_t pgid, pid_t* pids,
+                 int* pipe_fds, struct pipemon_options* options, FILE* out) {
+  size_t count = pipeline->cmds_length;
+  struct stage stages[count];
+  struct pipe_stats pipes[count];
+  memset(stages, 0, sizeof(stages));
+  memset(pipes, 0, sizeof(pipes));
+  for (size_t i = 0; i < count; i++) {
+    stages[i].pid = pids[i];
+    stages[i].ticks = read_ticks(pids[i]);
+    if (stages[i].ticks < 0) stages[i].ticks = 0;
+    pipes[i].fd = i + 1 < count ? pipe_fds[i] : -1;
+    pipes[i].capacity = pipes[i].fd >= 0 ? fcntl(pipes[i].fd, F_GETPIPE_SZ) : 1;
+    if (pipes[i].capacity <= 0) pipes[i].capacity = 65536;
+  }
+
+  double start = now(), last_sample = start;
+  size_t samples = 0, remaining = count;
+  while (remaining > 0) {
+    int status;
+    struct rusage usage;
+    pid_t pid;
+    while (remaining > 0 &&
+           (pid = wait4(-pgid, &status, WNOHANG | WUNTRACED, &usage)) > 0) {
+      for (size_t i = 0; i < count; i++) {
+        if (stages[i].pid != pid || stages[i].done) continue;
+        stages[i].done = true;
+        stages[i].status = status;
+        stages[i].wall = now() - start;
+        stages[i].cpu_seconds = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+                                (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+        /* The writer must see the pipe closed once its reader is gone */
+        if (i > 0 && pipes[i - 1].fd >= 0) {
+          close(pipes[i - 1].fd);
+          pipes[i - 1].fd = -1;
+        }
+        remaining--;
+      }
+    }
+    if (remaining == 0 || (pid < 0 && errno != EINTR)) break;
+
+    double t = now();
+    if ((t - last_sample) * 1000 >= options->interval_ms) {
+      sample(stages, pipes, count, t - last_sample);
+      samples++;
+      last_sample = t;
+      if (options->live) live_line(stages, pipes, count, t - start, out);
+    }
+    int wait_ms = options->interval_ms - (int)((now() - last_sample) * 1000);
+    poll(NULL, 0, wait_ms < 1 ? 1 : wait_ms > 20 ? 20 : wait_ms);
+  }
+  for (size_t i = 0; i + 1 < count; i++)
+    if (pipes[i].fd >= 0) close(pipes[i].fd);
+
+  double elapsed = now() - start;
+  for (size_t i = 0; i < count; i++)
+    if (!stages[i].done) stages[i].wall = elapsed;
+  report(pipeline, stages, pipes, count, samples, elapsed,
+         options->interval_ms / 1000.0, out);
+  return stages[count - 1].status;
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include "tokenizer.h"
+
+/* Pipeline monitor for pipemon [-i SECONDS] [-l] pipeline. While waiting
+ * for the pipeline it samples how many bytes sit in every pipe between
+ * stages (FIONREAD) and the CPU time of every stage (/proc/PID/stat). The
+ * report names the limiting stage: the reader of the last pipe that was
+ * mostly full, or the first stage when no pipe filled up. */
+
+/* Monitoring options, interval_ms is 0 when the monitor is off. */
+struct pipemon_options {
+  int interval_ms;
+  bool live; /* Print a line for every sample */
+};
+
+/* Removes a pipemon prefix from args and fills options. Returns -1 after
+ * printing usage when no command is left, 0 otherwise. */
+int pipemon_parse(char** args, struct pipemon_options* options);
+
+/* Waits for the processes of pipeline, which run in process group pgid.
+ * pipes[i] is a close-on-exec duplicate of the read end of the pipe after
+ * stage i, it is closed once stage i + 1 exits. Returns the wait status of
+ * the last stage. */
+int pipemon_wait(struct command* pipeline, pid_t pgid, pid_t* pids,
+                 int* pipes, struct pipemon_options* options, FILE* out);
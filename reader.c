@@ -0,0 +1,232 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "reader.h"
+
+enum {
+  KIND_FILE,   /* Read ahead, the offset is moved back when closing */
+  KIND_PIPE,   /* Peeked at with tee, consumed record by record */
+  KIND_SOCKET, /* Peeked at with MSG_PEEK, consumed record by record */
+  KIND_BYTES,  /* Read a byte at a time */
+  KIND_GREEDY  /* Read ahead, whatever is left over is dropped */
+};
+
+static const size_t chunk_size = 1 << 16;
+/* Peeks start small, most records are short lines */
+static const size_t first_peek = 256;
+
+struct reader {
+  int fd;
+  int kind;
+  int timeout_ms;
+  int64_t deadline; /* In ms of CLOCK_MONOTONIC */
+  char* data;       /* Input window, data[start..end) isn't returned yet */
+  size_t start, end;
+  size_t peek;      /* How much the next peek asks for */
+  bool behind;      /* The file offset isn't at the end of the chunk */
+  bool eof;
+  char* record;
+  size_t record_size;
+};
+
+/* The chunk of the regular file read last, offset is where it starts in
+ * the file. It is reused while the file is unchanged. */
+static struct {
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  off_t size;
+  off_t offset;
+  size_t length;
+  char* data;
+} chunk;
+
+/* Private pipe that tee copies peeked input into */
+static int peek_pipe[2] = {-1, -1};
+
+static int64_t now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+struct reader* reader_open(int fd, bool greedy, int timeout_ms) {
+  struct reader* r = calloc(1, sizeof(struct reader));
+  r->fd = fd;
+  r->timeout_ms = timeout_ms;
+  r->deadline = timeout_ms >= 0 ? now_ms() + timeout_ms : 0;
+  r->peek = first_peek;
+  struct stat st;
+  off_t position;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+      (position = lseek(fd, 0, SEEK_CUR)) >= 0) {
+    r->kind = KIND_FILE;
+    bool same = chunk.data != NULL && chunk.dev == st.st_dev &&
+                chunk.ino == st.st_ino && chunk.size == st.st_size &&
+                chunk.mtime.tv_sec == st.st_mtim.tv_sec &&
+                chunk.mtime.tv_nsec == st.st_mtim.tv_nsec &&
+                position >= chunk.offset &&
+                position <= chunk.offset + (off_t)chunk.length;
+    if (chunk.data == NULL) chunk.data = malloc(chunk_size);
+    chunk.dev = st.st_dev;
+    chunk.ino = st.st_ino;
+    chunk.size = st.st_size;
+    chunk.mtime = st.st_mtim;
+    r->data = chunk.data;
+    if (same) {
+      r->start = position - chunk.offset;
+      r->end = chunk.length;
+      r->behind = r->start != r->end;
+    } else {
+      chunk.offset = position;
+      chunk.length = 0;
+    }
+    return r;
+  }
+
+  r->data = malloc(chunk_size);
+  if (greedy) {
+    r->kind = KIND_GREEDY;
+  } else if (S_ISFIFO(st.st_mode) &&
+             (peek_pipe[0] >= 0 || pipe2(peek_pipe, O_CLOEXEC) == 0)) {
+    r->kind = KIND_PIPE;
+  } else if (S_ISSOCK(st.st_mode)) {
+    r->kind = KIND_SOCKET;
+  } else {
+    r->kind = KIND_BYTES;
+  }
+  return r;
+}
+
+/* Waits until fd is readable. Returns -1 with ETIMEDOUT after the
+ * deadline. */
+static int wait_input(struct reader* r) {
+  if (r->timeout_ms < 0) return 0;
+  struct pollfd pfd = {r->fd, POLLIN, 0};
+  int64_t left = r->deadline - now_ms();
+  int ready = left > 0 ? poll(&pfd, 1, left) : poll(&pfd, 1, 0);
+  if (ready == 0) errno = ETIMEDOUT;
+  return ready > 0 ? 0 : -1;
+}
+
+/* Copies what is in the pipe into data without consuming it. */
+static ssize_t peek_at_pipe(struct reader* r) {
+  ssize_t n = tee(r->fd, peek_pipe[1], r->peek, 0);
+  if (n <= 0) return n;
+  ssize_t copied = 0;
+  while (copied < n) {
+    ssize_t got = read(peek_pipe[0], r->data + copied, n - copied);
+    if (got <= 0) return -1;
+    copied += got;
+  }
+  return n;
+}
+
+/* Refills the empty window. Returns -1 on error, sets eof at the end. */
+static int fill(struct reader* r) {
+  ssize_t n;
+  if (r->kind != KIND_FILE && wait_input(r) < 0) return -1;
+  do {
+    switch (r->kind) {
+      case KIND_FILE:
+        if (r->behind) {
+          lseek(r->fd, chunk.offset + chunk.length, SEEK_SET);
+          r->behind = false;
+        }
+        chunk.offset += chunk.length;
+        chunk.length = 0;
+        n = read(r->fd, r->data, chunk_size);
+        if (n > 0) chunk.length = n;
+        break;
+      case KIND_PIPE:
+        n = peek_at_pipe(r);
+        if (n < 0 && errno == EINVAL) { /* Not a pipe tee works on */
+          r->kind = KIND_BYTES;
+          n = read(r->fd, r->data, 1);
+        }
+        break;
+      case KIND_SOCKET:
+        n = recv(r->fd, r->data, r->peek, MSG_PEEK);
+        break;
+      case KIND_BYTES:
+        n = read(r->fd, r->data, 1);
+        break;
+      default:
+        n = read(r->fd, r->data, chunk_size);
+    }
+  } while (n < 0 && errno == EINTR);
+  if (n < 0) return -1;
+  r->start = 0;
+  r->end = n;
+  r->eof = n == 0;
+  /* A record longer than the peek is read in larger steps */
+  if (r->peek < chunk_size) r->peek *= 2;
+  return 0;
+}
+
+/* Marks n bytes of the window as used, peeked ones are read for real. */
+static int consume(struct reader* r, size_t n) {
+  if (r->kind == KIND_PIPE || r->kind == KIND_SOCKET) {
+    size_t done = 0;
+    while (done < n) {
+      ssize_t got = read(r->fd, r->data + r->start + done, n - done);
+      if (got < 0 && errno == EINTR) continue;
+      if (got <= 0) return -1;
+      done += got;
+    }
+  }
+  r->start += n;
+  return 0;
+}
+
+ssize_t reader_next(struct reader* r, int delimiter, size_t limit,
+                    char** record, bool* delimited) {
+  size_t length = 0;
+  *delimited = false;
+  r->peek = first_peek;
+  while (limit == 0 || length < limit) {
+    if (r->start == r->end) {
+      if (!r->eof && fill(r) < 0) return -2;
+      if (r->eof) break;
+    }
+    size_t available = r->end - r->start;
+    if (limit != 0 && available > limit - length) available = limit - length;
+    char* found = memchr(r->data + r->start, delimiter, available);
+    size_t take = found ? found - (r->data + r->start) : available;
+    /* Room is left for the delimiter and a NUL */
+    if (length + take + 2 > r->record_size) {
+      r->record_size = 2 * (length + take + 2);
+      r->record = realloc(r->record, r->record_size);
+    }
+    memcpy(r->record + length, r->data + r->start, take);
+    length += take;
+    if (consume(r, take + (found != NULL)) < 0) return -2;
+    if (found) {
+      *delimited = true;
+      break;
+    }
+  }
+  if (length == 0 && !*delimited && r->eof) return -1;
+  if (r->record == NULL) r->record = malloc(r->record_size = 64);
+  r->record[length] = '\0';
+  *record = r->record;
+  return length;
+}
+
+void reader_close(struct reader* r) {
+  if (r->kind == KIND_FILE) {
+    lseek(r->fd, chunk.offset + r->start, SEEK_SET);
+  } else {
+    free(r->data);
+  }
+  free(r->record);
+  free(r);
+}
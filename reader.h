@@ -0,0 +1,31 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Reads delimited records from a file descriptor for read and mapfile
+ * without taking more input than the records returned, so commands run
+ * afterwards see the rest:
+ *  - regular files are read in large chunks and the offset is moved back
+ *    after the last record. The chunk is kept for the next reader of the
+ *    same file, so reading a file line by line doesn't read it again.
+ *  - pipes are peeked at with tee(2) into a private pipe and sockets with
+ *    MSG_PEEK, then exactly the bytes of the record are consumed.
+ *  - terminals and anything else are read a byte at a time. */
+
+struct reader;
+
+/* Starts reading fd. A greedy reader may consume all the input, pipes are
+ * then read in large chunks too. timeout_ms < 0 waits forever. */
+struct reader* reader_open(int fd, bool greedy, int timeout_ms);
+
+/* Reads the next record, ending with delimiter or after limit bytes when
+ * limit isn't 0. Returns its length without the delimiter, -1 at the end of
+ * input or -2 on a timeout or error, with errno set to ETIMEDOUT for a
+ * timeout. The record stays valid until the next call and has room for
+ * one more character after it. */
+ssize_t reader_next(struct reader* r, int delimiter, size_t limit,
+                    char** record, bool* delimited);
+
+/* Gives back the input read ahead and frees the reader. */
+void reader_close(struct reader* r);
@@ -0,0 +1,216 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#include "record.h"
+
+#define TRACE_MAGIC "shtrace1"
+
+/* After the magic every entry is a sequence of variable length integers:
+ * start relative to the previous entry, wall, user and system time, status,
+ * the length of the directory plus one followed by the directory, or 0 if
+ * it is the previous one, and the length of the text followed by the
+ * text. */
+
+struct trace {
+  FILE* file;
+  uint64_t start;
+  char* cwd;
+  char* text;
+};
+
+/* The trace is written through the module's own buffer rather than stdio,
+ * whose buffers forked children would flush again when they exit. */
+static int output = -1;
+static char buffer[1 << 16];
+static size_t buffered = 0;
+static pid_t owner;
+static uint64_t previous_start = 0;
+static char previous_cwd[PATH_MAX] = "";
+
+/* State of the running command, taken by record_begin */
+static char cwd[PATH_MAX];
+static uint64_t start;
+static struct timespec started;
+static struct rusage self_before, children_before;
+
+static uint64_t microseconds(struct timeval t) {
+  return (uint64_t)t.tv_sec * 1000000 + t.tv_usec;
+}
+
+static void write_all(const char* data, size_t length) {
+  for (size_t done = 0; done < length;) {
+    ssize_t n = write(output, data + done, length - done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return;
+    done += n;
+  }
+}
+
+static void flush() {
+  write_all(buffer, buffered);
+  buffered = 0;
+}
+
+/* Entries are small, a large buffer keeps writes out of the timings */
+static void put_bytes(const void* data, size_t length) {
+  if (buffered + length > sizeof(buffer)) flush();
+  if (length > sizeof(buffer)) {
+    write_all(data, length);
+    return;
+  }
+  memcpy(buffer + buffered, data, length);
+  buffered += length;
+}
+
+static void put_number(uint64_t n) {
+  unsigned char bytes[10];
+  size_t length = 0;
+  while (n >= 0x80) {
+    bytes[length++] = (n & 0x7f) | 0x80;
+    n >>= 7;
+  }
+  bytes[length++] = n;
+  put_bytes(bytes, length);
+}
+
+static void flush_at_exit() {
+  /* Children forked by the shell exit too, only the shell owns the trace */
+  if (getpid() == owner) flush();
+}
+
+int record_open(const char* path) {
+  output = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (output < 0) return -1;
+  put_bytes(TRACE_MAGIC, sizeof(TRACE_MAGIC) - 1);
+  owner = getpid();
+  atexit(flush_at_exit);
+  return 0;
+}
+
+bool recording() { return output >= 0; }
+
+void record_begin() {
+  if (getcwd(cwd, sizeof(cwd)) == NULL) cwd[0] = '\0';
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  start = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+  getrusage(RUSAGE_SELF, &self_before);
+  getrusage(RUSAGE_CHILDREN, &children_before);
+  clock_gettime(CLOCK_MONOTONIC, &started);
+}
+
+void record_end(const char* text, int status) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  struct rusage self, children;
+  getrusage(RUSAGE_SELF, &self);
+  getrusage(RUSAGE_CHILDREN, &children);
+  uint64_t wall = (now.tv_sec - started.tv_sec) * 1000000 +
+                  (now.tv_nsec - started.tv_nsec) / 1000;
+  uint64_t user = microseconds(self.ru_utime) + microseconds(children.ru_utime) -
+                  microseconds(self_before.ru_utime) -
+                  microseconds(children_before.ru_utime);
+  uint64_t system =
+      microseconds(self.ru_stime) + microseconds(children.ru_stime) -
+      microseconds(self_before.ru_stime) - microseconds(children_before.ru_stime);
+
+  put_number(start - previous_start);
+  put_number(wall);
+  put_number(user);
+  put_number(system);
+  put_number((unsigned)status);
+  previous_start = start;
+  if (strcmp(cwd, previous_cwd) == 0) {
+    put_number(0);
+  } else {
+    size_t length = strlen(cwd);
+    put_number(length + 1);
+    put_bytes(cwd, length);
+    memcpy(previous_cwd, cwd, length + 1);
+  }
+  size_t length = strlen(text);
+  put_number(length);
+  put_bytes(text, length);
+}
+
+struct trace* trace_open(const char* path) {
+  FILE* file = fopen(path, "re");
+  if (file == NULL) return NULL;
+  char magic[sizeof(TRACE_MAGIC) - 1];
+  if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) ||
+      memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0) {
+    fclose(file);
+    return NULL;
+  }
+  struct trace* trace = calloc(1, sizeof(struct trace));
+  trace->file = file;
+  trace->cwd = strdup("");
+  return trace;
+}
+
+/* Reads a number into n. Returns 0 at the end of the trace, -1 if the
+ * number is cut short. */
+static int get_number(FILE* file, uint64_t* n, bool first) {
+  *n = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    int c = getc(file);
+    if (c == EOF) return first && shift == 0 ? 0 : -1;
+    *n |= (uint64_t)(c & 0x7f) << shift;
+    if (!(c & 0x80)) return 1;
+  }
+  return -1;
+}
+
+/* Reads length bytes into a new string. */
+static char* get_string(FILE* file, uint64_t length) {
+  if (length > INT_MAX) return NULL;
+  char* s = malloc(length + 1);
+  if (fread(s, 1, length, file) != length) {
+    free(s);
+    return NULL;
+  }
+  s[length] = '\0';
+  return s;
+}
+
+int trace_next(struct trace* trace, struct trace_entry* entry) {
+  uint64_t fields[6];
+  for (int i = 0; i < 6; i++) {
+    int got = get_number(trace->file, &fields[i], i == 0);
+    if (got <= 0) return got;
+  }
+  trace->start += fields[0];
+  entry->start = trace->start;
+  entry->wall = fields[1];
+  entry->user = fields[2];
+  entry->system = fields[3];
+  entry->status = fields[4];
+  if (fields[5] > 0) {
+    char* cwd = get_string(trace->file, fields[5] - 1);
+    if (cwd == NULL) return -1;
+    free(trace->cwd);
+    trace->cwd = cwd;
+  }
+  uint64_t length;
+  if (get_number(trace->file, &length, false) < 0) return -1;
+  char* text = get_string(trace->file, length);
+  if (text == NULL) return -1;
+  free(trace->text);
+  trace->text = text;
+  entry->cwd = trace->cwd;
+  entry->text = trace->text;
+  return 1;
+}
+
+void trace_close(struct trace* trace) {
+  fclose(trace->file);
+  free(trace->cwd);
+  free(trace->text);
+  free(trace);
+}
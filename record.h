@@ -0,0 +1,49 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Workload traces for shell --record FILE. Every command the main loop
+ * runs is appended to FILE with when it started, the directory it ran in,
+ * its exit status and how long it took, so the replay tool can run the
+ * same workload against another build and compare. Numbers are written as
+ * variable length integers and the directory only when it changed, which
+ * keeps an entry to a few bytes more than the command text. */
+
+/* One recorded command. Times are in microseconds. */
+struct trace_entry {
+  uint64_t start; /* Since the epoch */
+  uint64_t wall;
+  uint64_t user; /* CPU time of the shell and the children it waited for */
+  uint64_t system;
+  int status;
+  char* cwd;
+  char* text;
+};
+
+/* Starts recording to path, truncating it. Returns -1 if it can't be
+ * opened. */
+int record_open(const char* path);
+
+/* Whether a trace is being recorded. */
+bool recording();
+
+/* Marks the start of the command the main loop is about to run. A command
+ * that exits the shell never reaches record_end and isn't recorded. */
+void record_begin();
+
+/* Appends the command started by record_begin to the trace. */
+void record_end(const char* text, int status);
+
+/* A trace being read. */
+struct trace;
+
+/* Opens the trace at path for reading. Returns NULL if it can't be opened
+ * or isn't a trace. */
+struct trace* trace_open(const char* path);
+
+/* Reads the next entry of trace into entry, whose strings stay valid until
+ * the next call. Returns 1 for an entry, 0 at the end and -1 if the trace
+ * is truncated or corrupt. */
+int trace_next(struct trace* trace, struct trace_entry* entry);
+
+void trace_close(struct trace* trace);
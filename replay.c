@@ -0,0 +1,221 @@
+/* Replays a trace made with shell --record against a build of the shell
+ * and compares the latency of every command with the recorded one.
+ *
+ * Usage: replay [--runs N] TRACE [SHELL]
+ *
+ * The commands are fed to SHELL --norc --record, starting in the directory
+ * the trace started in, so the replay is timed by the same code as the
+ * recording. With several runs every command keeps its fastest time. */
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "record.h"
+#include "vector.h"
+
+/* A recorded command and its fastest replay */
+struct command {
+  char* text;
+  uint64_t recorded;
+  int recorded_status;
+  uint64_t replayed; /* UINT64_MAX until a run reached it */
+  int replayed_status;
+};
+
+static void free_command(void* elem) { free(((struct command*)elem)->text); }
+
+/* Reads the commands of the trace at path and the directory it started
+ * in. Returns -1 if the trace can't be read or ends in a partial entry. */
+static int load(const char* path, vector* commands, char** cwd) {
+  struct trace* trace = trace_open(path);
+  if (trace == NULL) return -1;
+  struct trace_entry entry;
+  int got;
+  while ((got = trace_next(trace, &entry)) > 0) {
+    if (*cwd == NULL) *cwd = strdup(entry.cwd);
+    struct command c = {strdup(entry.text), entry.wall, entry.status,
+                        UINT64_MAX, 0};
+    VectorAppend(commands, &c);
+  }
+  trace_close(trace);
+  return got;
+}
+
+/* Writes the commands to a temporary file for the shell to read. Returns
+ * its descriptor, or -1. */
+static int write_input(vector* commands) {
+  char path[] = "/tmp/replay.XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) return -1;
+  unlink(path);
+  FILE* file = fdopen(dup(fd), "w");
+  for (int i = 0; i < VectorLength(commands); i++) {
+    const char* text = ((struct command*)VectorNth(commands, i))->text;
+    fputs(text, file);
+    size_t length = strlen(text);
+    if (length == 0 || text[length - 1] != '\n') fputc('\n', file);
+  }
+  fclose(file);
+  return fd;
+}
+
+/* Runs the commands once through shell, keeping the fastest time of each.
+ * Returns how many commands the run recorded, or -1. */
+static int run(const char* shell, int input, vector* commands) {
+  char trace_path[] = "/tmp/replay.trace.XXXXXX";
+  int fd = mkstemp(trace_path);
+  if (fd < 0) return -1;
+  close(fd);
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    lseek(input, 0, SEEK_SET);
+    dup2(input, STDIN_FILENO);
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    execl(shell, shell, "--norc", "--record", trace_path, (char*)NULL);
+    _exit(127);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  if (WIFEXITED(status) && WEXITSTATUS(status) == 127) {
+    unlink(trace_path);
+    return -1;
+  }
+
+  struct trace* trace = trace_open(trace_path);
+  unlink(trace_path);
+  if (trace == NULL) return -1;
+  struct trace_entry entry;
+  int count = 0;
+  while (count < VectorLength(commands) && trace_next(trace, &entry) > 0) {
+    struct command* c = VectorNth(commands, count++);
+    if (entry.wall < c->replayed) {
+      c->replayed = entry.wall;
+      c->replayed_status = entry.status;
+    }
+  }
+  trace_close(trace);
+  return count;
+}
+
+/* The first line of text, cut to fit a report line */
+static void summary(const char* text, char* out, int size) {
+  int length = strcspn(text, "\n");
+  if (length >= size) {
+    length = size - 4;
+    memcpy(out + length, "...", 4);
+  } else {
+    out[length] = '\0';
+  }
+  memcpy(out, text, length);
+}
+
+static int by_value(const void* a, const void* b) {
+  int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+  return (x > y) - (x < y);
+}
+
+static void report(vector* commands, int replayed) {
+  printf("%5s %10s %10s %10s %7s  %s\n", "#", "recorded", "replayed",
+         "delta", "%", "command");
+  uint64_t recorded_total = 0, replayed_total = 0;
+  int64_t deltas[replayed > 0 ? replayed : 1];
+  int slower = 0, faster = 0, mismatches = 0;
+  for (int i = 0; i < replayed; i++) {
+    struct command* c = VectorNth(commands, i);
+    int64_t delta = (int64_t)c->replayed - (int64_t)c->recorded;
+    deltas[i] = delta;
+    recorded_total += c->recorded;
+    replayed_total += c->replayed;
+    if (delta > 0) slower++;
+    if (delta < 0) faster++;
+    bool mismatch = c->replayed_status != c->recorded_status;
+    if (mismatch) mismatches++;
+    char text[41];
+    summary(c->text, text, sizeof(text));
+    printf("%5d %10llu %10llu %+10lld %+6.1f%%  %s", i + 1,
+           (unsigned long long)c->recorded, (unsigned long long)c->replayed,
+           (long long)delta,
+           c->recorded ? 100.0 * delta / c->recorded : 0.0, text);
+    if (mismatch)
+      printf("  (status %d, was %d)", c->replayed_status, c->recorded_status);
+    putchar('\n');
+  }
+  if (replayed == 0) return;
+  qsort(deltas, replayed, sizeof(int64_t), by_value);
+  int64_t total = (int64_t)replayed_total - (int64_t)recorded_total;
+  printf("\n%d commands, times in microseconds\n", replayed);
+  printf("total:  %llu recorded, %llu replayed, %+lld (%+.1f%%)\n",
+         (unsigned long long)recorded_total,
+         (unsigned long long)replayed_total, (long long)total,
+         recorded_total ? 100.0 * total / recorded_total : 0.0);
+  printf("delta:  mean %+.1f, median %+lld, p90 %+lld, max %+lld\n",
+         (double)total / replayed, (long long)deltas[replayed / 2],
+         (long long)deltas[replayed * 9 / 10], (long long)deltas[replayed - 1]);
+  printf("%d slower, %d faster, %d with a different status\n", slower, faster,
+         mismatches);
+}
+
+int main(int argc, char* argv[]) {
+  int runs = 1;
+  int i = 1;
+  if (i + 1 < argc && strcmp(argv[i], "--runs") == 0) {
+    runs = atoi(argv[i + 1]);
+    i += 2;
+  }
+  if (i >= argc || runs < 1) {
+    fprintf(stderr, "usage: replay [--runs N] TRACE [SHELL]\n");
+    return 2;
+  }
+  const char* trace_path = argv[i];
+  /* The shell is found before moving to the directory of the trace */
+  char shell[PATH_MAX];
+  if (realpath(i + 1 < argc ? argv[i + 1] : "./shell", shell) == NULL) {
+    perror(i + 1 < argc ? argv[i + 1] : "./shell");
+    return 2;
+  }
+
+  vector commands;
+  VectorNew(&commands, sizeof(struct command), free_command, 64);
+  char* cwd = NULL;
+  int loaded = load(trace_path, &commands, &cwd);
+  if (loaded < 0 && VectorLength(&commands) == 0) {
+    fprintf(stderr, "%s: not a readable trace\n", trace_path);
+    return 1;
+  }
+  /* A shell that was killed leaves its last entries cut short */
+  if (loaded < 0)
+    fprintf(stderr, "%s: truncated, replaying the first %d commands\n",
+            trace_path, VectorLength(&commands));
+  if (cwd != NULL && chdir(cwd) != 0) perror(cwd);
+
+  int input = write_input(&commands);
+  if (input < 0) {
+    perror("replay");
+    return 1;
+  }
+  int replayed = 0;
+  for (int run_number = 0; run_number < runs; run_number++) {
+    int count = run(shell, input, &commands);
+    if (count < 0) {
+      fprintf(stderr, "%s: could not replay the trace\n", shell);
+      return 1;
+    }
+    if (count > replayed) replayed = count;
+  }
+  if (replayed < VectorLength(&commands))
+    fprintf(stderr, "replay: only %d of %d commands ran\n", replayed,
+            VectorLength(&commands));
+  report(&commands, replayed);
+
+  close(input);
+  free(cwd);
+  VectorDispose(&commands);
+  return 0;
+}
@@ -0,0 +1,1120 @@
+#include <ctype.h>
+#include <fnmatch.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arith.h"
+#include "functions.h"
+#include "script.h"
+#include "tokenizer.h"
+
+enum opcode {
+  OP_RUN,        /* status = run_split(lines[a]) */
+  OP_ARITH,      /* status = whether expression strings[a] is zero */
+  OP_STATUS,     /* status = a */
+  OP_JMP,        /* pc = a */
+  OP_JFALSE,     /* if status != 0, pc = a */
+  OP_JTRUE,      /* if status == 0, pc = a */
+  OP_LOOP_ENTER, /* push loop frame, words to iterate are strings[a] */
+  OP_LOOP_NEXT,  /* set variable strings[a] to the next word, or pc = b */
+  OP_LOOP_STORE, /* remember status of the loop body */
+  OP_LOOP_EXIT,  /* pop loop frame, status = remembered status */
+  OP_CASE_ENTER, /* push frame with expanded strings[a] as case subject */
+  OP_CASE_MATCH, /* if subject matches pattern strings[a], pc = b */
+  OP_DROP,       /* pop frame, used by break and continue and by case */
+  OP_DEFINE,     /* define function strings[a] with body bodies[b] */
+  OP_REDIRECT,   /* apply redirections strings[a] if a >= 0, or status = 1
+                    and pc = b if they fail */
+  OP_RESTORE,    /* undo the last redirections */
+  OP_UNWIND,     /* undo redirections made inside the innermost frame */
+  OP_SUBSHELL,   /* status = bodies[b] run in a subshell, redirected with
+                    strings[a] if a >= 0 */
+  OP_PIPELINE,   /* status = bodies[a] to bodies[a + b - 1] run as the
+                    stages of a pipeline */
+};
+
+struct instruction {
+  int op;
+  int a;
+  int b;
+};
+
+struct script {
+  vector code;      /* struct instruction */
+  vector strings;   /* char*, words, patterns and redirections */
+  vector lines;     /* struct split_line*, simple commands */
+  vector bodies;    /* script*, of functions and subshells */
+  int references;
+};
+
+/* Runtime state of a loop or a case command. */
+struct frame {
+  int status;
+  char** words;
+  int position;
+  char* subject;
+  int redirects; /* Redirections made before the frame */
+};
+
+enum token_type { T_WORD, T_SEP, T_DSEMI, T_AMP, T_OP, T_LPAREN, T_RPAREN, T_EOF };
+
+struct token {
+  int type;
+  int start;
+  int end;
+};
+
+/* Jump targets of a loop being compiled. */
+struct loop_labels {
+  int continue_pc;
+  int depth; /* Frame depth of the loop's own frame */
+  vector breaks;
+};
+
+typedef struct {
+  const char* text;
+  int pos;
+  struct token tok;
+  int last_type; /* Type of the token before tok */
+  script* program;
+  bool incomplete;
+  bool error;
+  int depth; /* How many frames are pushed at this point */
+  vector loops;
+} compiler;
+
+static void free_string(void* elem) { free(*(char**)elem); }
+
+static void free_line(void* elem) {
+  split_line_free(*(struct split_line**)elem);
+}
+
+static void free_body(void* elem) { script_free(*(script**)elem); }
+
+static void free_labels(void* elem) {
+  VectorDispose(&((struct loop_labels*)elem)->breaks);
+}
+
+static void free_frame(void* elem) {
+  struct frame* f = elem;
+  if (f->words) {
+    for (int i = 0; f->words[i]; i++) free(f->words[i]);
+    free(f->words);
+  }
+  free(f->subject);
+}
+
+/* Returns index after the closing quote at s[i], or -1. */
+static int scan_quote(const char* s, int i) {
+  char quote = s[i++];
+  for (; s[i]; i++) {
+    if (s[i] == '\\' && quote == '"') {
+      if (!s[++i]) return -1;
+    } else if (s[i] == quote) {
+      return i + 1;
+    }
+  }
+  return -1;
+}
+
+/* Returns index after the bracket matching s[i], or -1. */
+static int scan_group(const char* s, int i) {
+  int depth = 0;
+  for (; s[i]; i++) {
+    char c = s[i];
+    if (c == '\\') {
+      if (!s[++i]) return -1;
+    } else if (c == '\'' || c == '"') {
+      int end = scan_quote(s, i);
+      if (end < 0) return -1;
+      i = end - 1;
+    } else if (c == '(' || c == '{') {
+      depth++;
+    } else if ((c == ')' || c == '}') && --depth == 0) {
+      return i + 1;
+    }
+  }
+  return -1;
+}
+
+/* Returns index after the word starting at s[i], or -1 if it isn't finished. */
+static int scan_word(const char* s, int i) {
+  if ((s[i] == '<' || s[i] == '>') && s[i + 1] == '(') i = scan_group(s, i + 1);
+  while (i >= 0 && s[i]) {
+    char c = s[i];
+    if (c == '\\') {
+      if (!s[i + 1]) return -1;
+      i += 2;
+    } else if (c == '\'' || c == '"') {
+      i = scan_quote(s, i);
+    } else if (c == '$' && (s[i + 1] == '(' || s[i + 1] == '{')) {
+      i = scan_group(s, i + 1);
+    } else if (c == '=' && s[i + 1] == '(') { /* Array assignment */
+      i = scan_group(s, i + 1);
+    } else if (isspace(c) || strchr(";&|<>()", c)) {
+      break;
+    } else {
+      i++;
+    }
+  }
+  return i;
+}
+
+static void advance(compiler* c) {
+  const char* s = c->text;
+  int i = c->pos;
+  while (1) {
+    if (s[i] == ' ' || s[i] == '\t' || s[i] == '\r')
+      i++;
+    else if (s[i] == '\\' && s[i + 1] == '\n')
+      i += 2;
+    else if (s[i] == '#')
+      while (s[i] && s[i] != '\n') i++;
+    else
+      break;
+  }
+
+  struct token* tok = &c->tok;
+  c->last_type = tok->type;
+  tok->start = i;
+  tok->end = i + 1;
+  char ch = s[i];
+  if (ch == '\0') {
+    tok->type = T_EOF;
+    tok->end = i;
+  } else if (ch == '\n') {
+    tok->type = T_SEP;
+  } else if (ch == ';') {
+    tok->type = s[i + 1] == ';' ? T_DSEMI : T_SEP;
+    if (tok->type == T_DSEMI) tok->end++;
+  } else if (ch == '&') {
+    tok->type = s[i + 1] == '&' ? T_OP : T_AMP;
+    if (tok->type == T_OP) tok->end++;
+  } else if (ch == '|') {
+    tok->type = T_OP;
+    if (s[i + 1] == '|') tok->end++;
+  } else if (ch == '(' && s[i + 1] == '(') { /* Arithmetic ((...)) */
+    tok->type = T_WORD;
+    tok->end = scan_group(s, i);
+  } else if (ch == '(') {
+    tok->type = T_LPAREN;
+  } else if (ch == ')') {
+    tok->type = T_RPAREN;
+  } else if ((ch == '<' || ch == '>') && s[i + 1] != '(') {
+    tok->type = T_OP;
+    if (ch == '>' && s[i + 1] == '>') tok->end++;
+  } else {
+    tok->type = T_WORD;
+    tok->end = scan_word(s, i);
+  }
+
+  if (tok->end < 0) {
+    c->incomplete = true;
+    tok->type = T_EOF;
+    tok->end = i;
+  }
+  c->pos = tok->end;
+}
+
+static bool is_word(compiler* c, const char* keyword) {
+  return c->tok.type == T_WORD &&
+         c->tok.end - c->tok.start == strlen(keyword) &&
+         strncmp(c->text + c->tok.start, keyword, c->tok.end - c->tok.start) == 0;
+}
+
+static bool is_reserved(compiler* c) {
+  const char* reserved[] = {"then", "elif", "else", "fi",
+                            "do",   "done", "esac", "}"};
+  for (int i = 0; i < sizeof(reserved) / sizeof(char*); i++)
+    if (is_word(c, reserved[i])) return true;
+  return false;
+}
+
+static bool is_compound(compiler* c) {
+  return is_word(c, "if") || is_word(c, "while") || is_word(c, "until") ||
+         is_word(c, "for") || is_word(c, "case") || is_word(c, "{");
+}
+
+/* Whether the current token is && or || */
+static bool is_logical(compiler* c) {
+  const char* op = c->text + c->tok.start;
+  return c->tok.type == T_OP && (op[0] == '&' || op[0] == '|') && op[1] == op[0];
+}
+
+/* Whether the && or || at the current token is followed by a command the
+ * interpreter runs itself, a compound command, a subshell or break. */
+static bool interpreted_follows(compiler* c) {
+  compiler ahead = *c;
+  advance(&ahead);
+  while (ahead.tok.type == T_SEP && ahead.text[ahead.tok.start] == '\n')
+    advance(&ahead);
+  return is_compound(&ahead) || ahead.tok.type == T_LPAREN ||
+         is_word(&ahead, "break") || is_word(&ahead, "continue");
+}
+
+/* Whether the current token is a single | */
+static bool is_pipe(compiler* c) {
+  return c->tok.type == T_OP && c->text[c->tok.start] == '|' &&
+         c->tok.end - c->tok.start == 1;
+}
+
+/* Whether the | at the current token is followed by a compound command or
+ * a subshell, which a pipeline of simple commands can't run. */
+static bool compound_follows(compiler* c) {
+  compiler ahead = *c;
+  advance(&ahead);
+  while (ahead.tok.type == T_SEP && ahead.text[ahead.tok.start] == '\n')
+    advance(&ahead);
+  return is_compound(&ahead) || ahead.tok.type == T_LPAREN;
+}
+
+/* Reports a syntax error, or marks input as incomplete at end of text. */
+static void syntax_error(compiler* c) {
+  if (c->error) return;
+  c->error = true;
+  if (c->tok.type == T_EOF) c->incomplete = true;
+  if (!c->incomplete) fprintf(stderr, "Syntax error!\n");
+}
+
+static void expect(compiler* c, const char* keyword) {
+  if (is_word(c, keyword))
+    advance(c);
+  else
+    syntax_error(c);
+}
+
+static int emit(compiler* c, int op, int a, int b) {
+  struct instruction in = {op, a, b};
+  VectorAppend(&c->program->code, &in);
+  return VectorLength(&c->program->code) - 1;
+}
+
+static int here(compiler* c) { return VectorLength(&c->program->code); }
+
+static void patch(compiler* c, int at, int target) {
+  struct instruction* in = VectorNth(&c->program->code, at);
+  if (in->op == OP_LOOP_NEXT || in->op == OP_CASE_MATCH)
+    in->b = target;
+  else
+    in->a = target;
+}
+
+static int add_string(compiler* c, char* str) {
+  VectorAppend(&c->program->strings, &str);
+  return VectorLength(&c->program->strings) - 1;
+}
+
+static int add_text(compiler* c, int start, int end) {
+  return add_string(c, strndup(c->text + start, end - start));
+}
+
+/* Turns a shell word into an fnmatch pattern, quoted characters are
+ * escaped so they match literally. */
+static char* unquote_pattern(const char* word, int length) {
+  char* pattern = malloc(2 * length + 1);
+  int n = 0;
+  char quote = 0;
+  for (int i = 0; i < length; i++) {
+    char ch = word[i];
+    if (quote && ch == quote) {
+      quote = 0;
+    } else if (!quote && (ch == '\'' || ch == '"')) {
+      quote = ch;
+    } else if (ch == '\\' && quote != '\'' && i + 1 < length) {
+      pattern[n++] = '\\';
+      pattern[n++] = word[++i];
+    } else {
+      if (quote && strchr("*?[]\\", ch)) pattern[n++] = '\\';
+      pattern[n++] = ch;
+    }
+  }
+  pattern[n] = '\0';
+  return pattern;
+}
+
+static void compile_list(compiler* c, const char** terminators);
+
+/* First character after the current token, skipping blanks. */
+static char peek_operator(compiler* c) {
+  int i = c->tok.end;
+  while (c->text[i] == ' ' || c->text[i] == '\t') i++;
+  return c->text[i];
+}
+
+/* A lone ((...)) command is evaluated by the interpreter itself */
+static void compile_arith(compiler* c) {
+  emit(c, OP_ARITH, add_text(c, c->tok.start + 2, c->tok.end - 2), 0);
+  advance(c);
+}
+
+static void skip_separators(compiler* c) {
+  while (c->tok.type == T_SEP) advance(c);
+}
+
+/* A pipeline, or a list of them joined with && and || run as one line.
+ * The list ends before a command the interpreter runs itself, and after
+ * the first pipeline when single is set. */
+static void compile_simple(compiler* c, bool single) {
+  int start = c->tok.start;
+  int end = c->tok.end;
+  bool joined = false;
+  while (c->tok.type == T_WORD || c->tok.type == T_OP) {
+    if (is_logical(c) && (single || interpreted_follows(c))) break;
+    if (is_pipe(c) && compound_follows(c)) break;
+    end = c->tok.end;
+    joined = c->tok.type == T_OP && (c->text[c->tok.start] == '|' ||
+                                     c->text[c->tok.start] == '&');
+    advance(c);
+    /* Lines may continue after a pipe or logical operator */
+    if (joined)
+      while (c->tok.type == T_SEP && c->text[c->tok.start] == '\n') advance(c);
+  }
+  if (joined && c->tok.type == T_EOF) {
+    syntax_error(c);
+    return;
+  }
+  if (c->tok.type == T_AMP) {
+    end = c->tok.end;
+    advance(c);
+  }
+  char* text = strndup(c->text + start, end - start);
+  struct split_line* line = split_line(text);
+  free(text);
+  VectorAppend(&c->program->lines, &line);
+  emit(c, OP_RUN, VectorLength(&c->program->lines) - 1, 0);
+}
+
+/* Whether the current word is an arithmetic command ((...)) */
+static bool is_arith(compiler* c) {
+  return c->tok.type == T_WORD && c->tok.end - c->tok.start >= 4 &&
+         strncmp(c->text + c->tok.start, "((", 2) == 0 &&
+         strncmp(c->text + c->tok.end - 2, "))", 2) == 0;
+}
+
+/* The list tested by if, elif, while and until, which can't be empty */
+static void compile_condition(compiler* c, const char** terminators) {
+  int start = here(c);
+  compile_list(c, terminators);
+  if (!c->error && here(c) == start) syntax_error(c);
+}
+
+static void compile_if(compiler* c) {
+  const char* then_terminators[] = {"then", NULL};
+  const char* body_terminators[] = {"elif", "else", "fi", NULL};
+  const char* else_terminators[] = {"fi", NULL};
+  vector end_jumps;
+  VectorNew(&end_jumps, sizeof(int), NULL, 4);
+
+  advance(c);
+  compile_condition(c, then_terminators);
+  expect(c, "then");
+  int jump_false = emit(c, OP_JFALSE, -1, 0);
+  compile_list(c, body_terminators);
+  while (!c->error) {
+    int jump_end = emit(c, OP_JMP, -1, 0);
+    VectorAppend(&end_jumps, &jump_end);
+    patch(c, jump_false, here(c));
+    if (is_word(c, "elif")) {
+      advance(c);
+      compile_condition(c, then_terminators);
+      expect(c, "then");
+      jump_false = emit(c, OP_JFALSE, -1, 0);
+      compile_list(c, body_terminators);
+    } else if (is_word(c, "else")) {
+      advance(c);
+      compile_list(c, else_terminators);
+      expect(c, "fi");
+      break;
+    } else {
+      expect(c, "fi");
+      emit(c, OP_STATUS, 0, 0);
+      break;
+    }
+  }
+  for (int i = 0; i < VectorLength(&end_jumps); i++)
+    patch(c, *(int*)VectorNth(&end_jumps, i), here(c));
+  VectorDispose(&end_jumps);
+}
+
+static void begin_loop(compiler* c, int continue_pc) {
+  struct loop_labels labels;
+  labels.continue_pc = continue_pc;
+  labels.depth = c->depth;
+  VectorNew(&labels.breaks, sizeof(int), NULL, 4);
+  VectorAppend(&c->loops, &labels);
+}
+
+/* Patches break jumps of the innermost loop to the current position. */
+static void end_loop(compiler* c) {
+  struct loop_labels* labels = VectorNth(&c->loops, VectorLength(&c->loops) - 1);
+  for (int i = 0; i < VectorLength(&labels->breaks); i++)
+    patch(c, *(int*)VectorNth(&labels->breaks, i), here(c));
+  VectorDelete(&c->loops, VectorLength(&c->loops) - 1);
+}
+
+static void compile_while(compiler* c) {
+  const char* do_terminators[] = {"do", NULL};
+  const char* done_terminators[] = {"done", NULL};
+  bool until = is_word(c, "until");
+
+  advance(c);
+  emit(c, OP_LOOP_ENTER, -1, 0);
+  c->depth++;
+  int top = here(c);
+  begin_loop(c, top);
+  compile_condition(c, do_terminators);
+  expect(c, "do");
+  int jump_exit = emit(c, until ? OP_JTRUE : OP_JFALSE, -1, 0);
+  compile_list(c, done_terminators);
+  expect(c, "done");
+  emit(c, OP_LOOP_STORE, 0, 0);
+  emit(c, OP_JMP, top, 0);
+  patch(c, jump_exit, here(c));
+  end_loop(c);
+  emit(c, OP_LOOP_EXIT, 0, 0);
+  c->depth--;
+}
+
+/* for ((init; condition; step)) evaluates everything without tokenizing */
+static void compile_arith_for(compiler* c) {
+  const char* done_terminators[] = {"done", NULL};
+  int parts[3];
+  int start = c->tok.start + 2;
+  int end = c->tok.end - 2;
+  for (int i = 0; i < 3; i++) {
+    const char* separator = memchr(c->text + start, ';', end - start);
+    int part_end = i < 2 && separator ? separator - c->text : end;
+    if (i < 2 && separator == NULL) {
+      syntax_error(c);
+      return;
+    }
+    parts[i] = add_text(c, start, part_end);
+    start = part_end + 1;
+  }
+  advance(c);
+  skip_separators(c);
+  expect(c, "do");
+
+  emit(c, OP_ARITH, parts[0], 0);
+  emit(c, OP_LOOP_ENTER, -1, 0);
+  c->depth++;
+  int jump_condition = emit(c, OP_JMP, -1, 0);
+  int step = emit(c, OP_ARITH, parts[2], 0);
+  begin_loop(c, step);
+  patch(c, jump_condition, here(c));
+  emit(c, OP_ARITH, parts[1], 1);
+  int jump_exit = emit(c, OP_JFALSE, -1, 0);
+  compile_list(c, done_terminators);
+  expect(c, "done");
+  emit(c, OP_LOOP_STORE, 0, 0);
+  emit(c, OP_JMP, step, 0);
+  patch(c, jump_exit, here(c));
+  end_loop(c);
+  emit(c, OP_LOOP_EXIT, 0, 0);
+  c->depth--;
+}
+
+static void compile_for(compiler* c) {
+  const char* done_terminators[] = {"done", NULL};
+
+  advance(c);
+  if (is_arith(c)) {
+    compile_arith_for(c);
+    return;
+  }
+  if (c->tok.type != T_WORD) {
+    syntax_error(c);
+    return;
+  }
+  int name = add_text(c, c->tok.start, c->tok.end);
+  advance(c);
+
+  int words;
+  if (is_word(c, "in")) {
+    advance(c);
+    int start = c->tok.start;
+    int end = start;
+    while (c->tok.type == T_WORD) {
+      end = c->tok.end;
+      advance(c);
+    }
+    words = add_text(c, start, end);
+  } else { /* for name; iterates over the positional parameters */
+    words = add_string(c, strdup("\"$@\""));
+  }
+  skip_separators(c);
+  expect(c, "do");
+
+  emit(c, OP_LOOP_ENTER, words, 0);
+  c->depth++;
+  int top = emit(c, OP_LOOP_NEXT, name, -1);
+  begin_loop(c, top);
+  compile_list(c, done_terminators);
+  expect(c, "done");
+  emit(c, OP_LOOP_STORE, 0, 0);
+  emit(c, OP_JMP, top, 0);
+  patch(c, top, here(c));
+  end_loop(c);
+  emit(c, OP_LOOP_EXIT, 0, 0);
+  c->depth--;
+}
+
+static void compile_case(compiler* c) {
+  const char* esac_terminators[] = {"esac", NULL};
+  vector end_jumps;
+  vector body_jumps;
+  VectorNew(&end_jumps, sizeof(int), NULL, 4);
+  VectorNew(&body_jumps, sizeof(int), NULL, 4);
+
+  advance(c);
+  if (c->tok.type != T_WORD) {
+    syntax_error(c);
+    VectorDispose(&end_jumps);
+    VectorDispose(&body_jumps);
+    return;
+  }
+  emit(c, OP_CASE_ENTER, add_text(c, c->tok.start, c->tok.end), 0);
+  c->depth++;
+  advance(c);
+  skip_separators(c);
+  expect(c, "in");
+
+  while (!c->error) {
+    skip_separators(c);
+    if (is_word(c, "esac")) {
+      advance(c);
+      break;
+    }
+    if (c->tok.type == T_LPAREN) advance(c);
+    while (!c->error) { /* Patterns separated with | */
+      if (c->tok.type != T_WORD) {
+        syntax_error(c);
+        break;
+      }
+      char* pattern = unquote_pattern(c->text + c->tok.start,
+                                      c->tok.end - c->tok.start);
+      int jump_body = emit(c, OP_CASE_MATCH, add_string(c, pattern), -1);
+      VectorAppend(&body_jumps, &jump_body);
+      advance(c);
+      if (c->tok.type != T_OP || c->text[c->tok.start] != '|') break;
+      advance(c);
+    }
+    if (c->tok.type != T_RPAREN) {
+      syntax_error(c);
+      break;
+    }
+    advance(c);
+
+    int jump_next = emit(c, OP_JMP, -1, 0);
+    for (int i = 0; i < VectorLength(&body_jumps); i++)
+      patch(c, *(int*)VectorNth(&body_jumps, i), here(c));
+    VectorDispose(&body_jumps);
+    VectorNew(&body_jumps, sizeof(int), NULL, 4);
+    compile_list(c, esac_terminators);
+    int jump_end = emit(c, OP_JMP, -1, 0);
+    VectorAppend(&end_jumps, &jump_end);
+    patch(c, jump_next, here(c));
+
+    if (c->tok.type == T_DSEMI)
+      advance(c);
+    else if (!is_word(c, "esac"))
+      syntax_error(c);
+  }
+  for (int i = 0; i < VectorLength(&end_jumps); i++)
+    patch(c, *(int*)VectorNth(&end_jumps, i), here(c));
+  emit(c, OP_DROP, 0, 0);
+  c->depth--;
+  VectorDispose(&end_jumps);
+  VectorDispose(&body_jumps);
+}
+
+/* break and continue are resolved to jumps at compile time */
+static void compile_break(compiler* c) {
+  bool is_break = is_word(c, "break");
+  advance(c);
+  int count = 1;
+  if (c->tok.type == T_WORD) {
+    count = atoi(c->text + c->tok.start);
+    advance(c);
+  }
+
+  int loops = VectorLength(&c->loops);
+  if (loops == 0) {
+    fprintf(stderr, "%s: only meaningful in a loop\n",
+            is_break ? "break" : "continue");
+    return;
+  }
+  if (count < 1) count = 1;
+  if (count > loops) count = loops;
+  struct loop_labels* target = VectorNth(&c->loops, loops - count);
+
+  /* Frames of inner loops and cases are popped before jumping, and
+   * redirections made inside the loop undone */
+  for (int i = c->depth; i > target->depth; i--) emit(c, OP_DROP, 0, 0);
+  emit(c, OP_UNWIND, 0, 0);
+  if (is_break) {
+    int jump = emit(c, OP_JMP, -1, 0);
+    VectorAppend(&target->breaks, &jump);
+  } else {
+    emit(c, OP_JMP, target->continue_pc, 0);
+  }
+}
+
+static script* new_script() {
+  script* program = malloc(sizeof(script));
+  VectorNew(&program->code, sizeof(struct instruction), NULL, 16);
+  VectorNew(&program->strings, sizeof(char*), free_string, 8);
+  VectorNew(&program->lines, sizeof(struct split_line*), free_line, 8);
+  VectorNew(&program->bodies, sizeof(script*), free_body, 1);
+  program->references = 1;
+  return program;
+}
+
+/* Starts compiling text at pos into program. */
+static void compiler_init(compiler* c, const char* text, int pos,
+                          script* program) {
+  c->text = text;
+  c->pos = pos;
+  c->program = program;
+  c->incomplete = false;
+  c->error = false;
+  c->depth = 0;
+  c->tok.type = T_EOF;
+  VectorNew(&c->loops, sizeof(struct loop_labels), free_labels, 4);
+  advance(c);
+}
+
+/* Whether the current word is the name of a definition name() */
+static bool is_definition(compiler* c) {
+  int i = c->tok.end;
+  while (c->text[i] == ' ' || c->text[i] == '\t') i++;
+  if (c->tok.type != T_WORD || c->text[i++] != '(') return false;
+  while (c->text[i] == ' ' || c->text[i] == '\t') i++;
+  return c->text[i] == ')';
+}
+
+/* Compiles the list after the current token into a script of its own,
+ * up to } or, without braces, up to ). Continues after it and returns the
+ * index of the script in bodies. */
+static int compile_body(compiler* c, bool braces) {
+  const char* end_terminators[] = {"}", NULL};
+  compiler body;
+  compiler_init(&body, c->text, c->tok.end, new_script());
+  compile_list(&body, braces ? end_terminators : NULL);
+  if (braces)
+    expect(&body, "}");
+  else if (body.tok.type == T_RPAREN)
+    advance(&body);
+  else
+    syntax_error(&body);
+  VectorDispose(&body.loops);
+  VectorAppend(&c->program->bodies, &body.program);
+  c->pos = body.pos;
+  c->tok = body.tok;
+  c->last_type = body.last_type;
+  c->incomplete = body.incomplete;
+  c->error = body.error;
+  return VectorLength(&c->program->bodies) - 1;
+}
+
+/* name() { list; } or function name { list; }. The function keeps the body
+ * when the definition runs. */
+static void compile_function(compiler* c) {
+  if (is_word(c, "function")) advance(c);
+  if (c->tok.type != T_WORD || is_reserved(c)) {
+    syntax_error(c);
+    return;
+  }
+  int name = add_text(c, c->tok.start, c->tok.end);
+  advance(c);
+  if (c->tok.type == T_LPAREN) {
+    advance(c);
+    if (c->tok.type != T_RPAREN) {
+      syntax_error(c);
+      return;
+    }
+    advance(c);
+  }
+  skip_separators(c);
+  if (!is_word(c, "{")) {
+    syntax_error(c);
+    return;
+  }
+  emit(c, OP_DEFINE, name, compile_body(c, true));
+}
+
+static bool is_redirection(compiler* c) {
+  return c->tok.type == T_OP &&
+         (c->text[c->tok.start] == '<' || c->text[c->tok.start] == '>');
+}
+
+/* Redirections after a compound command are kept as text, the shell
+ * expands and opens them when the command runs. Returns -1 if there are
+ * none. */
+static int compile_redirections(compiler* c) {
+  int start = c->tok.start;
+  int end = start;
+  while (is_redirection(c)) {
+    advance(c);
+    if (c->tok.type != T_WORD) {
+      syntax_error(c);
+      return -1;
+    }
+    end = c->tok.end;
+    advance(c);
+  }
+  return end > start ? add_text(c, start, end) : -1;
+}
+
+/* { list; } runs in the shell itself */
+static void compile_group(compiler* c) {
+  const char* end_terminators[] = {"}", NULL};
+  advance(c);
+  compile_list(c, end_terminators);
+  expect(c, "}");
+}
+
+/* ( list ) is a script of its own, a forked copy of the shell runs all of
+ * it */
+static void compile_subshell(compiler* c) {
+  int body = compile_body(c, false);
+  emit(c, OP_SUBSHELL, compile_redirections(c), body);
+}
+
+/* A compound command and the redirections after it. The instruction that
+ * applies them comes first and is filled in once they are known. */
+static void compile_compound(compiler* c) {
+  int redirect = emit(c, OP_REDIRECT, -1, 0);
+  if (is_word(c, "if"))
+    compile_if(c);
+  else if (is_word(c, "while") || is_word(c, "until"))
+    compile_while(c);
+  else if (is_word(c, "for"))
+    compile_for(c);
+  else if (is_word(c, "case"))
+    compile_case(c);
+  else
+    compile_group(c);
+  int redirections = compile_redirections(c);
+  if (redirections < 0) return;
+  emit(c, OP_RESTORE, 0, 0);
+  struct instruction* in = VectorNth(&c->program->code, redirect);
+  in->a = redirections;
+  in->b = here(c);
+}
+
+static void compile_stage(compiler* c, bool single) {
+  if (is_compound(c))
+    compile_compound(c);
+  else if (c->tok.type == T_LPAREN)
+    compile_subshell(c);
+  else if (is_word(c, "break") || is_word(c, "continue"))
+    compile_break(c);
+  else if (is_word(c, "function") || is_definition(c))
+    compile_function(c);
+  else if (is_reserved(c))
+    syntax_error(c);
+  else if (is_arith(c) && !(peek_operator(c) && strchr("&|<>", peek_operator(c))))
+    compile_arith(c);
+  else if (c->tok.type == T_WORD || c->tok.type == T_OP)
+    compile_simple(c, single);
+  else
+    syntax_error(c);
+}
+
+/* Lengths of the parts of a program, to drop what was compiled after */
+struct program_mark {
+  int code;
+  int strings;
+  int lines;
+  int bodies;
+};
+
+static struct program_mark mark_program(compiler* c) {
+  script* p = c->program;
+  struct program_mark mark = {VectorLength(&p->code), VectorLength(&p->strings),
+                              VectorLength(&p->lines), VectorLength(&p->bodies)};
+  return mark;
+}
+
+static void drop_to(vector* v, int length) {
+  while (VectorLength(v) > length) VectorDelete(v, VectorLength(v) - 1);
+}
+
+/* Forgets everything compiled after mark, breaks among it too. */
+static void drop_program(compiler* c, struct program_mark mark) {
+  drop_to(&c->program->code, mark.code);
+  drop_to(&c->program->strings, mark.strings);
+  drop_to(&c->program->lines, mark.lines);
+  drop_to(&c->program->bodies, mark.bodies);
+  for (int i = 0; i < VectorLength(&c->loops); i++) {
+    vector* breaks = &((struct loop_labels*)VectorNth(&c->loops, i))->breaks;
+    for (int j = VectorLength(breaks) - 1; j >= 0; j--)
+      if (*(int*)VectorNth(breaks, j) >= mark.code) VectorDelete(breaks, j);
+  }
+}
+
+/* Compiles the text of a pipeline stage into a script of its own and
+ * returns its index in bodies. */
+static int compile_stage_body(compiler* c, int start, int end) {
+  char* text = strndup(c->text + start, end - start);
+  compiler stage;
+  compiler_init(&stage, text, 0, new_script());
+  compile_list(&stage, NULL);
+  VectorDispose(&stage.loops);
+  free(text);
+  VectorAppend(&c->program->bodies, &stage.program);
+  return VectorLength(&c->program->bodies) - 1;
+}
+
+/* A command, or a pipeline with compound commands among its stages. Such
+ * a pipeline is only noticed at its first |, then what the first stage
+ * compiled to is dropped and every stage becomes a script of its own that
+ * a forked copy of the shell runs. */
+static void compile_command(compiler* c, bool single) {
+  struct program_mark mark = mark_program(c);
+  int start = c->tok.start;
+  compile_stage(c, single);
+  if (c->error || !is_pipe(c)) return;
+  drop_program(c, mark);
+  int first = compile_stage_body(c, start, c->tok.start);
+  int count = 1;
+  while (!c->error && is_pipe(c)) {
+    advance(c);
+    while (c->tok.type == T_SEP && c->text[c->tok.start] == '\n') advance(c);
+    mark = mark_program(c);
+    start = c->tok.start;
+    compile_stage(c, true);
+    if (c->error) return;
+    drop_program(c, mark);
+    compile_stage_body(c, start, c->tok.start);
+    count++;
+  }
+  emit(c, OP_PIPELINE, first, count);
+}
+
+/* Commands joined with && and ||. A compound command or break among them
+ * turns the operators after it into jumps, simple commands before it stay
+ * one line for run_line. */
+static void compile_and_or(compiler* c) {
+  compile_command(c, false);
+  while (!c->error && is_logical(c)) {
+    bool and = c->text[c->tok.start] == '&';
+    advance(c);
+    while (c->tok.type == T_SEP && c->text[c->tok.start] == '\n') advance(c);
+    int skip = emit(c, and ? OP_JFALSE : OP_JTRUE, -1, 0);
+    compile_command(c, true);
+    patch(c, skip, here(c));
+  }
+}
+
+/* Compiles commands until one of terminators appears in command position. */
+static void compile_list(compiler* c, const char** terminators) {
+  while (!c->error) {
+    skip_separators(c);
+    if (c->tok.type == T_EOF || c->tok.type == T_RPAREN ||
+        c->tok.type == T_DSEMI)
+      return;
+    for (int i = 0; terminators && terminators[i]; i++)
+      if (is_word(c, terminators[i])) return;
+
+    compile_and_or(c);
+    if (c->error) return;
+    /* Commands follow a separator, or & which ends a background command */
+    if (c->tok.type != T_SEP && c->tok.type != T_EOF &&
+        c->tok.type != T_DSEMI && c->tok.type != T_RPAREN &&
+        c->last_type != T_AMP) {
+      syntax_error(c);
+      return;
+    }
+  }
+}
+
+script* script_compile(const char* text, bool* incomplete) {
+  compiler c;
+  compiler_init(&c, text, 0, new_script());
+  script* program = c.program;
+  compile_list(&c, NULL);
+  if (!c.error && c.tok.type != T_EOF) syntax_error(&c);
+  if (c.incomplete) c.error = true;
+  VectorDispose(&c.loops);
+
+  if (incomplete) *incomplete = c.incomplete;
+  if (c.error) {
+    script_free(program);
+    return NULL;
+  }
+  return program;
+}
+
+/* Whether the command was killed with Ctrl-C, the script stops then. */
+static bool interrupted(int status) { return status == 128 + SIGINT; }
+
+static char* string_at(script* program, int index) {
+  return *(char**)VectorNth(&program->strings, index);
+}
+
+static struct frame* top_frame(vector* frames) {
+  return VectorNth(frames, VectorLength(frames) - 1);
+}
+
+/* Whether nothing but the end of the script follows the instruction
+ * before pc, also through a jump over an else branch. */
+static bool at_end(script* program, int pc) {
+  int length = VectorLength(&program->code);
+  if (pc == length) return true;
+  struct instruction* next = VectorNth(&program->code, pc);
+  return next->op == OP_JMP && next->a == length;
+}
+
+/* Undoes redirections until only count of them are left. */
+static void unwind(vector* redirects, int count) {
+  for (int i = VectorLength(redirects) - 1; i >= count; i--) {
+    redirect_restore(VectorNth(redirects, i));
+    VectorDelete(redirects, i);
+  }
+}
+
+int script_run(script* program, simple_map* variables, bool final) {
+  vector frames;
+  vector redirects;
+  VectorNew(&frames, sizeof(struct frame), free_frame, 4);
+  VectorNew(&redirects, sizeof(struct redirection), NULL, 2);
+  int status = 0;
+  int length = VectorLength(&program->code);
+
+  for (int pc = 0; pc < length;) {
+    struct instruction* in = VectorNth(&program->code, pc++);
+    struct split_line* line;
+    switch (in->op) {
+      case OP_RUN:
+        line = *(struct split_line**)VectorNth(&program->lines, in->a);
+        if (final && at_end(program, pc))
+          status = run_final_line(line);
+        else
+          status = run_split(line);
+        if (interrupted(status) || function_returning()) pc = length;
+        break;
+      case OP_ARITH: {
+        /* b is set when an empty expression means true, as in for ((;;)) */
+        char* expr = string_at(program, in->a);
+        int64_t value = in->b;
+        if (arith_eval(expr, strlen(expr), variables, &value) < 0)
+          status = 1;
+        else
+          status = value == 0;
+        save_last_status(status);
+        break;
+      }
+      case OP_STATUS:
+        status = in->a;
+        save_last_status(status);
+        break;
+      case OP_JMP:
+        pc = in->a;
+        break;
+      case OP_JFALSE:
+        if (status != 0) pc = in->a;
+        break;
+      case OP_JTRUE:
+        if (status == 0) pc = in->a;
+        break;
+      case OP_LOOP_ENTER: {
+        struct frame f = {0, NULL, 0, NULL, VectorLength(&redirects)};
+        if (in->a >= 0) {
+          f.words = expand_words(string_at(program, in->a), variables);
+          if (f.words == NULL) f.words = calloc(1, sizeof(char*));
+        }
+        VectorAppend(&frames, &f);
+        break;
+      }
+      case OP_LOOP_NEXT: {
+        struct frame* f = top_frame(&frames);
+        char* word = f->words[f->position];
+        if (word == NULL) {
+          pc = in->b;
+        } else {
+          simple_map_set(variables, string_at(program, in->a), word);
+          f->position++;
+        }
+        break;
+      }
+      case OP_LOOP_STORE:
+        top_frame(&frames)->status = status;
+        break;
+      case OP_LOOP_EXIT:
+        status = top_frame(&frames)->status;
+        save_last_status(status);
+        VectorDelete(&frames, VectorLength(&frames) - 1);
+        break;
+      case OP_CASE_ENTER: {
+        struct frame f = {0, NULL, 0, NULL, VectorLength(&redirects)};
+        char** words = expand_words(string_at(program, in->a), variables);
+        f.subject = strdup(words && words[0] ? words[0] : "");
+        for (int i = 0; words && words[i]; i++) free(words[i]);
+        free(words);
+        VectorAppend(&frames, &f);
+        status = 0;
+        save_last_status(status);
+        break;
+      }
+      case OP_CASE_MATCH:
+        if (fnmatch(string_at(program, in->a), top_frame(&frames)->subject,
+                    0) == 0)
+          pc = in->b;
+        break;
+      case OP_DROP:
+        VectorDelete(&frames, VectorLength(&frames) - 1);
+        break;
+      case OP_DEFINE:
+        function_define(string_at(program, in->a),
+                        *(script**)VectorNth(&program->bodies, in->b));
+        status = 0;
+        save_last_status(status);
+        break;
+      case OP_REDIRECT: {
+        struct redirection r;
+        if (in->a < 0) break;
+        if (redirect_apply(string_at(program, in->a), &r) < 0) {
+          status = 1;
+          pc = in->b;
+        } else {
+          VectorAppend(&redirects, &r);
+        }
+        break;
+      }
+      case OP_RESTORE:
+        unwind(&redirects, VectorLength(&redirects) - 1);
+        break;
+      case OP_UNWIND:
+        unwind(&redirects, top_frame(&frames)->redirects);
+        break;
+      case OP_SUBSHELL:
+        status = run_subshell(*(script**)VectorNth(&program->bodies, in->b),
+                              in->a >= 0 ? string_at(program, in->a) : NULL);
+        if (interrupted(status)) pc = length;
+        break;
+      case OP_PIPELINE:
+        status = run_pipeline(VectorNth(&program->bodies, in->a), in->b);
+        if (interrupted(status)) pc = length;
+        break;
+    }
+  }
+  /* A return may leave a redirected command early */
+  unwind(&redirects, 0);
+  VectorDispose(&redirects);
+  VectorDispose(&frames);
+  return status;
+}
+
+void script_hold(script* program) { program->references++; }
+
+void script_free(script* program) {
+  if (program == NULL || --program->references > 0) return;
+  VectorDispose(&program->code);
+  VectorDispose(&program->strings);
+  VectorDispose(&program->lines);
+  VectorDispose(&program->bodies);
+  free(program);
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include <stdbool.h>
+#include <sys/types.h>
+#include "simple_map.h"
+
+/* A shell script compiled into bytecode. Control flow (if, while, until, for,
+ * case, break and continue) becomes jumps, simple commands are split into
+ * words and operators once and handed to run_split(), so a loop only
+ * expands their words again.
+ * Bodies of functions and subshells are compiled into scripts of their own,
+ * { list; } and the other compound commands are redirected in the shell.
+ * So is every stage of a pipeline that has a compound command. */
+typedef struct script script;
+
+struct split_line;
+
+/* Sets $? to status, implemented by the shell. */
+void save_last_status(int status);
+
+/* Runs one simple command line, implemented by the shell. */
+int run_line(const char* text);
+
+/* Runs a line split when the script was compiled, implemented by the
+ * shell. */
+int run_split(struct split_line* line);
+
+/* Runs the line that ends a final script, see script_run. The shell may
+ * execute the command in its own place. */
+int run_final_line(struct split_line* line);
+
+/* Descriptors replaced by the redirections of a compound command and the
+ * process substitutions started for them */
+struct redirection {
+  int saved[2];
+  pid_t* procsubs;
+  size_t procsubs_length;
+};
+
+/* Applies redirections like "> file < <(list)" to the shell's standard
+ * input and output, implemented by the shell. Returns -1 if a file can't
+ * be opened. */
+int redirect_apply(const char* text, struct redirection* r);
+
+/* Puts back the descriptors replaced by redirect_apply and waits for its
+ * process substitutions. */
+void redirect_restore(struct redirection* r);
+
+/* Runs body in a forked copy of the shell, with redirections applied there
+ * when they aren't NULL, and returns its status. Implemented by the shell. */
+int run_subshell(script* body, const char* redirections);
+
+/* Runs count scripts as the stages of a pipeline, each in a forked copy of
+ * the shell, and returns the status of the last. Implemented by the
+ * shell. */
+int run_pipeline(script** stages, int count);
+
+/* Compiles text, returns NULL on syntax error. When the text ends in the
+ * middle of a compound command, incomplete is set and nothing is printed. */
+script* script_compile(const char* text, bool* incomplete);
+
+/* Executes compiled script and returns status of the last command. A final
+ * script is the last thing the shell runs before it exits. */
+int script_run(script* program, simple_map* variables, bool final);
+
+/* Keeps program alive until a matching script_free, for function bodies
+ * that outlive the script defining them. */
+void script_hold(script* program);
+
+/* Releases program, its memory is freed when nothing holds it anymore */
+void script_free(script* program);
@@ -0,0 +1,298 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "exports.h"
+#include "ipc.h"
+#include "server.h"
+#include "simple_map.h"
+#include "zygote.h"
+
+/* Defined in shell.c */
+extern simple_map variables;
+extern simple_map path_cache;
+extern char** environ;
+extern bool subshell;
+int run_script(const char* text);
+char* path_cache_get(char* program, char* path);
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+/* Request header, sent with the client's descriptors 0, 1 and 2. It is
+ * followed by the line, the working directory and envc NAME=value strings,
+ * all NUL terminated. */
+struct server_request {
+  uint32_t envc;
+  uint32_t payload_length;
+};
+
+static int unix_address(const char* path, struct sockaddr_un* address) {
+  memset(address, 0, sizeof(*address));
+  address->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address->sun_path)) {
+    fprintf(stderr, "%s: socket path too long\n", path);
+    return -1;
+  }
+  strcpy(address->sun_path, path);
+  return 0;
+}
+
+/* Makes the environment of the request the exported variables. Variables
+ * with unchanged values are left alone. */
+static void apply_environment(char** env, uint32_t envc) {
+  char** exported = exports_envp();
+  size_t count = 0;
+  while (exported[count] != NULL) count++;
+  char* names[count + 1];
+  for (size_t i = 0; i < count; i++)
+    names[i] = strndup(exported[i], strcspn(exported[i], "="));
+  names[count] = NULL;
+
+  for (uint32_t i = 0; i < envc; i++) {
+    char* equals = strchr(env[i], '=');
+    if (equals == NULL) continue;
+    *equals = '\0';
+    char* value = simple_map_get(&variables, env[i]);
+    if (value == NULL || strcmp(value, equals + 1) != 0)
+      simple_map_set(&variables, env[i], equals + 1);
+    exports_add(env[i]);
+    for (size_t j = 0; j < count; j++)
+      if (names[j] && strcmp(names[j], env[i]) == 0) {
+        free(names[j]);
+        names[j] = NULL;
+      }
+    *equals = '=';
+  }
+  /* Exported before but not by the client */
+  for (size_t j = 0; j < count; j++) {
+    if (names[j] == NULL) continue;
+    exports_remove(names[j]);
+    simple_map_remove(&variables, names[j]);
+    free(names[j]);
+  }
+}
+
+/* Runs the line of a request in a session of its own and exits with its
+ * status. */
+static void run_request(char* line, char* cwd, char** env, uint32_t envc,
+                        int cache_socket) {
+  setsid();
+  /* exit only flushes, as in a subshell: the exit handlers are the
+   * server's */
+  subshell = true;
+  int status = 1;
+  if (chdir(cwd) != 0) {
+    perror(cwd);
+  } else {
+    apply_environment(env, envc);
+    char* path = simple_map_get(&path_cache, "");
+    char* initial_path = strdup(path ? path : "");
+    int cached = simple_map_size(&path_cache);
+    status = run_script(line);
+
+    /* Programs found in the same PATH are worth keeping in the server */
+    path = simple_map_get(&path_cache, "");
+    for (int i = cached; path && strcmp(path, initial_path) == 0 &&
+                         i < simple_map_size(&path_cache);
+         i++) {
+      char *name, *value, record[4096];
+      simple_map_entry(&path_cache, i, &name, &value);
+      int length = snprintf(record, sizeof(record), "%s%c%s", name, '\0', value);
+      if (length < sizeof(record)) send(cache_socket, record, length + 1, 0);
+    }
+  }
+  fflush(NULL);
+  _exit(status);
+}
+
+/* Kills every process in session, the jobs of a request have process
+ * groups of their own. */
+static void kill_session(pid_t session) {
+  killpg(session, SIGKILL);
+  DIR* proc = opendir("/proc");
+  if (proc == NULL) return;
+  struct dirent* entry;
+  while ((entry = readdir(proc)) != NULL) {
+    char path[64], buffer[1024];
+    int pid = atoi(entry->d_name);
+    if (pid <= 0) continue;
+    sprintf(path, "/proc/%d/stat", pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) continue;
+    ssize_t n = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (n <= 0) continue;
+    buffer[n] = '\0';
+    /* The command name may contain spaces, fields are counted after it */
+    char* p = strrchr(buffer, ')');
+    int group, id;
+    if (p != NULL && sscanf(p + 2, "%*c %*d %d %d", &group, &id) == 2 &&
+        id == session)
+      killpg(group, SIGKILL);
+  }
+  closedir(proc);
+}
+
+/* Serves one request in a child of the server, connection is the client.
+ * The line runs in another child, which is killed with its jobs if the
+ * client goes away before it is done. */
+static void serve_request(int connection, int cache_socket) {
+  struct server_request request;
+  int fds[3];
+  if (receive_with_fds(connection, &request, sizeof(request), fds, 3) < 0)
+    _exit(1);
+
+  char* payload = malloc(request.payload_length + 1);
+  if (read_all(connection, payload, request.payload_length) < 0) _exit(1);
+  payload[request.payload_length] = '\0';
+  char* line = payload;
+  char* cwd = line + strlen(line) + 1;
+  char* env[request.envc + 1];
+  char* p = cwd + strlen(cwd) + 1;
+  for (uint32_t i = 0; i < request.envc; i++, p += strlen(p) + 1) {
+    if (p >= payload + request.payload_length) _exit(1);
+    env[i] = p;
+  }
+
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(connection);
+    for (int i = 0; i < 3; i++) {
+      dup2(fds[i], i);
+      close(fds[i]);
+    }
+    run_request(line, cwd, env, request.envc, cache_socket);
+  }
+  for (int i = 0; i < 3; i++) close(fds[i]);
+  if (pid < 0) {
+    perror("server");
+    _exit(1);
+  }
+
+  /* Without a pidfd the child is checked every 100 ms */
+  int pidfd = syscall(SYS_pidfd_open, pid, 0);
+  struct pollfd watch[2] = {{connection, POLLRDHUP, 0}, {pidfd, POLLIN, 0}};
+  int status;
+  pid_t reaped;
+  while ((reaped = waitpid(pid, &status, WNOHANG)) == 0) {
+    if (poll(watch, pidfd < 0 ? 1 : 2, pidfd < 0 ? 100 : -1) < 0 &&
+        errno != EINTR)
+      break;
+    if (watch[0].revents & (POLLRDHUP | POLLHUP | POLLERR)) {
+      kill_session(pid);
+      waitpid(pid, &status, 0);
+      _exit(1);
+    }
+  }
+  if (reaped != pid) _exit(1);
+  int32_t reply_status =
+      WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+  write_all(connection, &reply_status, sizeof(reply_status));
+  _exit(0);
+}
+
+/* Adds a program found by a request child to the server's path cache. */
+static void receive_cache_entry(int cache_socket) {
+  char record[4096];
+  ssize_t length = recv(cache_socket, record, sizeof(record) - 1, 0);
+  if (length <= 0) return;
+  record[length] = '\0';
+  char* name = record;
+  char* value = name + strlen(name) + 1;
+  char* path = simple_map_get(&variables, "PATH");
+  if (value >= record + length || path == NULL || name[0] == '\0') return;
+  if (path_cache_get(name, path) == NULL)
+    simple_map_set(&path_cache, name, value);
+}
+
+int server_run(const char* path) {
+  struct sockaddr_un address;
+  if (unix_address(path, &address) < 0) return 1;
+  int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  int cache[2];
+  if (listener < 0 ||
+      socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, cache) < 0) {
+    perror("server");
+    return 1;
+  }
+  unlink(path);
+  if (bind(listener, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+      listen(listener, 128) < 0) {
+    perror(path);
+    return 1;
+  }
+  /* Request children are never waited for */
+  signal(SIGCHLD, SIG_IGN);
+
+  struct pollfd fds[2] = {{listener, POLLIN, 0}, {cache[0], POLLIN, 0}};
+  while (1) {
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) continue;
+      perror("server");
+      return 1;
+    }
+    if (fds[1].revents & POLLIN) receive_cache_entry(cache[0]);
+    if (!(fds[0].revents & POLLIN)) continue;
+    int connection = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+    if (connection < 0) continue;
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+      signal(SIGCHLD, SIG_DFL);
+      close(listener);
+      close(cache[0]);
+      /* Programs started by the zygote would be children of the server */
+      zygote_detach();
+      serve_request(connection, cache[1]);
+    }
+    if (pid < 0) perror("server");
+    close(connection);
+  }
+}
+
+int server_request(const char* path, const char* line) {
+  struct sockaddr_un address;
+  if (unix_address(path, &address) < 0) return 127;
+  int connection = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (connection < 0 ||
+      connect(connection, (struct sockaddr*)&address, sizeof(address)) < 0) {
+    perror(path);
+    return 127;
+  }
+
+  char cwd[4096];
+  if (getcwd(cwd, sizeof(cwd)) == NULL) strcpy(cwd, "/");
+  struct server_request request = {0, strlen(line) + strlen(cwd) + 2};
+  for (; environ[request.envc] != NULL; request.envc++)
+    request.payload_length += strlen(environ[request.envc]) + 1;
+  char* payload = malloc(request.payload_length);
+  char* p = stpcpy(payload, line) + 1;
+  p = stpcpy(p, cwd) + 1;
+  for (uint32_t i = 0; i < request.envc; i++) p = stpcpy(p, environ[i]) + 1;
+
+  int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+  int32_t status = 127;
+  if (send_with_fds(connection, &request, sizeof(request), fds, 3) < 0 ||
+      write_all(connection, payload, request.payload_length) < 0 ||
+      read_all(connection, &status, sizeof(status)) < 0) {
+    fprintf(stderr, "%s: lost connection to server\n", path);
+    status = 127;
+  }
+  free(payload);
+  close(connection);
+  return status;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+/* Command server. shell --server PATH listens on a Unix socket and forks a
+ * child for every request, so requests run concurrently and can't change
+ * each other's state. A request carries a command line, the working
+ * directory, the client's environment and its three standard descriptors.
+ * The child applies the environment as a delta to the server's variables,
+ * runs the line and sends back the exit status, or is killed with its jobs
+ * if the client goes away first. The server keeps the state from its rc
+ * file, and programs its children find in PATH are added to its path
+ * cache. */
+
+/* Serves requests on path. Returns only if the socket can't be set up. */
+int server_run(const char* path);
+
+/* Client side: runs line on the server at path with the caller's working
+ * directory, environment and standard descriptors. Returns its status. */
+int server_request(const char* path, const char* line);
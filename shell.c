@@ -4,18 +4,43 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
 #include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <termios.h>
 #include <ulimit.h>
 #include <unistd.h>
+#include "arena.h"
+#include "arith.h"
+#include "arrays.h"
+#include "exports.h"
+#include "format.h"
+#include "functions.h"
+#include "jobs.h"
+#include "jobserver.h"
+#include "memstat.h"
+#include "pipemon.h"
+#include "reader.h"
+#include "record.h"
+#include "script.h"
+#include "server.h"
+#include "snapshot.h"
+#include "test.h"
 #include "tokenizer.h"
+#include "zygote.h"
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
 
 /* Convenience macro to silence compiler warnings about unused function
  * parameters. */
@@ -39,12 +64,45 @@ pid_t active_pgid = -1;
 /* Currently active process in foreground */
 pid_t active_pid = -1;
 
-/* Count of processes in running state */
-pid_t background_process_count = 0;
-
 /* Env Variables Map */
 simple_map variables;
 
+/* Options of a pipemon prefix on the current command */
+struct pipemon_options pipemon;
+
+/* Programs found in PATH by name. The entry with an empty name holds the
+ * PATH the cache was built for. */
+simple_map path_cache;
+
+/* Whether ~/.shellrc is run at startup and whether its snapshot is used */
+bool rc_enabled = true;
+bool snapshot_enabled = false;
+
+/* set -o argbatch: commands with more arguments than execve takes are run
+ * in batches like xargs does, this many batches at a time. 0 is off. */
+int argbatch_jobs = 0;
+
+/* Set while running the line that ends a -c script, its last command may
+ * replace the shell */
+bool final_line = false;
+
+/* Socket of the command server to run or to send -c commands to */
+char* server_path = NULL;
+char* client_path = NULL;
+
+/* Trace of the commands run from the main loop, see record.h */
+char* record_path = NULL;
+
+/* Id of the job the current command started in background, or 0 */
+int started_job = 0;
+
+/* Set in the forked copy of the shell running a subshell */
+bool subshell = false;
+
+/* Whether the current command may be launched through the zygote, commands
+ * with process substitutions need descriptors only the shell has. */
+bool zygote_allowed = true;
+
 int cmd_exit(char** command);
 int cmd_help(char** command);
 int cmd_pwd(char** command);
@@ -55,6 +113,25 @@ int cmd_type(char** command);
 int cmd_echo(char** command);
 int cmd_wait(char** command);
 int cmd_export(char** command);
+int cmd_unset(char** command);
+int cmd_declare(char** command);
+int cmd_let(char** command);
+int cmd_timeout(char** command);
+int cmd_read(char** command);
+int cmd_mapfile(char** command);
+int cmd_printf(char** command);
+int cmd_test(char** command);
+int cmd_function(char** command);
+int cmd_local(char** command);
+int cmd_return(char** command);
+int cmd_shift(char** command);
+int cmd_set(char** command);
+int cmd_exec(char** command);
+int cmd_true(char** command);
+int cmd_false(char** command);
+#ifdef MEMSTAT
+int cmd_memstat(char** command);
+#endif
 
 /* Built-in command functions take token array (see parse.h) and return int */
 typedef int cmd_fun_t(char** command);
@@ -76,8 +153,31 @@ fun_desc_t cmd_table[] = {
     {cmd_kill, "kill", "send signal to a process"},
     {cmd_type, "type", "display information about command type"},
     {cmd_echo, "echo", "prints input to standard output"},
-    {cmd_wait, "wait", "waits all children to terminate"},
-    {cmd_export, "export", "exports variable to environment"}};
+    {cmd_wait, "wait", "waits for background jobs: wait [-n] [pid|%job ...]"},
+    {cmd_export, "export", "exports variable to environment"},
+    {cmd_unset, "unset", "removes variables"},
+    {cmd_declare, "declare", "declares arrays: -a indexed, -A associative, -p prints"},
+    {cmd_let, "let", "evaluates arithmetic expressions"},
+    {cmd_timeout, "timeout", "runs command with a time limit"},
+    {cmd_read, "read", "reads a line: -r -d delim -n count -t secs -a array"},
+    {cmd_mapfile, "mapfile", "reads lines into an array: -t -n -s -d -u"},
+    {cmd_mapfile, "readarray", "reads lines into an array: -t -n -s -d -u"},
+    {cmd_printf, "printf", "formats and prints arguments: printf [-v name] format"},
+    {cmd_test, "test", "evaluates a conditional expression"},
+    {cmd_test, "[", "evaluates a conditional expression: [ expression ]"},
+    {cmd_function, "function", "defines a function: name() { commands; }"},
+    {cmd_local, "local", "makes variables local to a function"},
+    {cmd_return, "return", "returns from a function: return [status]"},
+    {cmd_shift, "shift", "drops positional parameters: shift [n]"},
+    {cmd_set, "set", "sets shell options: -j N, -o argbatch[=N]"},
+    {cmd_exec, "exec", "replaces the shell with a command, or redirects it"},
+    {cmd_true, ":", "does nothing, successfully"},
+    {cmd_true, "true", "does nothing, successfully"},
+    {cmd_false, "false", "does nothing, unsuccessfully"},
+#ifdef MEMSTAT
+    {cmd_memstat, "memstat", "shows allocations of every call site"},
+#endif
+};
 
 /* Prints a helpful description for the given command */
 int cmd_help(unused char** command) {
@@ -89,7 +189,31 @@ int cmd_help(unused char** command) {
 void save_last_status(int status) {
   char buffer[32];
   sprintf(buffer, "%d", status);
-  simple_map_put(&variables, strdup("?"), strdup(buffer));
+  simple_map_set(&variables, "?", buffer);
+}
+
+/* Ends the shell. A subshell only flushes its output: exit would flush the
+ * input buffer it shares with its parent, moving the parent's offset back
+ * to what it has already read. */
+void quit(int status) {
+  if (subshell) {
+    fflush(stdout);
+    _exit(status);
+  }
+  exit(status);
+}
+
+/* Turns a forked copy of the shell into a subshell. $$ stays the pid of
+ * the shell and programs are spawned by the copy itself, so it can wait
+ * for them. The jobs of the shell are its own and can't be waited for. */
+void enter_subshell() {
+  char parent[32];
+  sprintf(parent, "%d", getppid());
+  if (!subshell) simple_map_set(&variables, "$", parent);
+  subshell = true;
+  zygote_detach();
+  jobs_forget();
+  signal(SIGINT, SIG_DFL);
 }
 
 /* Exits this shell */
@@ -98,10 +222,16 @@ int cmd_exit(char** command) {
   if (command[1] != NULL) {
     status = atoi(command[1]);
   }
+  if (subshell) quit(status);
   simple_map_dispose(&variables);
+  zygote_stop();
   exit(status);
 }
 
+int cmd_true(unused char** command) { return 0; }
+
+int cmd_false(unused char** command) { return 1; }
+
 size_t get_length(char** command) {
   size_t length = 0;
   for (int i = 1;; i++) {
@@ -131,13 +261,24 @@ int cmd_cd(char** command) {
   return 0;
 }
 
-/* Waits children to terminate */
-int cmd_wait(unused char** command) {
-  int status = 1;
-  for (int i = 0; i < background_process_count; i++) {
-    wait(&status);
+/* Waits for background jobs: all of them, the next one to finish (-n) or
+ * the given processes and %jobs. */
+int cmd_wait(char** command) {
+  int status = 0;
+  if (command[1] == NULL) {
+    jobs_wait_all();
+  } else if (strcmp(command[1], "-n") == 0) {
+    if (jobs_wait_any(&status) < 0) status = 127;
+  } else {
+    for (int i = 1; command[i] != NULL; i++) {
+      pid_t pid = command[i][0] == '%' ? jobs_find(atoi(command[i] + 1))
+                                       : atoi(command[i]);
+      if (jobs_wait_pid(pid, &status) < 0) {
+        fprintf(stderr, "wait: %s: no such job\n", command[i]);
+        status = 127;
+      }
+    }
   }
-  background_process_count = 0;
   save_last_status(status);
   return status;
 }
@@ -155,25 +296,232 @@ int cmd_echo(char** command) {
   return 0;
 }
 
+/* Exports variables: export NAME, export NAME=VALUE or export NAME VALUE */
 int cmd_export(char** command) {
-  size_t arg_length = get_length(command);
-  if (arg_length == 1) {  // Only export
-    char* value = simple_map_get(&variables, command[1]);
-    if (value == NULL)
-      fprintf(stderr, "export: %s: No such variable\n", command[1]);
-    else
-      setenv(command[1], value, 0);
-  } else if (arg_length == 2) {  // Definition and export
-    char* name = strdup(command[1]);
-    char* value = strdup(command[2]);
-    simple_map_put(&variables, name, value);
-    setenv(name, value, 0);
-  } else {
-    // Error
+  int status = 0;
+  if (get_length(command) == 2 && strchr(command[1], '=') == NULL &&
+      strchr(command[2], '=') == NULL) {
+    simple_map_set(&variables, command[1], command[2]);
+    exports_add(command[1]);
+    return 0;
+  }
+  for (int i = 1; command[i] != NULL; i++) {
+    char* equals = strchr(command[i], '=');
+    if (equals != NULL) {
+      char* name = strndup(command[i], equals - command[i]);
+      simple_map_set(&variables, name, equals + 1);
+      exports_add(name);
+      free(name);
+    } else if (exports_add(command[i]) < 0) {
+      fprintf(stderr, "export: %s: No such variable\n", command[i]);
+      status = 1;
+    }
+  }
+  return status;
+}
+
+/* Removes variables and their exports, arrays or elements with NAME[sub],
+ * or functions with -f */
+int cmd_unset(char** command) {
+  int status = 0;
+  int i = 1;
+  if (command[i] != NULL && strcmp(command[i], "-f") == 0) {
+    for (i++; command[i] != NULL; i++) function_unset(command[i]);
+    return 0;
+  }
+  if (command[i] != NULL && strcmp(command[i], "-v") == 0) i++;
+  for (; command[i] != NULL; i++) {
+    char* open = strchr(command[i], '[');
+    size_t length = strlen(command[i]);
+    if (open != NULL && command[i][length - 1] == ']') {
+      *open = command[i][length - 1] = '\0';
+      struct array* a = array_find(command[i]);
+      if (a != NULL && array_remove(a, open + 1, &variables) < 0) status = 1;
+      continue;
+    }
+    exports_remove(command[i]);
+    simple_map_remove(&variables, command[i]);
+    array_unset(command[i]);
+  }
+  return status;
+}
+
+/* The array called name. A string variable with that name becomes its
+ * element 0. */
+struct array* to_array(char* name, bool associative) {
+  struct array* a = array_find(name);
+  if (a != NULL) return a;
+  a = array_declare(name, associative);
+  char* value = simple_map_get(&variables, name);
+  if (value != NULL) {
+    array_set(a, "0", value, &variables);
+    exports_remove(name);
+    simple_map_remove(&variables, name);
+  }
+  return a;
+}
+
+/* Prints a variable the way declare would define it */
+int print_declaration(char* name) {
+  struct array* a = array_find(name);
+  if (a == NULL) {
+    char* value = simple_map_get(&variables, name);
+    if (value == NULL) {
+      fprintf(stderr, "declare: %s: not found\n", name);
+      return 1;
+    }
+    printf("declare -- %s=\"%s\"\n", name, value);
+    return 0;
   }
+  printf("declare -%c %s=(", array_is_associative(a) ? 'A' : 'a', name);
+  char buffer[32];
+  const char* separator = "";
+  for (size_t i = 0; i < array_end(a); i++) {
+    const char* value = array_at(a, i);
+    if (value == NULL) continue;
+    printf("%s[%s]=\"%s\"", separator, array_key(a, i, buffer), value);
+    separator = " ";
+  }
+  printf(")\n");
   return 0;
 }
 
+int assign_array(char* name, char** words, bool append);
+
+/* Whether word ends the words of NAME=(words) */
+static bool closes_list(const char* word) {
+  size_t length = strlen(word);
+  return length > 0 && word[length - 1] == ')';
+}
+
+/* Assigns NAME=(words) given to declare. The parser splits the words in
+ * parentheses into arguments of their own, from the one of NAME up to the
+ * one ending in ), which *i is left at. first is what follows NAME=(. */
+static int declare_list(char** command, int* i, char* first) {
+  char* name = command[*i];
+  int start = *i;
+  int available = 0;
+  while (command[start + available] != NULL) available++;
+  char* words[available + 1];
+  int count = 1;
+  words[0] = first;
+  while (!closes_list(words[count - 1]) && command[start + count] != NULL) {
+    words[count] = command[start + count];
+    count++;
+  }
+  *i = start + count - 1;
+  if (!closes_list(words[count - 1])) {
+    fprintf(stderr, "declare: %s: missing )\n", name);
+    return 1;
+  }
+  words[count - 1][strlen(words[count - 1]) - 1] = '\0';
+  /* Blanks inside the parentheses leave empty words at either end */
+  if (words[count - 1][0] == '\0') count--;
+  char** list = words;
+  if (count > 0 && words[0][0] == '\0') {
+    list++;
+    count--;
+  }
+  list[count] = NULL;
+  return assign_array(name, list, false);
+}
+
+/* declare -a NAME, declare -A NAME, declare -p NAME or either of the first
+ * two with =(words) or =([key]=value ...) */
+int cmd_declare(char** command) {
+  bool associative = false, print = false;
+  int i = 1;
+  for (; command[i] != NULL && command[i][0] == '-'; i++) {
+    for (char* flag = command[i] + 1; *flag != '\0'; flag++) {
+      if (*flag == 'A') {
+        associative = true;
+      } else if (*flag == 'p') {
+        print = true;
+      } else if (*flag != 'a') {
+        fprintf(stderr, "declare: -%c: invalid option\n", *flag);
+        return 2;
+      }
+    }
+  }
+  int status = 0;
+  for (; command[i] != NULL; i++) {
+    if (print) {
+      status |= print_declaration(command[i]);
+      continue;
+    }
+    char* equals = strchr(command[i], '=');
+    if (equals != NULL) *equals = '\0';
+    struct array* a = array_find(command[i]);
+    if (a != NULL && array_is_associative(a) != associative) {
+      fprintf(stderr, "declare: %s: cannot convert array\n", command[i]);
+      status = 1;
+      continue;
+    }
+    a = to_array(command[i], associative);
+    if (equals != NULL && equals[1] == '(')
+      status |= declare_list(command, &i, equals + 2);
+    else if (equals != NULL && array_set(a, "0", equals + 1, &variables) < 0)
+      status = 1;
+  }
+  return status;
+}
+
+#ifdef MEMSTAT
+int cmd_memstat(unused char** command) {
+  memstat_report(stdout);
+  return 0;
+}
+#endif
+
+/* Sets shell options. -j N makes the shell a jobserver with N tokens
+ * shared by its background jobs and the makes it starts. -o argbatch[=N]
+ * splits long argument lists into batches, N of them running at once. */
+int cmd_set(char** command) {
+  for (int i = 1; command[i] != NULL; i++) {
+    if (strcmp(command[i], "--") == 0) {
+      positional_set(command + i + 1);
+      break;
+    } else if ((strcmp(command[i], "-o") == 0 || strcmp(command[i], "+o") == 0) &&
+        command[i + 1] != NULL &&
+        strncmp(command[i + 1], "argbatch", 8) == 0) {
+      char* value = command[i + 1] + 8;
+      argbatch_jobs = command[i][0] == '+' ? 0 : 1;
+      if (*value == '=' && argbatch_jobs) argbatch_jobs = atoi(value + 1);
+      if (argbatch_jobs < 0 || (*value != '\0' && *value != '=')) {
+        fprintf(stderr, "set: %s: invalid option\n", command[i + 1]);
+        argbatch_jobs = 0;
+        return 1;
+      }
+      i++;
+    } else if (strcmp(command[i], "-j") == 0 && command[i + 1] != NULL) {
+      const char* makeflags = jobserver_serve(atoi(command[++i]));
+      if (makeflags == NULL) {
+        fprintf(stderr, "set: -j: could not start jobserver\n");
+        return 1;
+      }
+      simple_map_set(&variables, "MAKEFLAGS", makeflags);
+      exports_add("MAKEFLAGS");
+    } else {
+      fprintf(stderr, "set: %s: invalid option\n", command[i]);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Evaluates every argument, succeeds if the last value is not zero */
+int cmd_let(char** command) {
+  int64_t value = 0;
+  if (command[1] == NULL) {
+    fprintf(stderr, "let: expression expected\n");
+    return 1;
+  }
+  for (int i = 1; command[i] != NULL; i++)
+    if (arith_eval(command[i], strlen(command[i]), &variables, &value) < 0)
+      return 1;
+  return value == 0;
+}
+
 int is_number(char* str) {
   int i = 0;
   int length = strlen(str);
@@ -235,90 +583,90 @@ void limit_helper(char* flaga, char* flagb, limits function) {
   switch (f) {
     case 'a':
       function(RLIMIT_CORE, value,
-               strdup("core file size          (blocks, -c)"), is_soft, true,
+               "core file size          (blocks, -c)", is_soft, true,
                false);
       function(RLIMIT_DATA, value,
-               strdup("data seg size           (kbytes, -d)"), is_soft, true,
+               "data seg size           (kbytes, -d)", is_soft, true,
                true);
       function(RLIMIT_NICE, value,
-               strdup("scheduling priority             (-e)"), is_soft, true,
+               "scheduling priority             (-e)", is_soft, true,
                false);
       function(RLIMIT_FSIZE, value,
-               strdup("file size               (blocks, -f)"), is_soft, true,
+               "file size               (blocks, -f)", is_soft, true,
                false);
       function(RLIMIT_SIGPENDING, value,
-               strdup("pending signals                 (-i)"), is_soft, true,
+               "pending signals                 (-i)", is_soft, true,
                false);
       function(RLIMIT_MEMLOCK, value,
-               strdup("max locked memory       (kbytes, -l)"), is_soft, true,
+               "max locked memory       (kbytes, -l)", is_soft, true,
                true);
       function(RLIMIT_RSS, value,
-               strdup("max memory size         (kbytes, -m)"), is_soft, true,
+               "max memory size         (kbytes, -m)", is_soft, true,
                true);
       function(RLIMIT_NOFILE, value,
-               strdup("open files                      (-n)"), is_soft, true,
+               "open files                      (-n)", is_soft, true,
                false);
       fprintf(stdout, "pipe size            (512 bytes, -p) %d\n",
               get_pipe_size());
       function(RLIMIT_MSGQUEUE, value,
-               strdup("POSIX message queues     (bytes, -q)"), is_soft, true,
+               "POSIX message queues     (bytes, -q)", is_soft, true,
                false);
       function(RLIMIT_RTPRIO, value,
-               strdup("real-time priority              (-r)"), is_soft, true,
+               "real-time priority              (-r)", is_soft, true,
                false);
       function(RLIMIT_STACK, value,
-               strdup("stack size              (kbytes, -s)"), is_soft, true,
+               "stack size              (kbytes, -s)", is_soft, true,
                true);
       function(RLIMIT_CPU, value,
-               strdup("cpu time               (seconds, -t)"), is_soft, true,
+               "cpu time               (seconds, -t)", is_soft, true,
                false);
       function(RLIMIT_NPROC, value,
-               strdup("max user processes              (-u)"), is_soft, true,
+               "max user processes              (-u)", is_soft, true,
                true);
-      function(RLIMIT_AS, value, strdup("virtual memory          (kbytes, -v)"),
+      function(RLIMIT_AS, value, "virtual memory          (kbytes, -v)",
                is_soft, true, true);
       function(RLIMIT_LOCKS, value,
-               strdup("file locks                      (-x)"), is_soft, true,
+               "file locks                      (-x)", is_soft, true,
                false);
       break;
     case 'c':
       function(RLIMIT_CORE, value,
-               strdup("core file size          (blocks, -c)"), is_soft, false,
+               "core file size          (blocks, -c)", is_soft, false,
                false);
       break;
     case 'd':
       function(RLIMIT_DATA, value,
-               strdup("data seg size           (kbytes, -d)"), is_soft, false,
+               "data seg size           (kbytes, -d)", is_soft, false,
                true);
       break;
     case 'e':
       function(RLIMIT_NICE, value,
-               strdup("scheduling priority             (-e)"), is_soft, false,
+               "scheduling priority             (-e)", is_soft, false,
                false);
       break;
     case 'f':
       function(RLIMIT_FSIZE, value,
-               strdup("file size               (blocks, -f)"), is_soft, false,
+               "file size               (blocks, -f)", is_soft, false,
                false);
       break;
     case 'i':
       function(RLIMIT_SIGPENDING, value,
-               strdup("pending signals                 (-i)"), is_soft, false,
+               "pending signals                 (-i)", is_soft, false,
                false);
       break;
     case 'l':
       function(RLIMIT_MEMLOCK, value,
-               strdup("max locked memory       (kbytes, -l)"), is_soft, false,
+               "max locked memory       (kbytes, -l)", is_soft, false,
                true);
       break;
     case 'm':
       function(RLIMIT_RSS, value,
-               strdup("max memory size         (kbytes, -m)"), is_soft, false,
+               "max memory size         (kbytes, -m)", is_soft, false,
                true);
       break;
     case 'n':
       function(RLIMIT_NOFILE, value,
-               strdup("open files                      (-n)"), is_soft, false,
+               "open files                      (-n)", is_soft, false,
                false);
       break;
     case 'p': {
@@ -327,36 +675,36 @@ void limit_helper(char* flaga, char* flagb, limits function) {
     }
     case 'q':
       function(RLIMIT_MSGQUEUE, value,
-               strdup("POSIX message queues     (bytes, -q)"), is_soft, false,
+               "POSIX message queues     (bytes, -q)", is_soft, false,
                false);
       break;
     case 'r':
       function(RLIMIT_RTPRIO, value,
-               strdup("real-time priority              (-r)"), is_soft, false,
+               "real-time priority              (-r)", is_soft, false,
                false);
       break;
     case 's':
       function(RLIMIT_STACK, value,
-               strdup("stack size              (kbytes, -s)"), is_soft, false,
+               "stack size              (kbytes, -s)", is_soft, false,
                true);
       break;
     case 't':
       function(RLIMIT_CPU, value,
-               strdup("cpu time               (seconds, -t)"), is_soft, false,
+               "cpu time               (seconds, -t)", is_soft, false,
                false);
       break;
     case 'u':
       function(RLIMIT_NPROC, value,
-               strdup("max user processes              (-u)"), is_soft, false,
+               "max user processes              (-u)", is_soft, false,
                false);
       break;
     case 'v':
-      function(RLIMIT_AS, value, strdup("virtual memory          (kbytes, -v)"),
+      function(RLIMIT_AS, value, "virtual memory          (kbytes, -v)",
                is_soft, false, true);
       break;
     case 'x':
       function(RLIMIT_LOCKS, value,
-               strdup("file locks                      (-x)"), is_soft, false,
+               "file locks                      (-x)", is_soft, false,
                false);
       break;
   }
@@ -373,8 +721,7 @@ void set_limit(int resource, int value, char* info, bool is_soft, bool print,
     limit.rlim_max = value;
 
   setrlimit(resource, &limit);
-
-  free(info);
+  zygote_limits_changed();
 }
 
 void get_limit(int resource, int value, char* info, bool is_soft, bool print,
@@ -389,7 +736,6 @@ void get_limit(int resource, int value, char* info, bool is_soft, bool print,
   if ((is_soft && soft_limit == RLIM_INFINITY) ||
       (!is_soft && hard_limit == RLIM_INFINITY)) {
     fprintf(stdout, "unlimited\n");
-    free(info);
     return;
   }
 
@@ -402,8 +748,6 @@ void get_limit(int resource, int value, char* info, bool is_soft, bool print,
     fprintf(stdout, "%lu\n", soft_limit);
   else
     fprintf(stdout, "%lu\n", hard_limit);
-
-  free(info);
 }
 
 int cmd_ulimit(char** command) {
@@ -417,13 +761,29 @@ int cmd_ulimit(char** command) {
   return 1;
 }
 
-/* Looks up the built-in command, if it exists. */
+/* Looks up the built-in command, if it exists. Functions are found first
+ * and run by the function builtin. */
 int lookup(char cmd[]) {
+  if (cmd == NULL) return -1;
+  if (function_find(cmd) != NULL) cmd = "function";
   for (unsigned int i = 0; i < sizeof(cmd_table) / sizeof(fun_desc_t); i++)
-    if (cmd && (strcmp(cmd_table[i].cmd, cmd) == 0)) return i;
+    if (strcmp(cmd_table[i].cmd, cmd) == 0) return i;
   return -1;
 }
 
+/* Returns the cached location of program, or NULL. The cache is dropped
+ * when PATH changes. */
+char* path_cache_get(char* program, char* path) {
+  char* cached_path = simple_map_get(&path_cache, "");
+  if (cached_path == NULL || strcmp(cached_path, path) != 0) {
+    simple_map_dispose(&path_cache);
+    simple_map_new(&path_cache);
+    simple_map_set(&path_cache, "", path);
+    return NULL;
+  }
+  return simple_map_get(&path_cache, program);
+}
+
 /* Checks if program exists and if not searching in PATH */
 // >show_all_results< parameter says if method should print/log the paths
 // default parameter value of is_builtin is -1
@@ -432,13 +792,22 @@ char* find_program(char* program_path, int show_all_results, int is_builtin) {
     return program_path;
   }
 
+  char* env = simple_map_get(&variables, "PATH");
+  if (env == NULL) env = "";
+
+  bool cacheable = show_all_results == 0 && strchr(program_path, '/') == NULL;
+  if (cacheable) {
+    char* cached = path_cache_get(program_path, env);
+    if (cached != NULL && access(cached, 0) >= 0)
+      return arena_strdup(&command_arena, cached);
+  }
+
   char program_sufix_path[strlen(program_path) + 1];
   char* res = "/";
   strcpy(program_sufix_path, res);
   strcpy(program_sufix_path + 1,
          program_path);  //  example ->  program_sufix_path="/program_path"
 
-  char* env = getenv("PATH");
 
   int start = 0;
 
@@ -459,7 +828,7 @@ char* find_program(char* program_path, int show_all_results, int is_builtin) {
         }
 
         if (final_res == NULL) {
-          final_res = strdup((const char*)&res);
+          final_res = arena_strdup(&command_arena, res);
         }
       }
       start = i + 1;
@@ -475,10 +844,12 @@ char* find_program(char* program_path, int show_all_results, int is_builtin) {
       fprintf(stdout, "%s is %s\n", program_path, last_attempt);
     }
     if (final_res == NULL) {
-      final_res = strdup((const char*)&last_attempt);
+      final_res = arena_strdup(&command_arena, last_attempt);
     }
   }
   if (final_res != NULL) {
+    if (cacheable)
+      simple_map_set(&path_cache, program_path, final_res);
     return final_res;
   }
 
@@ -491,6 +862,10 @@ char* find_program(char* program_path, int show_all_results, int is_builtin) {
 
 int cmd_type(char** command) {
   char* current_command = command[1];
+  if (current_command != NULL && function_find(current_command) != NULL) {
+    fprintf(stdout, "%s is a function\n", current_command);
+    return 0;
+  }
   int have_command = lookup(current_command);
   if (have_command != -1) {
     fprintf(stdout, "%s is a shell builtin\n", current_command);
@@ -499,6 +874,339 @@ int cmd_type(char** command) {
   return 0;
 }
 
+int run_line(const char* text);
+
+/* Starts commands of <(...) and >(...) connected to pipes and replaces their
+ * arguments with /dev/fd/N paths. The parent ends are stored in fds. */
+void spawn_process_substitutions(struct command* full_command, int* fds,
+                                 pid_t* pids) {
+  for (size_t i = 0; i < full_command->procsubs_length; i++) {
+    struct process_substitution* ps = full_command->procsubs[i];
+    int pipe_fds[2];
+    fds[i] = -1;
+    pids[i] = -1;
+    if (pipe(pipe_fds) < 0) {
+      perror("process substitution");
+      continue;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+      fprintf(stderr, "Creating child process failed\n");
+      close(pipe_fds[0]);
+      close(pipe_fds[1]);
+      continue;
+    } else if (pid == 0) { /* Child Process */
+      for (size_t j = 0; j < i; j++)
+        if (fds[j] != -1) close(fds[j]);
+      dup2(pipe_fds[ps->output ? 0 : 1], ps->output ? STDIN_FILENO : STDOUT_FILENO);
+      close(pipe_fds[0]);
+      close(pipe_fds[1]);
+      shell_is_interactive = false;
+      enter_subshell();
+      quit(run_line(ps->line));
+    }
+    pids[i] = pid;
+    fds[i] = pipe_fds[ps->output ? 1 : 0];
+    close(pipe_fds[ps->output ? 0 : 1]);
+
+    char path[32];
+    sprintf(path, "/dev/fd/%d", fds[i]);
+    char** target;
+    if (ps->redirection)
+      target = ps->output ? &full_command->out_file : &full_command->inp_file;
+    else
+      target = &command_get_cmd(full_command, ps->cmd_index)[ps->arg_index];
+    *target = arena_strdup(&command_arena, path);
+  }
+}
+
+/* Closes the parent ends of process substitutions and reaps them. Those of
+ * a background command belong to its job and are reaped with it. */
+void finish_process_substitutions(struct command* full_command, int* fds,
+                                  pid_t* pids) {
+  size_t started = 0;
+  for (size_t i = 0; i < full_command->procsubs_length; i++) {
+    if (fds[i] != -1) close(fds[i]);
+    if (pids[i] != -1) pids[started++] = pids[i];
+  }
+  if (started == 0) return;
+  if (full_command->background && started_job > 0 &&
+      jobs_attach(started_job, pids, started) == 0)
+    return;
+  for (size_t i = 0; i < started; i++) waitpid(pids[i], NULL, 0);
+}
+
+/* Registers processes started in background as a job. */
+void start_job(pid_t* pids, size_t count, struct command* full_command,
+               int token) {
+  char text[1024];
+  size_t length = 0;
+  text[0] = '\0';
+  for (size_t i = 0; i < full_command->cmds_length; i++) {
+    char** args = command_get_cmd(full_command, i);
+    for (int j = 0; args[j] != NULL && length < sizeof(text); j++)
+      length += snprintf(text + length, sizeof(text) - length, "%s%s",
+                         i + j == 0 ? "" : j == 0 ? " | " : " ", args[j]);
+  }
+  int id = jobs_add(pids, count, text, token);
+  started_job = id;
+  char pid[32];
+  sprintf(pid, "%d", pids[count - 1]);
+  simple_map_set(&variables, "!", pid);
+  if (shell_is_interactive) fprintf(stdout, "[%d] %d\n", id, pids[count - 1]);
+}
+
+/* Whether the command is the last thing the shell does, so it can be
+ * executed in place of the shell instead of forking and waiting for it. Not
+ * when jobs are left to wait for or something else must run at exit. */
+bool tail_position(struct command* full_command) {
+#ifdef MEMSTAT
+  return false;
+#endif
+  return final_line && full_command->logical_index == 0 &&
+         full_command->background == 0 && full_command->procsubs_length == 0 &&
+         full_command->env_var_definition == 0 && pipemon.interval_ms == 0 &&
+         jobs_count() == 0 && !jobserver_serving() && !recording();
+}
+
+/* Executes a program in place of the shell with given standard input and
+ * output. Only returns if the program can't be found. */
+void replace_shell(char** args, int inp_fd, int out_fd) {
+  char* program_path = find_program(args[0], 0, -1);
+  if (program_path == NULL) quit(127);
+  fflush(stdout);
+  if (inp_fd != STDIN_FILENO) {
+    dup2(inp_fd, STDIN_FILENO);
+    close(inp_fd);
+  }
+  if (out_fd != STDOUT_FILENO) {
+    dup2(out_fd, STDOUT_FILENO);
+    close(out_fd);
+  }
+  /* Signals the shell ignores would stay ignored in the program */
+  signal(SIGINT, SIG_DFL);
+  signal(SIGQUIT, SIG_DFL);
+  signal(SIGTSTP, SIG_DFL);
+  signal(SIGTTIN, SIG_DFL);
+  signal(SIGTTOU, SIG_DFL);
+  execve(program_path, args, exports_envp());
+  fprintf(stderr, "%s: %s\n", args[0], strerror(errno));
+  quit(126);
+}
+
+/* exec with no command makes its redirections permanent. */
+int cmd_exec(char** command) {
+  if (command[1] != NULL) replace_shell(command + 1, STDIN_FILENO, STDOUT_FILENO);
+  return 0;
+}
+
+/* exec with redirections, which apply to the shell itself. */
+int exec_redirected(char** args, int inp_fd, int out_fd) {
+  if (args[1] != NULL) replace_shell(args + 1, inp_fd, out_fd);
+  fflush(stdout);
+  if (inp_fd != STDIN_FILENO) {
+    dup2(inp_fd, STDIN_FILENO);
+    close(inp_fd);
+  }
+  if (out_fd != STDOUT_FILENO) {
+    dup2(out_fd, STDOUT_FILENO);
+    close(out_fd);
+  }
+  save_last_status(0);
+  return 0;
+}
+
+/* Opens the input and output files of full_command into inp_fd and out_fd.
+ * Returns 1 if it has any, 0 if not and -1 if one couldn't be opened. */
+int open_redirections(struct command* full_command, int* inp_fd,
+                      int* out_fd) {
+  int is_redirection = 0;
+  if (full_command->inp_file != NULL) {  // Prepare file if neccessary
+    int fd = open(full_command->inp_file, O_RDONLY);
+    if (fd != -1) {
+      *inp_fd = fd;
+      is_redirection = 1;
+    } else {
+      fprintf(stderr, "%s: could not open file\n", full_command->inp_file);
+      is_redirection = -1;
+    }
+  }
+  if (full_command->out_file != NULL) {  // Prepare file if neccessary
+    mode_t f_mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH;
+    int f_flags;
+    if (full_command->append_to_file == 1)
+      f_flags = O_WRONLY | O_CREAT | O_APPEND;
+    else
+      f_flags = O_WRONLY | O_CREAT | O_TRUNC;
+    int fd = open(full_command->out_file, f_flags, f_mode);
+    if (fd != -1) {
+      *out_fd = fd;
+      if (is_redirection == 0) is_redirection = 1;
+    } else {
+      fprintf(stderr, "%s: could not open file\n", full_command->out_file);
+      is_redirection = -1;
+    }
+  }
+  return is_redirection;
+}
+
+/* Points the shell's standard input and output at inp_fd and out_fd. The
+ * descriptors they replace are kept in saved, -1 when unchanged. */
+void save_fds(int inp_fd, int out_fd, int saved[2]) {
+  fflush(stdout);
+  saved[0] = saved[1] = -1;
+  if (inp_fd != STDIN_FILENO) {
+    saved[0] = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 10);
+    dup2(inp_fd, STDIN_FILENO);
+  }
+  if (out_fd != STDOUT_FILENO) {
+    saved[1] = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+    dup2(out_fd, STDOUT_FILENO);
+  }
+}
+
+void restore_fds(int saved[2]) {
+  fflush(stdout);
+  if (saved[0] >= 0) {
+    dup2(saved[0], STDIN_FILENO);
+    close(saved[0]);
+  }
+  if (saved[1] >= 0) {
+    dup2(saved[1], STDOUT_FILENO);
+    close(saved[1]);
+  }
+}
+
+/* Runs a builtin in the shell with its standard input and output
+ * redirected for the time it runs, instead of forking for it. */
+int run_builtin_redirected(char** args, int inp_fd, int out_fd) {
+  int saved[2];
+  save_fds(inp_fd, out_fd, saved);
+  int status = cmd_table[lookup(args[0])].fun(args);
+  restore_fds(saved);
+  save_last_status(status);
+  return status;
+}
+
+/* Redirects the shell for a compound command, the redirections are parsed
+ * and opened like the ones of a simple command. Process substitutions
+ * among them run until the command is done. */
+int redirect_apply(const char* text, struct redirection* r) {
+  struct command* redirections = parse(text, &variables, 0);
+  if (redirections == NULL) return -1;
+  size_t count = redirections->procsubs_length;
+  int procsub_fds[count + 1];
+  pid_t procsub_pids[count + 1];
+  spawn_process_substitutions(redirections, procsub_fds, procsub_pids);
+  int inp_fd = STDIN_FILENO;
+  int out_fd = STDOUT_FILENO;
+  int opened = open_redirections(redirections, &inp_fd, &out_fd);
+  command_destroy(redirections);
+  r->saved[0] = r->saved[1] = -1;
+  if (opened >= 0) save_fds(inp_fd, out_fd, r->saved);
+  if (inp_fd != STDIN_FILENO) close(inp_fd);
+  if (out_fd != STDOUT_FILENO) close(out_fd);
+
+  /* The redirections hold the pipes open now */
+  r->procsubs = malloc(sizeof(pid_t) * (count + 1));
+  r->procsubs_length = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (procsub_fds[i] != -1) close(procsub_fds[i]);
+    if (procsub_pids[i] != -1)
+      r->procsubs[r->procsubs_length++] = procsub_pids[i];
+  }
+  if (opened >= 0) return 0;
+  redirect_restore(r);
+  save_last_status(1);
+  return -1;
+}
+
+void redirect_restore(struct redirection* r) {
+  restore_fds(r->saved);
+  for (size_t i = 0; i < r->procsubs_length; i++)
+    waitpid(r->procsubs[i], NULL, 0);
+  free(r->procsubs);
+}
+
+/* Forks once for the whole subshell, its last command replaces the copy of
+ * the shell when it can. */
+int run_subshell(script* body, const char* redirections) {
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return 1;
+  }
+  if (pid == 0) {
+    struct redirection r;
+    enter_subshell();
+    if (redirections == NULL) quit(script_run(body, &variables, true));
+    if (redirect_apply(redirections, &r) < 0) quit(1);
+    int status = script_run(body, &variables, true);
+    redirect_restore(&r);
+    quit(status);
+  }
+  int status;
+  active_pid = pid;
+  while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+    ;
+  active_pid = -1;
+  status = exit_status(status);
+  save_last_status(status);
+  return status;
+}
+
+/* Forks a copy of the shell for every stage, connected with pipes. */
+int run_pipeline(script** stages, int count) {
+  pid_t pids[count];
+  int started = 0;
+  int input = -1;
+  fflush(stdout);
+  for (; started < count; started++) {
+    int fds[2] = {-1, -1};
+    if (started < count - 1 && pipe(fds) < 0) {
+      perror("pipe");
+      break;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      if (fds[0] != -1) close(fds[0]);
+      if (fds[1] != -1) close(fds[1]);
+      break;
+    }
+    if (pid == 0) {
+      enter_subshell();
+      if (input != -1) {
+        dup2(input, STDIN_FILENO);
+        close(input);
+      }
+      if (fds[1] != -1) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+      }
+      quit(script_run(stages[started], &variables, true));
+    }
+    pids[started] = pid;
+    if (input != -1) close(input);
+    if (fds[1] != -1) close(fds[1]);
+    input = fds[0];
+  }
+  if (input != -1) close(input);
+
+  int status = 1;
+  for (int i = 0; i < started; i++) {
+    int wait_status;
+    while (waitpid(pids[i], &wait_status, 0) < 0 && errno == EINTR)
+      ;
+    if (i == count - 1) status = exit_status(wait_status);
+  }
+  save_last_status(status);
+  return status;
+}
+
 int redirected_execution(struct command* full_command, int inp_fd, int out_fd) {
   int status = 1;
   int fds1[2];
@@ -506,18 +1214,51 @@ int redirected_execution(struct command* full_command, int inp_fd, int out_fd) {
   int* read_pipe = fds1;  // Read from 0 write to 1.
   int* write_pipe = fds2;
   pid_t pgid = -1;
+  pid_t pids[full_command->cmds_length];
+  /* The last stage may be the shell itself, then the others join its
+   * process group */
+  char** last = command_get_cmd(full_command, full_command->cmds_length - 1);
+  bool tail = tail_position(full_command) && lookup(last[0]) < 0;
+  if (tail) pgid = getpgrp();
+  /* Background jobs wait for a jobserver token before starting */
+  int token = full_command->background ? jobs_acquire_token() : JOBSERVER_NONE;
+  /* The monitor keeps its own read end of every pipe */
+  bool monitored = pipemon.interval_ms > 0 && full_command->background == 0;
+  int monitor_fds[full_command->cmds_length];
   for (size_t i = 0; i < full_command->cmds_length; i++) {
     char** args = command_get_cmd(full_command, i);
 
     if (i <
-        full_command->cmds_length - 1) /* Don't create pipe for last process */
+        full_command->cmds_length - 1) { /* Don't create pipe for last process */
       pipe(write_pipe);
+      if (monitored) monitor_fds[i] = fcntl(write_pipe[0], F_DUPFD_CLOEXEC, 0);
+    }
 
-    pid_t pid = fork();
+    if (tail && i == full_command->cmds_length - 1)
+      replace_shell(args, i == 0 ? inp_fd : read_pipe[0], out_fd);
+
+    pid_t pid = -1;
+    if (zygote_active() && zygote_allowed && lookup(args[0]) < 0) {
+      char* program_path = find_program(args[0], 0, 0);
+      if (program_path != NULL) {
+        int stage_inp = i == 0 ? inp_fd : read_pipe[0];
+        int stage_out =
+            i == full_command->cmds_length - 1 ? out_fd : write_pipe[1];
+        pid = zygote_spawn(program_path, args, exports_envp(), stage_inp, stage_out,
+                           STDERR_FILENO, pgid == -1 ? 0 : pgid);
+      }
+    }
+    if (pid == -1) {
+      fflush(stdout); /* The child would write the buffer once more */
+      pid = fork();
+    }
     if (pid < 0) {
       fprintf(stderr, "Creating child process failed\n");
+      jobserver_release(token);
       return 1;
     } else if (pid == 0) { /* Child Process */
+      /* Also set by the parent, whichever runs first */
+      setpgid(0, pgid == -1 ? 0 : pgid);
       if (i == 0) {        /* First process, only writes to pipe. */
         if (full_command->cmds_length != 1) { /* Check for pipeless case */
           close(write_pipe[0]);
@@ -545,18 +1286,23 @@ int redirected_execution(struct command* full_command, int inp_fd, int out_fd) {
         dup2(write_pipe[1], 1);
       }
 
+      /* _exit, as exit would move the offset of the shell's input back to
+       * where its buffer was read to, and the shell would read it twice */
       int fundex = lookup(args[0]);
       if (fundex >= 0) {
         int status = cmd_table[fundex].fun(args);
-        exit(status);
+        fflush(stdout);
+        _exit(status);
       } else {
         char* program_path = find_program(args[0], 0, -1);
-        if (program_path == NULL) exit(1);
-        execv(program_path, args);
-        exit(1);
+        if (program_path == NULL) _exit(1);
+        execve(program_path, args, exports_envp());
+        fprintf(stderr, "%s: %s\n", args[0], strerror(errno));
+        _exit(1);
       }
 
     } else { /* Parent Process */
+      pids[i] = pid;
       if (pgid == -1) pgid = pid;
       setpgid(pid, pgid);
       if (i < full_command->cmds_length - 1) close(write_pipe[1]);
@@ -566,54 +1312,642 @@ int redirected_execution(struct command* full_command, int inp_fd, int out_fd) {
       write_pipe = tmp;
     }
   }
-  if (full_command->background == 0) {
+  if (monitored) {
     active_pgid = pgid;
-    for (size_t i = 0; i < full_command->cmds_length; i++) /* Wait for all childs in pipe */
-      waitpid(-pgid, &status, WSTOPPED);
-      save_last_status(status);
+    status = exit_status(pipemon_wait(full_command, pgid, pids, monitor_fds,
+                                      &pipemon, stderr));
+    save_last_status(status);
+    active_pgid = -1;
+  } else if (full_command->background == 0) {
+    active_pgid = pgid;
+    for (size_t i = 0; i < full_command->cmds_length; i++) { /* Wait for all childs in pipe */
+      int wait_status;
+      /* Pipeline status is the status of its last command */
+      if (waitpid(-pgid, &wait_status, WSTOPPED) == pids[full_command->cmds_length - 1])
+        status = exit_status(wait_status);
+    }
+    save_last_status(status);
     active_pgid = -1;
   } else {
-    background_process_count += full_command->cmds_length;
+    start_job(pids, full_command->cmds_length, full_command, token);
+  }
+  return status;
+}
+
+/* Starts program in process group pgid (0 for a new group) with given
+ * standard input and output. Uses the zygote when possible. */
+pid_t spawn_program(char* program_path, char** args, pid_t pgid, int inp_fd,
+                    int out_fd) {
+  pid_t pid = -1;
+  /* Output of builtins must come before the program's */
+  fflush(stdout);
+  if (zygote_active() && zygote_allowed)
+    pid = zygote_spawn(program_path, args, exports_envp(), inp_fd, out_fd,
+                       STDERR_FILENO, pgid);
+  if (pid == -1) pid = fork();
+  if (pid < 0) {
+    fprintf(stderr, "Creating child process failed\n");
+    return -1;
+  } else if (pid == 0) { /* Child Process */
+    setpgid(0, pgid);
+    if (inp_fd != STDIN_FILENO) dup2(inp_fd, STDIN_FILENO);
+    if (out_fd != STDOUT_FILENO) dup2(out_fd, STDOUT_FILENO);
+    execve(program_path, args, exports_envp());
+    fprintf(stderr, "%s: %s\n", args[0], strerror(errno));
+    _exit(127);
   }
+  setpgid(pid, pgid == 0 ? pid : pgid);
+  return pid;
+}
+
+/* Whether a command's lazy arguments are left to run_batched. Only simple
+ * foreground programs are split, with the arguments before the first lazy
+ * word repeated in every batch. */
+bool batchable(struct command* full_command) {
+  char** args = command_get_cmd(full_command, 0);
+  return argbatch_jobs > 0 && full_command->lazy_length > 0 &&
+         full_command->cmds_length == 1 && full_command->background == 0 &&
+         full_command->env_var_definition == 0 &&
+         full_command->procsubs_length == 0 &&
+         full_command->lazy[0]->arg_index > 0 && lookup(args[0]) < 0 &&
+         strcmp(args[0], "pipemon") != 0;
+}
+
+/* Bytes execve has for arguments: ARG_MAX less the environment, with some
+ * headroom like xargs keeps. */
+size_t argument_space() {
+  long space = sysconf(_SC_ARG_MAX) - 4096;
+  for (char** entry = exports_envp(); *entry != NULL; entry++)
+    space -= strlen(*entry) + 1 + sizeof(char*);
+  return space > 4096 ? space : 4096;
+}
+
+/* Waits for one batch of pgid and keeps the last failing status. */
+int wait_batch(pid_t pgid, int status) {
+  int wait_status;
+  if (waitpid(-pgid, &wait_status, 0) > 0 && exit_status(wait_status) != 0)
+    status = exit_status(wait_status);
   return status;
 }
 
+/* Runs a program with its arguments split into as many execve calls as
+ * they need, argbatch_jobs of them at a time. Words of lazy brace
+ * expansions are generated batch by batch. */
+int run_batched(struct command* full_command, int inp_fd, int out_fd) {
+  char** args = command_get_cmd(full_command, 0);
+  char* program_path = find_program(args[0], 0, -1);
+  if (program_path == NULL) {
+    save_last_status(127);
+    return 127;
+  }
+  size_t space = argument_space();
+  size_t fixed = full_command->lazy[0]->arg_index;
+  size_t fixed_size = 0;
+  for (size_t i = 0; i < fixed; i++)
+    fixed_size += strlen(args[i]) + 1 + sizeof(char*);
+
+  size_t capacity = fixed + 1024;
+  char** batch = malloc(sizeof(char*) * capacity);
+  memcpy(batch, args, sizeof(char*) * fixed);
+  struct word_cursor* cursor = malloc(sizeof(struct word_cursor));
+  command_cursor(full_command, 0, fixed, cursor);
+  const char* word = command_next_word(cursor);
+
+  int status = 0;
+  int running = 0;
+  pid_t pgid = 0;
+  while (word != NULL) {
+    arena_mark mark = arena_save(&command_arena);
+    size_t n = fixed, size = fixed_size;
+    for (; word != NULL; word = command_next_word(cursor)) {
+      size_t word_size = strlen(word) + 1 + sizeof(char*);
+      if (n > fixed && size + word_size > space) break;
+      if (n + 1 == capacity) {
+        capacity *= 2;
+        batch = realloc(batch, sizeof(char*) * capacity);
+      }
+      batch[n++] = arena_strdup(&command_arena, word);
+      size += word_size;
+    }
+    batch[n] = NULL;
+
+    if (running == argbatch_jobs) {
+      status = wait_batch(pgid, status);
+      running--;
+    }
+    /* Batches share a process group while one of them is left in it */
+    if (running == 0) pgid = 0;
+    pid_t pid = spawn_program(program_path, batch, pgid, inp_fd, out_fd);
+    arena_rewind(&command_arena, mark);
+    if (pid < 0) {
+      status = 1;
+      break;
+    }
+    if (pgid == 0) {
+      pgid = pid;
+      active_pgid = pgid;
+      if (shell_is_interactive) tcsetpgrp(shell_terminal, pgid);
+    }
+    running++;
+  }
+  for (; running > 0; running--) status = wait_batch(pgid, status);
+  if (shell_is_interactive) tcsetpgrp(shell_terminal, shell_pgid);
+  active_pgid = -1;
+  free(cursor);
+  free(batch);
+  save_last_status(status);
+  return status;
+}
+
+/* Assigns an element of an array, appending to it with append. */
+int assign_element(char* name, char* subscript, char* value, bool append) {
+  struct array* a = to_array(name, false);
+  const char* old = append ? array_get(a, subscript, &variables) : NULL;
+  if (old == NULL) return array_set(a, subscript, value, &variables) < 0;
+  char joined[strlen(old) + strlen(value) + 1];
+  sprintf(joined, "%s%s", old, value);
+  return array_set(a, subscript, joined, &variables) < 0;
+}
+
+/* Assigns the words of NAME=(words), [subscript]=value words set that
+ * element. The array is emptied first unless append. */
+int assign_array(char* name, char** words, bool append) {
+  struct array* a = to_array(name, false);
+  if (!append) array_clear(a);
+  int status = 0;
+  for (; *words != NULL; words++) {
+    char* close = (*words)[0] == '[' ? strstr(*words, "]=") : NULL;
+    if (close != NULL) {
+      *close = '\0';
+      if (array_set(a, *words + 1, close + 2, &variables) < 0) status = 1;
+    } else if (array_is_associative(a)) {
+      fprintf(stderr, "%s: %s: must use subscript when assigning associative array\n",
+              name, *words);
+      status = 1;
+    } else {
+      array_append(a, *words);
+    }
+  }
+  return status;
+}
+
+/* NAME=value, NAME[subscript]=value or NAME=(words) without export, the
+ * parser leaves the + of += at the end of the name. */
+int assign(char** args, int env_var_definition) {
+  char* name = args[0];
+  char* value = args[1] ? args[1] : "";
+  size_t length = strlen(name);
+  bool append = length > 1 && name[length - 1] == '+';
+  if (append) name[--length] = '\0';
+  if (env_var_definition == 2) return assign_array(name, args + 1, append);
+
+  char* open = strchr(name, '[');
+  if (open != NULL && name[length - 1] == ']') {
+    *open = name[length - 1] = '\0';
+    return assign_element(name, open + 1, value, append);
+  }
+  if (array_find(name) != NULL) return assign_element(name, "0", value, append);
+  char* old = append ? simple_map_get(&variables, name) : NULL;
+  if (old == NULL) {
+    simple_map_set(&variables, name, value);
+    return 0;
+  }
+  char joined[strlen(old) + strlen(value) + 1];
+  sprintf(joined, "%s%s", old, value);
+  simple_map_set(&variables, name, joined);
+  return 0;
+}
+
 int execute_command(char** args, int background, int env_var_definition) {
   int status = 0;
   int fundex = lookup(args[0]); /* Find which built-in function to run. */
   if (fundex >= 0) {
     status = cmd_table[fundex].fun(args);
-  } else if (env_var_definition == 1) { /* Definition without export */
-    char* name = strdup(args[0]);
-    char* value = strdup(args[1]);
-    simple_map_put(&variables, name, value);
+    save_last_status(status);
+  } else if (env_var_definition != 0) { /* Definition without export */
+    status = assign(args, env_var_definition);
+    save_last_status(status);
   } else {
     char* program_path = find_program(args[0], 0, -1);
-    if (program_path == NULL) return status;
-    pid_t pid = fork();
+    if (program_path == NULL) {
+      save_last_status(127);
+      return 127;
+    }
+    int token = background ? jobs_acquire_token() : JOBSERVER_NONE;
+    pid_t pid = spawn_program(program_path, args, 0, STDIN_FILENO, STDOUT_FILENO);
     if (pid < 0) {
-      fprintf(stderr, "Creating child process failed\n");
+      jobserver_release(token);
       return 1;
-    } else if (pid == 0) { /* Child Process */
-      execv(program_path, args);
-      exit(1);
-    } else { /* Parent Process */
-      setpgid(pid, pid);
-      if (background == 0) {
-        active_pid = pid;
-        tcsetpgrp(shell_terminal, pid);
-        waitpid(pid, &status, WSTOPPED);
-        save_last_status(status);
-        tcsetpgrp(shell_terminal, shell_pgid);
-        active_pid = -1;
-      } else {
-        background_process_count++;
+    }
+    if (background == 0) {
+      active_pid = pid;
+      if (shell_is_interactive) tcsetpgrp(shell_terminal, pid);
+      waitpid(pid, &status, WSTOPPED);
+      status = exit_status(status);
+      save_last_status(status);
+      if (shell_is_interactive) tcsetpgrp(shell_terminal, shell_pgid);
+      active_pid = -1;
+    } else {
+      struct command single = {1, &args};
+      start_job(&pid, 1, &single, token);
+    }
+  }
+  return status;
+}
+
+/* Parses durations like 10, 0.5s, 2m, 1h or 1d into nanoseconds. */
+int64_t parse_duration(char* text) {
+  char* end;
+  double value = strtod(text, &end);
+  if (end == text || !(value >= 0)) return -1;
+  switch (*end) {
+    case 'd': value *= 24;  /* fall through */
+    case 'h': value *= 60;  /* fall through */
+    case 'm': value *= 60;  /* fall through */
+    case 's':
+    case '\0': break;
+    default: return -1;
+  }
+  /* Infinity and durations of centuries don't fit */
+  if (value * 1e9 >= 9e18) return -1;
+  return (int64_t)(value * 1e9);
+}
+
+/* Parses a signal given as a number or a name with or without SIG. */
+int parse_signal(char* text) {
+  static const struct {
+    const char* name;
+    int number;
+  } signals[] = {{"HUP", SIGHUP},   {"INT", SIGINT},   {"QUIT", SIGQUIT},
+                 {"KILL", SIGKILL}, {"USR1", SIGUSR1}, {"USR2", SIGUSR2},
+                 {"PIPE", SIGPIPE}, {"ALRM", SIGALRM}, {"TERM", SIGTERM},
+                 {"CONT", SIGCONT}, {"STOP", SIGSTOP}, {"TSTP", SIGTSTP}};
+  if (is_number(text)) return atoi(text);
+  if (strncmp(text, "SIG", 3) == 0) text += 3;
+  for (int i = 0; i < sizeof(signals) / sizeof(signals[0]); i++)
+    if (strcasecmp(signals[i].name, text) == 0) return signals[i].number;
+  return -1;
+}
+
+/* A zero duration leaves the timer disarmed, like 0 means no time limit
+ * to coreutils timeout. */
+static void arm_timer(int timer, int64_t nanoseconds) {
+  struct itimerspec spec = {{0, 0}, {nanoseconds / 1000000000,
+                                     nanoseconds % 1000000000}};
+  if (nanoseconds > 0) timerfd_settime(timer, 0, &spec, NULL);
+}
+
+/* Runs command and signals its process group when the duration elapses.
+ * Waits on a pidfd and a timerfd. Status is 124 after a timeout, or 137
+ * if the command had to be killed with -k. */
+int cmd_timeout(char** command) {
+  int signal_number = SIGTERM;
+  int64_t kill_after = -1;
+  int64_t duration = -1;
+  int i = 1;
+  for (; command[i] != NULL; i++) {
+    if (strcmp(command[i], "-s") == 0 && command[i + 1] != NULL) {
+      signal_number = parse_signal(command[++i]);
+    } else if (strcmp(command[i], "-k") == 0 && command[i + 1] != NULL) {
+      kill_after = parse_duration(command[++i]);
+      if (kill_after < 0) {
+        duration = -1;
+        break;
       }
+    } else if (duration == -1) {
+      duration = parse_duration(command[i]);
+      if (duration < 0) break;
+    } else {
+      break;
     }
   }
+  if (duration < 0 || signal_number < 0 || command[i] == NULL) {
+    fprintf(stderr, "timeout: usage: timeout DURATION [-s SIG] [-k KILLAFTER] command\n");
+    save_last_status(125);
+    return 125;
+  }
+
+  char** args = command + i;
+  char* program_path = find_program(args[0], 0, -1);
+  if (program_path == NULL) {
+    save_last_status(127);
+    return 127;
+  }
+  pid_t pid = spawn_program(program_path, args, 0, STDIN_FILENO, STDOUT_FILENO);
+  if (pid < 0) return 125;
+
+  bool foreground = shell_is_interactive && getpgrp() == shell_pgid;
+  active_pid = pid;
+  if (foreground) tcsetpgrp(shell_terminal, pid);
+
+  struct pollfd fds[2];
+  fds[0].fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  fds[0].events = POLLIN;
+  fds[1].fd = syscall(SYS_pidfd_open, pid, 0);
+  fds[1].events = POLLIN;
+  arm_timer(fds[0].fd, duration);
+
+  int status = 0;
+  int timed_out = 0; /* 1 after the signal, 2 after SIGKILL */
+  while (waitpid(pid, &status, WNOHANG) == 0) {
+    /* Without pidfd the child is polled every 10 milliseconds */
+    int nfds = fds[1].fd >= 0 ? 2 : 1;
+    if (poll(fds, nfds, nfds == 2 ? -1 : 10) <= 0 || !(fds[0].revents & POLLIN))
+      continue;
+    uint64_t expirations;
+    read(fds[0].fd, &expirations, sizeof(expirations));
+    if (timed_out == 0) {
+      killpg(pid, signal_number);
+      if (signal_number != SIGKILL && signal_number != SIGCONT)
+        killpg(pid, SIGCONT);
+      timed_out = signal_number == SIGKILL ? 2 : 1;
+      if (kill_after >= 0) arm_timer(fds[0].fd, kill_after);
+    } else if (timed_out == 1) {
+      killpg(pid, SIGKILL);
+      timed_out = 2;
+    }
+  }
+  close(fds[0].fd);
+  if (fds[1].fd >= 0) close(fds[1].fd);
+  if (foreground) tcsetpgrp(shell_terminal, shell_pgid);
+  active_pid = -1;
+
+  status = exit_status(status);
+  if (timed_out == 1) status = 124;
+  if (timed_out == 2) status = 137;
+  save_last_status(status);
   return status;
 }
 
+/* Value of an option like -n 5 or -n5 of a builtin, NULL if it's missing. */
+char* option_value(char** command, int* i) {
+  if (command[*i][2] != '\0') return command[*i] + 2;
+  if (command[*i + 1] == NULL) return NULL;
+  return command[++*i];
+}
+
+/* Assigns the fields of text split by IFS to names, the last name gets the
+ * rest of the line. With a NULL name the fields go to array instead. */
+void assign_fields(char* text, char** names, struct array* array) {
+  char* ifs = simple_map_get(&variables, "IFS");
+  if (ifs == NULL) ifs = " \t\n";
+  for (int k = 0; array != NULL || names[k] != NULL; k++) {
+    while (*text != '\0' && strchr(ifs, *text) && isspace(*text)) text++;
+    if (*text == '\0' && array != NULL) break;
+    char* end = text;
+    if (array != NULL || names[k + 1] != NULL) {
+      while (*end != '\0' && !strchr(ifs, *end)) end++;
+    } else {
+      end = text + strlen(text);
+      while (end > text && strchr(ifs, end[-1]) && isspace(end[-1])) end--;
+    }
+    char* next = end;
+    /* Blanks around a separator, then the separator itself */
+    while (*next != '\0' && strchr(ifs, *next) && isspace(*next)) next++;
+    if (*next != '\0' && strchr(ifs, *next) && next == end) next++;
+    *end = '\0';
+    if (array != NULL) {
+      array_append(array, text);
+    } else {
+      char* args[] = {names[k], text, NULL};
+      assign(args, 1);
+    }
+    text = next;
+  }
+}
+
+/* read [-r] [-d delim] [-n count] [-t seconds] [-p prompt] [-u fd]
+ * [-a array] [name ...] reads a line into the names, or REPLY. */
+int cmd_read(char** command) {
+  bool raw = false;
+  int delimiter = '\n';
+  size_t limit = 0;
+  int timeout_ms = -1;
+  int fd = STDIN_FILENO;
+  char* array_name = NULL;
+  char* prompt = NULL;
+  int i = 1;
+  for (; command[i] != NULL && command[i][0] == '-'; i++) {
+    if (strcmp(command[i], "--") == 0) {
+      i++;
+      break;
+    }
+    char option = command[i][1];
+    if (option == 'r' && command[i][2] == '\0') {
+      raw = true;
+      continue;
+    }
+    char* value = strchr("dntpua", option) ? option_value(command, &i) : NULL;
+    if (value == NULL) {
+      fprintf(stderr, "read: %s: invalid option\n", command[i]);
+      return 2;
+    }
+    if (option == 'd') delimiter = (unsigned char)value[0];
+    if (option == 'n') limit = atol(value);
+    if (option == 't') timeout_ms = parse_duration(value) / 1000000;
+    if (option == 'p') prompt = value;
+    if (option == 'u') fd = atoi(value);
+    if (option == 'a') array_name = value;
+  }
+  if (prompt != NULL && isatty(fd)) {
+    fprintf(stderr, "%s", prompt);
+    fflush(stderr);
+  }
+
+  struct reader* r = reader_open(fd, false, timeout_ms);
+  char* text = NULL;
+  size_t length = 0;
+  int status = 0;
+  while (1) {
+    char* record;
+    bool delimited;
+    ssize_t n = reader_next(r, delimiter, limit ? limit - length : 0, &record,
+                            &delimited);
+    if (n < 0) {
+      status = n == -1 || errno != ETIMEDOUT ? 1 : 128 + SIGALRM;
+      if (n == -2 && errno != ETIMEDOUT) perror("read");
+      if (text == NULL) break;
+    } else {
+      text = realloc(text, length + n + 1);
+      memcpy(text + length, record, n + 1);
+      length += n;
+      if (!delimited && (limit == 0 || length < limit)) status = 1;
+    }
+    /* Without -r a \ before the delimiter continues the line */
+    if (n < 0 || raw || !delimited || length == 0 || text[length - 1] != '\\')
+      break;
+    text[--length] = '\0';
+  }
+  reader_close(r);
+  if (text == NULL) return status;
+
+  if (!raw) { /* Backslashes quote the next character */
+    size_t k = 0;
+    for (size_t j = 0; j < length; j++) {
+      if (text[j] == '\\' && j + 1 < length) j++;
+      text[k++] = text[j];
+    }
+    text[k] = '\0';
+  }
+  if (array_name != NULL) {
+    struct array* a = to_array(array_name, false);
+    array_clear(a);
+    assign_fields(text, NULL, a);
+  } else if (command[i] == NULL) {
+    simple_map_set(&variables, "REPLY", text);
+  } else {
+    assign_fields(text, command + i, NULL);
+  }
+  free(text);
+  return status;
+}
+
+/* mapfile [-t] [-n count] [-s skip] [-d delim] [-u fd] [array] reads lines
+ * into the elements of array, or MAPFILE. */
+int cmd_mapfile(char** command) {
+  bool trim = false;
+  int delimiter = '\n';
+  size_t count = 0, skip = 0;
+  int fd = STDIN_FILENO;
+  int i = 1;
+  for (; command[i] != NULL && command[i][0] == '-'; i++) {
+    char option = command[i][1];
+    if (option == 't' && command[i][2] == '\0') {
+      trim = true;
+      continue;
+    }
+    char* value = strchr("nsdu", option) ? option_value(command, &i) : NULL;
+    if (value == NULL) {
+      fprintf(stderr, "%s: %s: invalid option\n", command[0], command[i]);
+      return 2;
+    }
+    if (option == 'n') count = atol(value);
+    if (option == 's') skip = atol(value);
+    if (option == 'd') delimiter = (unsigned char)value[0];
+    if (option == 'u') fd = atoi(value);
+  }
+  struct array* a = to_array(command[i] ? command[i] : "MAPFILE", false);
+  array_clear(a);
+
+  /* Without a count all the input is used, it can be read in bulk */
+  struct reader* r = reader_open(fd, count == 0, -1);
+  char* record;
+  bool delimited;
+  ssize_t n;
+  for (size_t lines = 0; count == 0 || lines < count + skip; lines++) {
+    if ((n = reader_next(r, delimiter, 0, &record, &delimited)) < 0) break;
+    if (lines < skip) continue;
+    if (delimited && !trim) {
+      record[n] = delimiter;
+      record[n + 1] = '\0';
+    }
+    array_append(a, record);
+  }
+  reader_close(r);
+  if (n == -2) {
+    perror(command[0]);
+    return 1;
+  }
+  return 0;
+}
+
+/* printf [-v name] format [arguments]. The output is collected and written
+ * with a single write, or assigned to name. */
+int cmd_printf(char** command) {
+  int i = 1;
+  char* name = NULL;
+  /* -v without a name is an error, not the format */
+  if (command[i] != NULL && strcmp(command[i], "-v") == 0) name = command[++i];
+  if (name != NULL) i++;
+  if (command[i] != NULL && strcmp(command[i], "--") == 0) i++;
+  if (command[i] == NULL) {
+    fprintf(stderr, "printf: usage: printf [-v name] format [arguments]\n");
+    return 2;
+  }
+  struct output out = {NULL, 0, 0};
+  int status = format_print(command[i], command + i + 1, &out);
+  if (name != NULL) {
+    char empty = '\0';
+    char* value = out.data ? out.data : &empty;
+    if (out.data) out.data[out.length] = '\0';
+    char* args[] = {name, value, NULL};
+    assign(args, 1);
+  } else {
+    fflush(stdout);
+    for (size_t done = 0; done < out.length;) {
+      ssize_t n = write(STDOUT_FILENO, out.data + done, out.length - done);
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0) {
+        perror("printf");
+        status = 1;
+        break;
+      }
+      done += n;
+    }
+  }
+  free(out.data);
+  return status;
+}
+
+int cmd_test(char** command) { return test_run(command, &variables); }
+
+/* Calls the function named by command[0] */
+int cmd_function(char** command) {
+  script* body = function_find(command[0]);
+  if (body == NULL) {
+    fprintf(stderr, "function: usage: name() { commands; }\n");
+    return 2;
+  }
+  /* The body runs before the shell is done, nothing in it is the last
+   * command even when the call is */
+  bool was_final = final_line;
+  final_line = false;
+  int status = function_call(body, command, &variables);
+  final_line = was_final;
+  return status;
+}
+
+/* local name[=value] ... saves the values names have outside the function,
+ * a name without a value is unset inside it */
+int cmd_local(char** command) {
+  for (int i = 1; command[i] != NULL; i++) {
+    char* equals = strchr(command[i], '=');
+    size_t length = equals ? equals - command[i] : strlen(command[i]);
+    if (length > 0 && command[i][length - 1] == '+') length--;
+    char name[length + 1];
+    memcpy(name, command[i], length);
+    name[length] = '\0';
+    if (function_local(&variables, name) < 0) {
+      fprintf(stderr, "local: can only be used in a function\n");
+      return 1;
+    }
+    if (equals == NULL) {
+      simple_map_remove(&variables, name);
+      continue;
+    }
+    *equals = '\0';
+    char* args[] = {command[i], equals + 1, NULL};
+    if (assign(args, 1) != 0) return 1;
+  }
+  return 0;
+}
+
+/* return [status], the status defaults to the one of the last command */
+int cmd_return(char** command) {
+  char* last = simple_map_get(&variables, "?");
+  int status = command[1] ? atoi(command[1]) : last ? atoi(last) : 0;
+  if (function_return() < 0) {
+    fprintf(stderr, "return: can only return from a function\n");
+    return 1;
+  }
+  return status & 0xff;
+}
+
+int cmd_shift(char** command) {
+  int count = command[1] ? atoi(command[1]) : 1;
+  return positional_shift(count) < 0 ? 1 : 0;
+}
+
 /* There's no handling for processes that were stopped */
 void signal_handler(int signum) {
   if (signum == SIGINT || signum == SIGTSTP) {
@@ -622,10 +1956,6 @@ void signal_handler(int signum) {
     } else if (active_pgid != -1) {
       killpg(active_pgid, signum);
     }
-  } else if (signum == SIGCHLD) {
-    int status = 1;
-    waitpid(-1, &status, WSTOPPED | WNOHANG);
-    save_last_status(status);
   }
 }
 
@@ -657,156 +1987,314 @@ void init_shell() {
     signal(SIGTTOU, SIG_IGN);
     signal(SIGINT, signal_handler);
     signal(SIGTSTP, signal_handler);
-    signal(SIGCHLD, signal_handler);
   }
 }
 
-char** str_split(char* str, const char delimiter) {
-  char** result = 0;
-  size_t count = 0;
-  char* tmp = str;
-  char* last_comma = 0;
-  char delim[2];
-  delim[0] = delimiter;
-  delim[1] = 0;
+/* Compiles text and runs it, returns status of the last command. */
+int run_script(const char* text) {
+  script* program = script_compile(text, NULL);
+  if (program == NULL) return 1;
+  int status = script_run(program, &variables, false);
+  script_free(program);
+  return status;
+}
 
-  /* Count how many elements will be extracted. */
-  while (*tmp) {
-    if (delimiter == *tmp) {
-      count++;
-      last_comma = tmp;
+/* Runs the -c script, arguments after it are $0 and the positional
+ * parameters. The shell exits after it, so its last command is executed in
+ * place of the shell when possible. */
+void c_command(int argc, char* argv[]) {
+  if (argc > 2 && (strcmp(argv[1], "-c") == 0)) {
+    if (argc > 3) {
+      simple_map_set(&variables, "0", argv[3]);
+      positional_set(argv + 4);
     }
-    tmp++;
+    script* program = script_compile(argv[2], NULL);
+    if (program == NULL) exit(1);
+    exit(script_run(program, &variables, true));
   }
+}
 
-  /* Add space for trailing token. */
-  count += last_comma < (str + strlen(str) - 1);
+int run_final_line(struct split_line* line) {
+  final_line = true;
+  int status = run_split(line);
+  final_line = false;
+  return status;
+}
 
-  /* Add space for terminating null string so caller
-     knows where the list of returned strings ends. */
-  count++;
+int run_line(const char* text) {
+  if (text[strspn(text, " \t\n")] == '\0') return 0;
+  struct split_line* line = split_line(text);
+  int status = run_split(line);
+  split_line_free(line);
+  return status;
+}
 
-  result = malloc(sizeof(char*) * count);
+/* Runs one input line: pipelines chained with && and || operators. */
+int run_split(struct split_line* line) {
+  memstat_command();
+  test_forget();
 
-  if (result) {
-    size_t index = 0;
-    char* token = strtok(str, delim);
+  struct command* full_command;
+  int parsing_index = 0;
+  int status = 1;
+  while (1) {
+    int inp_fd = STDIN_FILENO;
+    int out_fd = STDOUT_FILENO;
+    int is_redirection;
+
+    /* Split our line into commands with it's arguments. */
+    full_command = parse_split(line, &variables, parsing_index);
+
+    if (full_command != NULL) {  // Valid input
+      /* Tests in a row share stat results, anything else may change files */
+      char* first = command_get_cmd(full_command, 0)[0];
+      if (full_command->cmds_length != 1 ||
+          (strcmp(first, "test") != 0 && strcmp(first, "[") != 0))
+        test_forget();
+      int procsub_fds[full_command->procsubs_length + 1];
+      pid_t procsub_pids[full_command->procsubs_length + 1];
+      spawn_process_substitutions(full_command, procsub_fds, procsub_pids);
+      started_job = 0;
+      zygote_allowed = full_command->procsubs_length == 0;
+      bool batched = batchable(full_command);
+      if (!batched) command_expand_lazy(full_command);
+      bool usage_error =
+          pipemon_parse(command_get_cmd(full_command, 0), &pipemon) < 0;
+
+      is_redirection = open_redirections(full_command, &inp_fd, &out_fd);
+
+      if (usage_error) {
+        status = 2;
+        save_last_status(status);
+      } else if (batched && is_redirection != -1) {
+        status = run_batched(full_command, inp_fd, out_fd);
+        if (inp_fd != STDIN_FILENO) close(inp_fd);
+        if (out_fd != STDOUT_FILENO) close(out_fd);
+      } else if (is_redirection == 1 && full_command->cmds_length == 1 &&
+                 strcmp(command_get_cmd(full_command, 0)[0], "exec") == 0) {
+        status = exec_redirected(command_get_cmd(full_command, 0), inp_fd,
+                                 out_fd);
+      } else if (is_redirection == 1 && full_command->cmds_length == 1 &&
+                 full_command->background == 0 &&
+                 lookup(command_get_cmd(full_command, 0)[0]) >= 0) {
+        status = run_builtin_redirected(command_get_cmd(full_command, 0),
+                                        inp_fd, out_fd);
+        if (inp_fd != STDIN_FILENO) close(inp_fd);
+        if (out_fd != STDOUT_FILENO) close(out_fd);
+      } else if (full_command->cmds_length > 1 || is_redirection == 1 ||
+                 pipemon.interval_ms > 0) {  // Pipes and redirection.
+        status = redirected_execution(full_command, inp_fd, out_fd);
+        if (inp_fd != STDIN_FILENO) close(inp_fd);
+        if (out_fd != STDOUT_FILENO) close(out_fd);
+      } else if (is_redirection == 0 && full_command->cmds_length == 1) {
+        char** args = command_get_cmd(full_command, 0);
+        if (tail_position(full_command) && lookup(args[0]) < 0)
+          replace_shell(args, STDIN_FILENO, STDOUT_FILENO);
+        status = execute_command(args, full_command->background,
+                                 full_command->env_var_definition);
+      }
+
+      finish_process_substitutions(full_command, procsub_fds, procsub_pids);
+      zygote_allowed = true;
+      pipemon.interval_ms = 0;
+      if (function_returning()) {
+        command_destroy(full_command);
+        break;
+      }
 
-    while (token) {
-      *(result + index++) = strdup(token);
-      token = strtok(0, delim);
+      parsing_index = full_command->logical_index;
+      while ((status == 0 && full_command->log_operator == 1) ||
+             (status != 0 && full_command->log_operator == 0)) {
+        command_destroy(full_command);
+        full_command = parse_split(line, &variables, parsing_index);
+        if (full_command == NULL) return status;
+        parsing_index = full_command->logical_index;
+      }
+      command_destroy(full_command);
+      if (parsing_index == 0) break;
+    } else {
+      fprintf(stderr, "Syntax error!\n");
+      break;
     }
-    *(result + index) = 0;
   }
+  return status;
+}
+
+/* Collects what the rc file changed: variables whose value differs from
+ * the inherited environment, which the shell never modifies, and names it
+ * exported. */
+void collect_rc_state(simple_map* changed, simple_map* exported) {
+  for (int i = 0; i < simple_map_size(&variables); i++) {
+    char *name, *value;
+    simple_map_entry(&variables, i, &name, &value);
+    char* inherited = getenv(name);
+    if (inherited == NULL || strcmp(inherited, value) != 0)
+      simple_map_set(changed, name, value);
+  }
+  for (char** entry = exports_envp(); *entry != NULL; entry++) {
+    char* equals = strchr(*entry, '=');
+    char* name = strndup(*entry, equals - *entry);
+    char* inherited = getenv(name);
+    if (inherited == NULL || strcmp(inherited, equals + 1) != 0)
+      simple_map_set(exported, name, "");
+    free(name);
+  }
+}
 
-  return result;
+/* Runs ~/.shellrc. With --snapshot the state it leaves behind is saved to
+ * ~/.shellrc.snap and restored from there while the rc file and the
+ * inherited environment are unchanged. */
+void load_rc() {
+  char* home = simple_map_get(&variables, "HOME");
+  if (!rc_enabled || home == NULL) return;
+  char rc_path[strlen(home) + 16];
+  sprintf(rc_path, "%s/.shellrc", home);
+  struct stat rc;
+  if (stat(rc_path, &rc) != 0) return;
+
+  char snapshot_path[sizeof(rc_path) + 8];
+  sprintf(snapshot_path, "%s.snap", rc_path);
+  simple_map changed, exported;
+  simple_map_new(&changed);
+  simple_map_new(&exported);
+
+  simple_map* loaded[] = {&variables, &exported, &path_cache};
+  int count = sizeof(loaded) / sizeof(loaded[0]);
+  if (snapshot_enabled &&
+      snapshot_load(snapshot_path, &rc, environ, loaded, count) == 0) {
+    for (int i = 0; i < simple_map_size(&exported); i++) {
+      char *name, *value;
+      simple_map_entry(&exported, i, &name, &value);
+      exports_add(name);
+    }
+  } else {
+    FILE* file = fopen(rc_path, "r");
+    char* text = malloc(rc.st_size + 1);
+    size_t length = file ? fread(text, 1, rc.st_size, file) : 0;
+    text[length] = '\0';
+    if (file) fclose(file);
+    run_script(text);
+    free(text);
+
+    /* Arrays and functions aren't part of snapshots, an rc file defining
+     * them runs every time */
+    if (snapshot_enabled && arrays_count() == 0 && functions_count() == 0) {
+      collect_rc_state(&changed, &exported);
+      simple_map* saved[] = {&changed, &exported, &path_cache};
+      if (snapshot_save(snapshot_path, &rc, environ, saved, count) != 0)
+        perror(snapshot_path);
+    }
+  }
+  simple_map_dispose(&changed);
+  simple_map_dispose(&exported);
+  save_last_status(0);
 }
 
-void c_command(int argc, char* argv[]) {
-  if (argc > 2 && (strcmp(argv[1], "-c") == 0)) {
-    char** splitted = str_split(argv[2], ';');
-    int length = get_length(splitted) + 1;
-    for (int i = 0; i < length; i++) {
-      char buffer[4096];
-      strcpy(buffer, splitted[i]);
-      struct command* executable = parse(buffer, &variables, 0);
-      execute_command(command_get_cmd(executable, 0), executable->background,
-                      executable->env_var_definition);
+/* Handles --options before the regular arguments, returns how many
+ * arguments were consumed. */
+int parse_options(int argc, char* argv[]) {
+  int consumed = 0;
+  for (int i = 1; i < argc && strncmp(argv[i], "--", 2) == 0; i++) {
+    if (strcmp(argv[i], "--zygote") == 0) {
+      if (zygote_start() != 0) perror("zygote");
+    } else if (strcmp(argv[i], "--norc") == 0) {
+      rc_enabled = false;
+    } else if (strcmp(argv[i], "--snapshot") == 0) {
+      snapshot_enabled = true;
+    } else if ((strcmp(argv[i], "--server") == 0 ||
+                strcmp(argv[i], "--client") == 0) && i + 1 < argc) {
+      *(argv[i][2] == 's' ? &server_path : &client_path) = argv[i + 1];
+      consumed++;
+      i++;
+    } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+      record_path = argv[i + 1];
+      consumed++;
+      i++;
+    } else {
+      fprintf(stderr, "%s: unknown option\n", argv[i]);
+      exit(2);
     }
-    exit(0);
+    consumed++;
   }
+  return consumed;
 }
 
 int main(int argc, char* argv[]) {
-  init_shell();
+  /* The zygote is forked first, while the shell is still small. */
+  int consumed = parse_options(argc, argv);
+  argv[consumed] = argv[0];
+  argc -= consumed;
+  argv += consumed;
+
+  if (client_path != NULL) {
+    if (argc < 3 || strcmp(argv[1], "-c") != 0) {
+      fprintf(stderr, "--client: usage: shell --client SOCKET -c command\n");
+      exit(2);
+    }
+    exit(server_request(client_path, argv[2]));
+  }
+
+  /* -c scripts don't need the terminal, so nothing is set up for it */
+  if (argc > 2 && strcmp(argv[1], "-c") == 0)
+    shell_is_interactive = false;
+  else
+    init_shell();
 
   simple_map_new(&variables);
-  simple_map_put(&variables, strdup("?"), strdup("0"));
+  exports_init(&variables, environ);
+  jobserver_join(simple_map_get(&variables, "MAKEFLAGS"));
+  simple_map_set(&variables, "?", "0");
+  simple_map_new(&path_cache);
+  load_rc();
+
+  if (server_path != NULL) {
+    shell_is_interactive = false;
+    exit(server_run(server_path));
+  }
 
   static char line[4096];
   int line_num = 0;
 
+  if (record_path != NULL && record_open(record_path) != 0) {
+    perror(record_path);
+    exit(2);
+  }
+
   c_command(argc, argv);
   /* Please only print shell prompts when standard input is not a tty */
   if (shell_is_interactive) fprintf(stdout, "%d: ", line_num);
 
+  /* Lines are collected until they form complete commands */
+  char* text = NULL;
+  size_t text_length = 0;
   while (fgets(line, 4096, stdin)) {
-
-    int inp_fd = STDIN_FILENO;
-    int out_fd = STDOUT_FILENO;
-    int is_redirection = 0;
-    struct command* full_command;
-
-    int parsing_index = 0;
-    if (strcmp(line, "\n")) {
-      int status = 1;
-      while(1) {
-        /* Split our line into commands with it's arguments. */
-        full_command = parse(line, &variables, parsing_index);
-
-        if (full_command != NULL) {  // Valid input
-
-          if (full_command->inp_file != NULL) {  // Prepare file if neccessary
-            int fd = open(full_command->inp_file, O_RDONLY);
-            if (fd != -1) {
-              inp_fd = fd;
-              is_redirection = 1;
-            } else {
-              fprintf(stderr, "%s: could not open file\n",
-                      full_command->inp_file);
-              is_redirection = -1;
-            }
-          }
-          if (full_command->out_file != NULL) {  // Prepare file if neccessary
-            mode_t f_mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH;
-            int f_flags;
-            if (full_command->append_to_file == 1)
-              f_flags = O_WRONLY | O_CREAT | O_APPEND;
-            else
-              f_flags = O_WRONLY | O_CREAT | O_TRUNC;
-            int fd = open(full_command->out_file, f_flags, f_mode);
-            if (fd != -1) {
-              out_fd = fd;
-              is_redirection = 1;
-            } else {
-              fprintf(stderr, "%s: could not open file\n",
-                      full_command->out_file);
-              is_redirection = -1;
-            }
-          }
-
-          if (full_command->cmds_length > 1 || is_redirection == 1) {  // Pipes and redirection.
-            status = redirected_execution(full_command, inp_fd, out_fd);
-            if (inp_fd != STDIN_FILENO) close(inp_fd);
-            if (out_fd != STDOUT_FILENO) close(out_fd);
-          } else if (is_redirection == 0) { 
-            char** args = command_get_cmd(full_command, 0);
-            status = execute_command(args, full_command->background,
-                            full_command->env_var_definition);
-          }
-
-          parsing_index = full_command->logical_index;
-          while ((status == 0 && full_command->log_operator == 1) || (status != 0 && full_command->log_operator == 0)) {
-            command_destroy(full_command);
-            full_command = parse(line, &variables, parsing_index);
-            parsing_index = full_command->logical_index;
-          }
-          command_destroy(full_command);
-          if(parsing_index == 0) break;
-        } else {
-          fprintf(stderr, "Syntax error!\n");
-          break;
-        }
-      }
+    size_t length = strlen(line);
+    text = realloc(text, text_length + length + 1);
+    strcpy(text + text_length, line);
+    text_length += length;
+
+    bool incomplete = false;
+    if (recording()) record_begin();
+    script* program = script_compile(text, &incomplete);
+    if (program == NULL && incomplete) {
+      if (shell_is_interactive) fprintf(stdout, "> ");
+      continue;
     }
+    if (program != NULL) {
+      int status = script_run(program, &variables, false);
+      script_free(program);
+      if (recording()) record_end(text, status);
+    }
+    text_length = 0;
 
+    /* Finished background jobs are reported before the prompt */
+    jobs_notify(shell_is_interactive ? stdout : NULL);
     if (shell_is_interactive)
       /* Please only print shell prompts when standard input is not a tty */
       fprintf(stdout, "%d: ", ++line_num);
-
-    /* Clean up memory */
-    //command_destroy(full_command);
   }
+  if (text_length > 0) fprintf(stderr, "Syntax error!\n");
+  free(text);
 
   return 0;
 }
@@ -1,3 +1,4 @@
+#include <stdint.h>
 #include "simple_map.h"
 
 struct key_value {
@@ -11,33 +12,125 @@ static void free_elem(void *elem) {
   free(kv->value);
 }
 
-void simple_map_new(simple_map* m) {
-    VectorNew(&m->storage, sizeof(struct key_value), free_elem, 4);
+/* FNV-1a */
+static uint32_t hash(const char* key) {
+    uint32_t h = 2166136261u;
+    for (; *key; key++) h = (h ^ (unsigned char)*key) * 16777619u;
+    return h;
 }
 
-void simple_map_put(simple_map* m, char* key, char* value) {
+/* Slot holding key, or the free slot where it would go. */
+static int find_slot(simple_map* m, const char* key) {
+    int mask = m->slot_count - 1;
+    for (int i = hash(key) & mask;; i = (i + 1) & mask) {
+        if (m->slots[i] < 0) return i;
+        struct key_value* kv = VectorNth(&m->storage, m->slots[i]);
+        if (strcmp(kv->key, key) == 0) return i;
+    }
+}
+
+/* Position of key in storage, or -1. */
+static int find(simple_map* m, const char* key) {
+    if (m->slot_count == 0) return -1;
+    return m->slots[find_slot(m, key)];
+}
+
+/* Builds the index again, keeping it at most half full. */
+static void reindex(simple_map* m) {
     int size = VectorLength(&m->storage);
+    int count = 8;
+    while (count < 2 * (size + 1)) count *= 2;
+    if (count != m->slot_count) {
+        free(m->slots);
+        m->slots = malloc(count * sizeof(int));
+        m->slot_count = count;
+    }
+    memset(m->slots, -1, count * sizeof(int));
     for (int i = 0; i < size; i++) {
         struct key_value* kv = VectorNth(&m->storage, i);
-        if (strcmp(kv->key, key) == 0) {
-            free(kv->value);
-            kv->value = value;
-            return;
-        }
+        m->slots[find_slot(m, kv->key)] = i;
+    }
+}
+
+static void append(simple_map* m, struct key_value* kv) {
+    VectorAppend(&m->storage, kv);
+    int size = VectorLength(&m->storage);
+    if (2 * size > m->slot_count)
+        reindex(m);
+    else
+        m->slots[find_slot(m, kv->key)] = size - 1;
+}
+
+void simple_map_new(simple_map* m) {
+    VectorNew(&m->storage, sizeof(struct key_value), free_elem, 4);
+    m->slots = NULL;
+    m->slot_count = 0;
+    m->on_put = NULL;
+}
+
+void simple_map_put(simple_map* m, char* key, char* value) {
+    int position = find(m, key);
+    if (position >= 0) {
+        struct key_value* kv = VectorNth(&m->storage, position);
+        free(key);
+        free(kv->value);
+        kv->value = value;
+        if (m->on_put) m->on_put(kv->key, value);
+        return;
     }
     struct key_value kv;
     kv.key = key;
     kv.value = value;
-    VectorAppend(&m->storage, &kv);
+    append(m, &kv);
+    if (m->on_put) m->on_put(key, value);
+}
+
+void simple_map_set(simple_map* m, const char* key, const char* value) {
+    size_t length = strlen(value) + 1;
+    int position = find(m, key);
+    if (position >= 0) {
+        struct key_value* kv = VectorNth(&m->storage, position);
+        if (kv->value == value) return;
+        kv->value = realloc(kv->value, length);
+        memcpy(kv->value, value, length);
+        if (m->on_put) m->on_put(kv->key, kv->value);
+        return;
+    }
+    struct key_value kv;
+    kv.key = strdup(key);
+    kv.value = memcpy(malloc(length), value, length);
+    append(m, &kv);
+    if (m->on_put) m->on_put(kv.key, kv.value);
 }
 
 char* simple_map_get(simple_map* m, char* key) {
-    int size = VectorLength(&m->storage);
-    for (int i = 0; i < size; i++) {
-        struct key_value* kv = VectorNth(&m->storage, i);
-        if (strcmp(kv->key, key) == 0) return kv->value;
+    int position = find(m, key);
+    if (position < 0) return NULL;
+    struct key_value* kv = VectorNth(&m->storage, position);
+    return kv->value;
+}
+
+void simple_map_remove(simple_map* m, char* key) {
+    if (m->slot_count == 0) return;
+    int mask = m->slot_count - 1;
+    int hole = find_slot(m, key);
+    int position = m->slots[hole];
+    if (position < 0) return;
+    /* Entries probed past the hole move back into it, unless their own
+     * slot comes after it */
+    for (int i = (hole + 1) & mask; m->slots[i] >= 0; i = (i + 1) & mask) {
+        struct key_value* kv = VectorNth(&m->storage, m->slots[i]);
+        int home = hash(kv->key) & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            m->slots[hole] = m->slots[i];
+            hole = i;
+        }
     }
-    return NULL;
+    m->slots[hole] = -1;
+    /* Later entries move down in storage */
+    for (int i = 0; i < m->slot_count; i++)
+        if (m->slots[i] > position) m->slots[i]--;
+    VectorDelete(&m->storage, position);
 }
 
 int simple_map_size(simple_map* m) {
@@ -45,7 +138,13 @@ int simple_map_size(simple_map* m) {
     return size;
 }
 
+void simple_map_entry(simple_map* m, int index, char** key, char** value) {
+    struct key_value* kv = VectorNth(&m->storage, index);
+    *key = kv->key;
+    *value = kv->value;
+}
+
 void simple_map_dispose(simple_map* m) {
     VectorDispose(&m->storage);
+    free(m->slots);
 }
-
@@ -3,17 +3,34 @@
 
 /* Works only for C strings, uses vector.
  * Strings must be allocated in heap or seg fault will occur.
+ * Entries keep their insertion order in storage and are found through a
+ * hash index, so lookups don't depend on the size of the map.
  */
 typedef struct {
     vector storage;
+    /* Open addressing table of storage positions, -1 marks a free slot */
+    int* slots;
+    int slot_count;
+    /* Called after every put with the stored key and value, may be NULL */
+    void (*on_put)(char* key, char* value);
 } simple_map;
 
 void simple_map_new(simple_map* m);
 
 void simple_map_put(simple_map* m, char* key, char* value);
 
+/* Stores copies of key and value. If key exists, its value buffer is
+ * reused when the new value fits. */
+void simple_map_set(simple_map* m, const char* key, const char* value);
+
 char* simple_map_get(simple_map* m, char* key);
 
+/* Removes key and its value, does nothing if it isn't there. */
+void simple_map_remove(simple_map* m, char* key);
+
 void simple_map_dispose(simple_map* m);
 
 int simple_map_size(simple_map* m);
+
+/* Key and value of the entry at index, for iterating over the map. */
+void simple_map_entry(simple_map* m, int index, char** key, char** value);
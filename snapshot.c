@@ -0,0 +1,139 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "snapshot.h"
+
+#define SNAPSHOT_MAGIC "shsnap2"
+
+/* File header. It is followed by every map: a uint32_t number of entries,
+ * then key and value of each entry as NUL terminated strings. */
+struct snapshot_header {
+  char magic[8];
+  uint64_t rc_inode;
+  uint64_t rc_size;
+  int64_t rc_mtime_sec;
+  int64_t rc_mtime_nsec;
+  uint64_t environment; /* Hash of the environment the rc file ran with */
+  uint32_t count;
+  uint32_t length; /* Bytes after the header */
+};
+
+/* FNV-1a of every entry, summed so the order of the entries doesn't
+ * matter. */
+static uint64_t hash_environment(char** environment) {
+  uint64_t sum = 0;
+  for (; *environment != NULL; environment++) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char* c = *environment; *c; c++)
+      hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+    sum += hash;
+  }
+  return sum;
+}
+
+static void fill_header(struct snapshot_header* header, const struct stat* rc,
+                        char** environment, int count, size_t length) {
+  memset(header, 0, sizeof(*header));
+  memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+  header->rc_inode = rc->st_ino;
+  header->rc_size = rc->st_size;
+  header->rc_mtime_sec = rc->st_mtim.tv_sec;
+  header->rc_mtime_nsec = rc->st_mtim.tv_nsec;
+  header->environment = hash_environment(environment);
+  header->count = count;
+  header->length = length;
+}
+
+/* Reads a string at *p, which must end before end. */
+static const char* next_string(const char** p, const char* end) {
+  const char* s = *p;
+  const char* nul = s < end ? memchr(s, '\0', end - s) : NULL;
+  if (nul == NULL) return NULL;
+  *p = nul + 1;
+  return s;
+}
+
+int snapshot_load(const char* path, const struct stat* rc,
+                  char** environment, simple_map* maps[], int count) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return -1;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < sizeof(struct snapshot_header)) {
+    close(fd);
+    return -1;
+  }
+  char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return -1;
+
+  struct snapshot_header expected;
+  fill_header(&expected, rc, environment, count,
+              st.st_size - sizeof(expected));
+  int result = -1;
+  if (memcmp(data, &expected, sizeof(expected)) == 0) {
+    const char* p = data + sizeof(expected);
+    const char* end = data + st.st_size;
+    int i = 0;
+    for (; i < count && p + sizeof(uint32_t) <= end; i++) {
+      uint32_t entries;
+      memcpy(&entries, p, sizeof(entries));
+      p += sizeof(entries);
+      for (; entries > 0; entries--) {
+        const char* key = next_string(&p, end);
+        const char* value = key ? next_string(&p, end) : NULL;
+        if (value == NULL) break;
+        simple_map_set(maps[i], key, value);
+      }
+      if (entries > 0) break;
+    }
+    if (i == count && p == end) result = 0;
+  }
+  munmap(data, st.st_size);
+  return result;
+}
+
+int snapshot_save(const char* path, const struct stat* rc,
+                  char** environment, simple_map* maps[], int count) {
+  size_t length = 0;
+  for (int i = 0; i < count; i++) {
+    length += sizeof(uint32_t);
+    for (int j = 0; j < simple_map_size(maps[i]); j++) {
+      char *key, *value;
+      simple_map_entry(maps[i], j, &key, &value);
+      length += strlen(key) + strlen(value) + 2;
+    }
+  }
+
+  char* data = malloc(sizeof(struct snapshot_header) + length);
+  fill_header((struct snapshot_header*)data, rc, environment, count, length);
+  char* p = data + sizeof(struct snapshot_header);
+  for (int i = 0; i < count; i++) {
+    uint32_t entries = simple_map_size(maps[i]);
+    memcpy(p, &entries, sizeof(entries));
+    p += sizeof(entries);
+    for (int j = 0; j < entries; j++) {
+      char *key, *value;
+      simple_map_entry(maps[i], j, &key, &value);
+      p = stpcpy(p, key) + 1;
+      p = stpcpy(p, value) + 1;
+    }
+  }
+
+  /* Other shells may be reading the old snapshot or writing a new one. */
+  char temporary[strlen(path) + 32];
+  sprintf(temporary, "%s.%d", path, (int)getpid());
+  int result = -1;
+  FILE* file = fopen(temporary, "w");
+  if (file != NULL) {
+    size_t written = fwrite(data, 1, p - data, file);
+    if (fclose(file) == 0 && written == p - data)
+      result = rename(temporary, path);
+    if (result != 0) unlink(temporary);
+  }
+  free(data);
+  return result;
+}
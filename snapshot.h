@@ -0,0 +1,21 @@
+#pragma once
+#include <sys/stat.h>
+#include "simple_map.h"
+
+/* Snapshot of the state left by the rc file: a list of string maps
+ * (variables, exports, path cache...) written to a single file that is
+ * mapped and copied back on startup instead of running the rc file again.
+ * A snapshot is only used while the rc file has the same inode, size and
+ * modification time as when the snapshot was made, and the shell inherited
+ * the same environment, which the rc file may expand. */
+
+/* Fills the maps from the snapshot at path. Returns 0 on success, -1 if the
+ * snapshot is missing, corrupt, older than the rc file or made with another
+ * environment. */
+int snapshot_load(const char* path, const struct stat* rc,
+                  char** environment, simple_map* maps[], int count);
+
+/* Writes the maps to path, replacing any previous snapshot atomically.
+ * Returns 0 on success. */
+int snapshot_save(const char* path, const struct stat* rc,
+                  char** environment, simple_map* maps[], int count);
@@ -0,0 +1,299 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "arrays.h"
+#include "test.h"
+
+/* Few paths are checked per command, a linear search beats hashing */
+#define CACHED_PATHS 8
+
+/* Result of a stat or lstat of path, error is its errno or 0 */
+struct cached_stat {
+  char* path;
+  bool link;
+  int error;
+  struct stat st;
+};
+
+static struct cached_stat cache[CACHED_PATHS];
+static int cached = 0;
+/* Next entry to replace when the cache is full */
+static int victim = 0;
+
+/* An expression being evaluated, args[pos] is the next word */
+struct expression {
+  char** args;
+  int count;
+  int pos;
+  simple_map* variables;
+  const char* name; /* test or [, for messages */
+  bool invalid;
+};
+
+void test_forget() {
+  for (int i = 0; i < cached; i++) free(cache[i].path);
+  cached = 0;
+  victim = 0;
+}
+
+/* Stats path, or lstats it when link is set, through the cache. Returns
+ * NULL with errno set if it fails. */
+static struct stat* cached_stat(const char* path, bool link) {
+  for (int i = 0; i < cached; i++) {
+    if (cache[i].link == link && strcmp(cache[i].path, path) == 0) {
+      errno = cache[i].error;
+      return cache[i].error == 0 ? &cache[i].st : NULL;
+    }
+  }
+  struct cached_stat* entry;
+  if (cached < CACHED_PATHS) {
+    entry = &cache[cached++];
+  } else {
+    entry = &cache[victim];
+    victim = (victim + 1) % CACHED_PATHS;
+    free(entry->path);
+  }
+  entry->path = strdup(path);
+  entry->link = link;
+  int failed = link ? lstat(path, &entry->st) : stat(path, &entry->st);
+  entry->error = failed ? errno : 0;
+  errno = entry->error;
+  return entry->error == 0 ? &entry->st : NULL;
+}
+
+static bool in_group(gid_t gid) {
+  static gid_t* groups = NULL;
+  static int group_count = -1;
+  if (gid == getegid()) return true;
+  if (group_count < 0) {
+    group_count = getgroups(0, NULL);
+    if (group_count < 0) group_count = 0;
+    groups = malloc((group_count + 1) * sizeof(gid_t));
+    group_count = getgroups(group_count, groups);
+    if (group_count < 0) group_count = 0;
+  }
+  for (int i = 0; i < group_count; i++)
+    if (groups[i] == gid) return true;
+  return false;
+}
+
+/* Whether the effective user may access the file with mode, one of
+ * R_OK, W_OK or X_OK. Decided from the stat alone like access(2) does
+ * without ACLs, so no second system call is needed. */
+static bool permitted(struct stat* st, int mode) {
+  uid_t uid = geteuid();
+  if (uid == 0)
+    return mode != X_OK || (st->st_mode & 0111) || S_ISDIR(st->st_mode);
+  int shift = st->st_uid == uid ? 6 : in_group(st->st_gid) ? 3 : 0;
+  int bit = mode == R_OK ? 4 : mode == W_OK ? 2 : 1;
+  return (st->st_mode >> shift) & bit;
+}
+
+static bool integer(struct expression* e, const char* text, long long* value) {
+  char* end;
+  errno = 0;
+  *value = strtoll(text, &end, 10);
+  while (*end == ' ' || *end == '\t') end++;
+  if (end == text || *end != '\0' || errno != 0) {
+    fprintf(stderr, "%s: %s: integer expression expected\n", e->name, text);
+    e->invalid = true;
+    return false;
+  }
+  return true;
+}
+
+static bool newer(struct timespec a, struct timespec b) {
+  return a.tv_sec > b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec > b.tv_nsec);
+}
+
+static bool is_unary(const char* op) {
+  return op[0] == '-' && op[1] != '\0' && op[2] == '\0' &&
+         strchr("bcdefghkprstuwxzGLNOSnv", op[1]) != NULL;
+}
+
+static bool is_binary(const char* op) {
+  static const char* const operators[] = {
+      "=",   "==",  "!=",  "<",   ">",   "-eq", "-ne", "-lt",
+      "-le", "-gt", "-ge", "-nt", "-ot", "-ef", NULL};
+  for (int i = 0; operators[i] != NULL; i++)
+    if (strcmp(op, operators[i]) == 0) return true;
+  return false;
+}
+
+static bool unary(struct expression* e, char op, const char* operand) {
+  struct stat* st;
+  switch (op) {
+    case 'n': return operand[0] != '\0';
+    case 'z': return operand[0] == '\0';
+    case 't': {
+      long long fd;
+      return integer(e, operand, &fd) && fd >= 0 && fd <= INT_MAX &&
+             isatty(fd);
+    }
+    case 'v': {
+      char* bracket = strchr(operand, '[');
+      if (bracket == NULL)
+        return simple_map_get(e->variables, (char*)operand) != NULL ||
+               array_find(operand) != NULL;
+      char name[bracket - operand + 1];
+      memcpy(name, operand, bracket - operand);
+      name[bracket - operand] = '\0';
+      size_t length = strlen(bracket);
+      struct array* a = array_find(name);
+      if (a == NULL || bracket[length - 1] != ']') return false;
+      char subscript[length];
+      memcpy(subscript, bracket + 1, length - 2);
+      subscript[length - 2] = '\0';
+      return array_get(a, subscript, e->variables) != NULL;
+    }
+    case 'h':
+    case 'L':
+      st = cached_stat(operand, true);
+      return st != NULL && S_ISLNK(st->st_mode);
+  }
+  st = cached_stat(operand, false);
+  if (st == NULL) return false;
+  switch (op) {
+    case 'e': return true;
+    case 'f': return S_ISREG(st->st_mode);
+    case 'd': return S_ISDIR(st->st_mode);
+    case 'b': return S_ISBLK(st->st_mode);
+    case 'c': return S_ISCHR(st->st_mode);
+    case 'p': return S_ISFIFO(st->st_mode);
+    case 'S': return S_ISSOCK(st->st_mode);
+    case 's': return st->st_size > 0;
+    case 'g': return st->st_mode & S_ISGID;
+    case 'u': return st->st_mode & S_ISUID;
+    case 'k': return st->st_mode & S_ISVTX;
+    case 'r': return permitted(st, R_OK);
+    case 'w': return permitted(st, W_OK);
+    case 'x': return permitted(st, X_OK);
+    case 'O': return st->st_uid == geteuid();
+    case 'G': return st->st_gid == getegid();
+    case 'N': return newer(st->st_mtim, st->st_atim);
+  }
+  return false;
+}
+
+static bool binary(struct expression* e, const char* left, const char* op,
+                   const char* right) {
+  if (op[0] != '-') {
+    int order = strcmp(left, right);
+    if (op[0] == '!') return order != 0;
+    if (op[0] == '<') return order < 0;
+    if (op[0] == '>') return order > 0;
+    return order == 0;
+  }
+  if (op[2] == 't' && (op[1] == 'n' || op[1] == 'o')) {
+    struct stat* a = cached_stat(left, false);
+    struct timespec a_time = a ? a->st_mtim : (struct timespec){0, 0};
+    struct stat* b = cached_stat(right, false);
+    if (op[1] == 'o')
+      return b != NULL && (a == NULL || newer(b->st_mtim, a_time));
+    return a != NULL && (b == NULL || newer(a_time, b->st_mtim));
+  }
+  if (strcmp(op, "-ef") == 0) {
+    struct stat* a = cached_stat(left, false);
+    if (a == NULL) return false;
+    dev_t dev = a->st_dev;
+    ino_t ino = a->st_ino;
+    struct stat* b = cached_stat(right, false);
+    return b != NULL && b->st_dev == dev && b->st_ino == ino;
+  }
+  long long a, b;
+  if (!integer(e, left, &a) || !integer(e, right, &b)) return false;
+  switch (op[1] << 8 | op[2]) {
+    case 'e' << 8 | 'q': return a == b;
+    case 'n' << 8 | 'e': return a != b;
+    case 'l' << 8 | 't': return a < b;
+    case 'l' << 8 | 'e': return a <= b;
+    case 'g' << 8 | 't': return a > b;
+    default: return a >= b;
+  }
+}
+
+static bool disjunction(struct expression* e);
+
+static bool primary(struct expression* e) {
+  if (e->pos >= e->count) {
+    fprintf(stderr, "%s: argument expected\n", e->name);
+    e->invalid = true;
+    return false;
+  }
+  char** args = e->args + e->pos;
+  int left = e->count - e->pos;
+  /* A binary operator wins, so [ ! = x ] and [ -f = x ] compare strings */
+  if (left >= 3 && is_binary(args[1])) {
+    e->pos += 3;
+    return binary(e, args[0], args[1], args[2]);
+  }
+  if (strcmp(args[0], "!") == 0 && left >= 2) {
+    e->pos++;
+    return !primary(e);
+  }
+  if (strcmp(args[0], "(") == 0 && left >= 2) {
+    e->pos++;
+    bool value = disjunction(e);
+    if (e->pos >= e->count || strcmp(e->args[e->pos], ")") != 0) {
+      if (!e->invalid) fprintf(stderr, "%s: `)' expected\n", e->name);
+      e->invalid = true;
+      return false;
+    }
+    e->pos++;
+    return value;
+  }
+  if (left >= 2 && is_unary(args[0])) {
+    e->pos += 2;
+    return unary(e, args[0][1], args[1]);
+  }
+  e->pos++;
+  return args[0][0] != '\0';
+}
+
+static bool conjunction(struct expression* e) {
+  bool value = primary(e);
+  while (!e->invalid && e->pos < e->count &&
+         strcmp(e->args[e->pos], "-a") == 0) {
+    e->pos++;
+    bool right = primary(e);
+    value = value && right;
+  }
+  return value;
+}
+
+static bool disjunction(struct expression* e) {
+  bool value = conjunction(e);
+  while (!e->invalid && e->pos < e->count &&
+         strcmp(e->args[e->pos], "-o") == 0) {
+    e->pos++;
+    bool right = conjunction(e);
+    value = value || right;
+  }
+  return value;
+}
+
+int test_run(char** args, simple_map* variables) {
+  int count = 0;
+  while (args[count + 1] != NULL) count++;
+  if (strcmp(args[0], "[") == 0) {
+    if (count == 0 || strcmp(args[count], "]") != 0) {
+      fprintf(stderr, "[: missing `]'\n");
+      return 2;
+    }
+    count--;
+  }
+  struct expression e = {args + 1, count, 0, variables, args[0], false};
+  if (count == 0) return 1;
+  bool value = disjunction(&e);
+  if (!e.invalid && e.pos < e.count) {
+    fprintf(stderr, "%s: %s: unexpected argument\n", args[0], e.args[e.pos]);
+    return 2;
+  }
+  return e.invalid ? 2 : !value;
+}
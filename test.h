@@ -0,0 +1,15 @@
+#pragma once
+#include "simple_map.h"
+
+/* The test and [ builtins. File operators share a small stat cache, so
+ * [ -f x -a -r x -a -s x ] does a single stat. The cache lives until
+ * test_forget, which the shell calls before every command that isn't a
+ * test, so no command can change a file between the stat and its use. */
+
+/* Evaluates the expression of test, or of [ when args[0] is "[" and the
+ * last argument is "]". Returns 0 if it is true, 1 if it is false and 2
+ * after printing a message if it is invalid. */
+int test_run(char** args, simple_map* variables);
+
+/* Drops the cached stat results. */
+void test_forget();
@@ -0,0 +1,67 @@
+#!/bin/sh
+# Runs scripts through the shell and compares what they print with what a
+# POSIX shell prints. Every case is a bug that was fixed once.
+#
+# Usage: tests/regressions.sh
+
+SHELL_BIN=${SHELL_BIN:-$(pwd)/shell}
+failed=0
+
+# check NAME SCRIPT EXPECTED runs SCRIPT with -c, so its last command is in
+# tail position, and compares its output and exit status with EXPECTED.
+check() {
+  actual=$("$SHELL_BIN" --norc -c "$2" 2>&1; echo "status $?")
+  if [ "$actual" != "$3" ]; then
+    printf 'FAIL %s\n  expected: %s\n  actual:   %s\n' "$1" "$3" "$actual"
+    failed=$((failed + 1))
+  fi
+}
+
+check "function in tail position runs its whole body" \
+  'f() { /bin/echo one; /bin/echo two; }; f' "one
+two
+status 0"
+check "function in tail position returns its status" \
+  'f() { /bin/echo one; return 4; }; f' "one
+status 4"
+check "defining a function sets \$? to 0" 'false; f() { :; }; echo $?' "0
+status 0"
+check "if without else sets \$?" \
+  'false; if false; then :; fi; echo $?' "0
+status 0"
+check "while that never runs sets \$?" \
+  'false; while false; do :; done; echo $?' "0
+status 0"
+check "case without a match sets \$?" \
+  'false; case x in y) ;; esac; echo $?' "0
+status 0"
+check "if needs a condition" 'if then fi' "Syntax error!
+status 1"
+check "((0)) sets \$? to 1" 'true; ((0)); echo $?' "1
+status 0"
+check "((1)) sets \$? to 0" 'false; ((1)); echo $?' "0
+status 0"
+check "timeout 0 sets no time limit" 'timeout 0 sleep 0.1; echo $?' "0
+status 0"
+check "timeout rejects a bad duration" 'timeout x true' \
+  "timeout: usage: timeout DURATION [-s SIG] [-k KILLAFTER] command
+status 125"
+check "printf reports the conversion after a length modifier" \
+  "printf '%zk'" "printf: %zk: invalid conversion character k
+status 1"
+check "printf -v needs a name" 'printf -v' \
+  "printf: usage: printf [-v name] format [arguments]
+status 2"
+check "arrays take indexes far past their end" \
+  'a[5000000]=x; a[2]=y; a+=(z); echo ${!a[@]} ${a[@]}' "2 5000000 5000001 y x z
+status 0"
+check "appending after unset goes after the last element" \
+  "b=(1 2 3); b[10]=q; unset 'b[10]' 'b[2]'; b+=(x); declare -p b" \
+  'declare -a b=([0]="1" [1]="2" [2]="x")
+status 0'
+
+if [ "$failed" -gt 0 ]; then
+  echo "$failed failed"
+  exit 1
+fi
+echo "all passed"
@@ -1,171 +1,1159 @@
 #include <ctype.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include "arena.h"
+#include "arith.h"
+#include "arrays.h"
+#include "brace.h"
+#include "functions.h"
+#include "pattern.h"
 #include "tokenizer.h"
 #include "simple_map.h"
 
 #include <stdio.h>
 
+/* Arrays live in the command arena and grow to the next power of two
+ * when their size reaches one. */
 static void *vector_push(void* pointer, size_t* size, void* elem) {
   void*** ptr = (void***)pointer;
-  *ptr = realloc(*ptr, sizeof(void*) * (*size + 1));
+  if (*size >= 4 && (*size & (*size - 1)) == 0) {
+    void** grown = arena_alloc(&command_arena, sizeof(void*) * *size * 2);
+    memcpy(grown, *ptr, sizeof(void*) * *size);
+    *ptr = grown;
+  } else if (*size == 0) {
+    *ptr = arena_alloc(&command_arena, sizeof(void*) * 4);
+  }
   (*ptr)[*size] = elem;
   *size += 1;
   return elem;
 }
 
-static void *copy_word(char *source, size_t n) {
-  source[n] = '\0';
-  char *word = (char *) malloc(n + 1);
-  strncpy(word, source, n + 1);
-  return word;
+static void *copy_word(const char *source, size_t n) {
+  return arena_strndup(&command_arena, source, n);
 }
 
-struct command* parse(const char *line, simple_map* variables, int i) {
-  if (line == NULL || strlen(line) == i) {
-    return NULL;
+/* Returns index of the parenthesis closing the one at line[open], or -1. */
+static int matching_paren(const char *line, int open, size_t line_length) {
+  int depth = 0;
+  char quote = 0;
+  for (int i = open; i < line_length; i++) {
+    char c = line[i];
+    if (quote) {
+      if (c == quote) quote = 0;
+      else if (c == '\\' && quote == '"') i++;
+    } else if (c == '\'' || c == '"') {
+      quote = c;
+    } else if (c == '\\') {
+      i++;
+    } else if (c == '(') {
+      depth++;
+    } else if (c == ')') {
+      if (--depth == 0) return i;
+    }
   }
+  return -1;
+}
 
-  static char token[4096];
-  size_t n = 0, n_max = 4096;
-  size_t line_length = strlen(line);
+/* Words of the command being parsed. */
+struct parser {
+  struct command* cmds;
+  char** cmd;
+  size_t cmd_len;
+  char* token;
+  char* quoted; /* How each character of token was written, see below */
+  size_t n;
+  int glob;     /* The word has an unquoted *, ? or [ */
+  int brace;    /* The word has an unquoted { */
+  int empty;    /* The word has quotes, so "" is an empty argument */
+  int input_filename;
+  int output_filename;
+};
 
-  struct command* cmds = (struct command *) malloc(sizeof(struct command));
-  cmds->cmds_length = 0;
-  cmds->cmds = NULL;
-  cmds->inp_file = NULL;
-  cmds->out_file = NULL;
-  cmds->append_to_file = 0;
-  cmds->background = 0;
-  cmds->env_var_definition = 0;
-  cmds->log_operator = -1;
-  cmds->logical_index = 0;
+/* Only unquoted characters are brace syntax, values of variables are
+ * still pathname patterns. */
+enum { UNQUOTED, QUOTED, EXPANDED };
+
+static const size_t n_max = 4096;
+
+/* Brace expansions with more words are generated when the command runs */
+static const size_t lazy_words = 1024;
+
+static void add_char(struct parser* p, char c, int quoted) {
+  p->quoted[p->n] = quoted;
+  p->token[p->n++] = c;
+  if (quoted != QUOTED && (c == '*' || c == '?' || c == '[')) p->glob = 1;
+  if (quoted == UNQUOTED && c == '{') p->brace = 1;
+}
+
+static void add_path(const char* path, void* data) {
+  struct parser* p = data;
+  vector_push(&p->cmd, &p->cmd_len, arena_strdup(&command_arena, path));
+}
+
+/* Adds the paths matching the current word, quoted characters are escaped
+ * to match only themselves. Returns the number of paths. */
+static size_t expand_pathnames(struct parser* p) {
+  char pattern[2 * n_max];
+  size_t length = 0;
+  for (size_t i = 0; i < p->n; i++) {
+    if (p->quoted[i] == QUOTED && strchr("*?[]\\", p->token[i]))
+      pattern[length++] = '\\';
+    pattern[length++] = p->token[i];
+  }
+  pattern[length] = '\0';
+  return pattern_expand(pattern, add_path, p);
+}
+
+static void add_argument(struct parser* p, int glob) {
+  /* Patterns matching nothing are kept as they are */
+  if (!glob || expand_pathnames(p) == 0)
+    vector_push(&p->cmd, &p->cmd_len, copy_word(p->token, p->n));
+}
+
+/* Adds the words of a brace expansion. Long ones are left for the executor
+ * with the unexpanded word standing in for them. */
+static void add_braces(struct parser* p, struct brace* braces, int glob) {
+  if (!glob && brace_count(braces) > lazy_words) {
+    struct lazy_word* lazy = arena_alloc(&command_arena, sizeof(struct lazy_word));
+    lazy->cmd_index = p->cmds->cmds_length;
+    lazy->arg_index = p->cmd_len;
+    lazy->braces = braces;
+    vector_push(&p->cmds->lazy, &p->cmds->lazy_length, lazy);
+    vector_push(&p->cmd, &p->cmd_len, copy_word(p->token, p->n));
+    return;
+  }
+  ssize_t n;
+  while ((n = brace_next(braces, p->token, p->quoted, n_max - 1)) >= 0) {
+    if (n == 0) continue;
+    p->n = n;
+    glob = 0;
+    for (size_t i = 0; i < p->n; i++)
+      if (p->quoted[i] != QUOTED && strchr("*?[", p->token[i])) glob = 1;
+    add_argument(p, glob);
+  }
+}
+
+/* Finishes the current word: a redirection file name or an argument. */
+static void finish_word(struct parser* p) {
+  int empty = p->empty;
+  p->empty = 0;
+  if (p->n == 0 && !empty) return;
+  int glob = p->glob, brace = p->brace;
+  p->glob = p->brace = 0;
+  struct brace* braces = NULL;
+  /* Assigned values are never expanded */
+  if (p->cmds->env_var_definition == 1 && p->cmd_len == 1) glob = brace = 0;
+  if (p->input_filename == 1) {
+    p->input_filename = 0;
+    p->cmds->inp_file = (char*)copy_word(p->token, p->n);
+  } else if (p->output_filename == 1) {
+    p->output_filename = 0;
+    p->cmds->out_file = (char*)copy_word(p->token, p->n);
+  } else if (brace && (braces = brace_compile(&command_arena, p->token,
+                                              p->quoted, p->n)) != NULL) {
+    add_braces(p, braces, glob);
+  } else {
+    add_argument(p, glob);
+  }
+  p->n = 0;
+}
+
+/* Appends expanded value to the current word. Unquoted values are split
+ * into separate words on whitespace. */
+static void append_value(struct parser* p, const char* value, int split) {
+  for (; *value; value++) {
+    if (split && isspace(*value))
+      finish_word(p);
+    else if (p->n + 1 < n_max)
+      add_char(p, *value, split ? EXPANDED : QUOTED);
+  }
+}
+
+static const char* lookup_variable(simple_map* variables, char* name,
+                                   char* buffer) {
+  /* A subshell sets $ to the pid of the shell it was forked from */
+  if (strcmp(name, "$") == 0 && simple_map_get(variables, name) == NULL) {
+    sprintf(buffer, "%d", getpid());
+    return buffer;
+  }
+  if (strcmp(name, "#") == 0) {
+    sprintf(buffer, "%d", positional_count());
+    return buffer;
+  }
+  if (isdigit(name[0]) && strcmp(name, "0") != 0)
+    return positional_get(atoi(name));
+  const char* value = simple_map_get(variables, name);
+  struct array* a;
+  /* $a is the first element of an array */
+  if (value == NULL && (a = array_find(name)) != NULL)
+    value = array_get(a, "0", variables);
+  return value;
+}
+
+/* Whether the word being parsed is assigned: the value of NAME=value, or
+ * an argument with = of local, export or declare. Those aren't split. */
+static int assigning(struct parser* p) {
+  if (p->cmds->env_var_definition == 1) return p->cmd_len == 1;
+  return p->cmd_len > 0 && memchr(p->token, '=', p->n) != NULL &&
+         (strcmp(p->cmd[0], "local") == 0 ||
+          strcmp(p->cmd[0], "export") == 0 ||
+          strcmp(p->cmd[0], "declare") == 0);
+}
+
+/* Index of the first c in text outside of quotes, or length. */
+static size_t find_unquoted(const char* text, size_t length, char c) {
+  char quote = 0;
+  for (size_t i = 0; i < length; i++) {
+    if (text[i] == '\\' && quote != '\'') {
+      i++;
+    } else if (quote) {
+      if (text[i] == quote) quote = 0;
+    } else if (text[i] == '\'' || text[i] == '"') {
+      quote = text[i];
+    } else if (text[i] == c) {
+      return i;
+    }
+  }
+  return length;
+}
+
+/* Expands the word after an operator of ${...}, or the key of an
+ * associative array: quotes are removed and $name and ${name} replaced by
+ * their values. For a pattern, quoted characters are escaped with \ so they
+ * only match themselves. */
+static void expand_operand(const char* text, size_t length,
+                           simple_map* variables, int pattern, char* out,
+                           size_t size) {
+  char name[256];
+  char buffer[32];
+  size_t n = 0;
+  char quote = 0;
+  for (size_t i = 0; i < length && n + 2 < size; i++) {
+    char c = text[i];
+    size_t start = i + 1, end;
+    if (c == quote) {
+      quote = 0;
+      continue;
+    } else if (!quote && (c == '\'' || c == '"')) {
+      quote = c;
+      continue;
+    } else if (c == '\\' && quote != '\'' && i + 1 < length) {
+      if (pattern) out[n++] = '\\';
+      out[n++] = text[++i];
+      continue;
+    } else if (c == '$' && quote != '\'' && i + 1 < length &&
+               text[i + 1] == '{') {
+      const char* close = memchr(text + i, '}', length - i);
+      if (close == NULL) break;
+      start = i + 2;
+      end = close - text;
+      i = end;
+    } else if (c == '$' && quote != '\'' && i + 1 < length &&
+               (isalpha(text[i + 1]) || text[i + 1] == '_')) {
+      for (end = start;
+           end < length && (isalnum(text[end]) || text[end] == '_'); end++)
+        ;
+      i = end - 1;
+    } else {
+      if (pattern && quote && strchr("*?[]\\", c)) out[n++] = '\\';
+      out[n++] = c;
+      continue;
+    }
+    snprintf(name, sizeof(name), "%.*s", (int)(end - start), text + start);
+    const char* value = lookup_variable(variables, name, buffer);
+    for (; value && *value && n + 2 < size; value++) {
+      /* Unquoted values are still patterns */
+      if (pattern && quote && strchr("*?[]\\", *value)) out[n++] = '\\';
+      out[n++] = *value;
+    }
+  }
+  out[n] = '\0';
+}
+
+/* Removes the \ escapes of a pattern that has no special characters. */
+static size_t unescape(char* text) {
+  size_t n = 0;
+  for (size_t i = 0; text[i]; i++) {
+    if (text[i] == '\\' && text[i + 1]) i++;
+    text[n++] = text[i];
+  }
+  text[n] = '\0';
+  return n;
+}
+
+/* Length of the longest (or shortest) match of pattern at the start of
+ * text, or -1. A literal is compared directly. */
+static ssize_t match_at(const struct pattern* pattern, const char* literal,
+                        size_t literal_length, const char* text, size_t length,
+                        int longest) {
+  if (literal != NULL)
+    return literal_length <= length && memcmp(text, literal, literal_length) == 0
+               ? literal_length
+               : -1;
+  for (size_t k = 0; k <= length; k++) {
+    size_t n = longest ? length - k : k;
+    if (pattern_match(pattern, text, n)) return n;
+  }
+  return -1;
+}
+
+/* ${v#p}, ${v##p}, ${v%p}, ${v%%p}, ${v/p/r}, ${v//p/r}, ${v/#p/r} and
+ * ${v/%p/r}. The pattern is compiled once, matching doesn't allocate. */
+static const char* match_operator(const char* value, const char* op,
+                                  size_t op_length, simple_map* variables,
+                                  char* out, size_t size) {
+  char kind = op[0];
+  int twice = op_length > 1 && op[1] == kind;
+  char anchor = kind == '/' && op_length > 1 && strchr("#%", op[1]) ? op[1] : 0;
+  if (kind == '#' || kind == '%') anchor = kind;
+  size_t skip = 1 + (twice || (kind == '/' && anchor));
+  op += skip;
+  op_length -= skip;
+  size_t pattern_length = kind == '/' ? find_unquoted(op, op_length, '/')
+                                      : op_length;
+  char text[n_max];
+  expand_operand(op, pattern_length, variables, 1, text, sizeof(text));
+  if (text[0] == '\0') return value;
+
+  struct pattern* pattern = pattern_compile(text, strlen(text));
+  const char* literal = NULL;
+  size_t literal_length = 0;
+  if (pattern_is_literal(pattern)) {
+    literal_length = unescape(text);
+    literal = text;
+  }
+  size_t length = strlen(value);
+  const char* result = value;
+
+  if (kind == '#') {
+    ssize_t n = match_at(pattern, literal, literal_length, value, length, twice);
+    if (n >= 0) result = value + n;
+  } else if (kind == '%') {
+    /* The shortest suffix starts closest to the end */
+    for (size_t k = 0; k <= length; k++) {
+      size_t start = twice ? k : length - k;
+      if (literal ? length - start == literal_length &&
+                        memcmp(value + start, literal, literal_length) == 0
+                  : pattern_match(pattern, value + start, length - start)) {
+        snprintf(out, size, "%.*s", (int)start, value);
+        result = out;
+        break;
+      }
+    }
+  } else {
+    char replacement[n_max];
+    size_t r = pattern_length < op_length ? pattern_length + 1 : op_length;
+    expand_operand(op + r, op_length - r, variables, 0, replacement,
+                   sizeof(replacement));
+    size_t replacement_length = strlen(replacement);
+    size_t n = 0;
+    int replaced = 0;
+    for (size_t i = 0; i <= length && n + 1 < size;) {
+      ssize_t match = -1;
+      if ((!replaced || twice) && (anchor != '#' || i == 0)) {
+        if (anchor == '%') {
+          if (literal ? length - i == literal_length &&
+                            memcmp(value + i, literal, literal_length) == 0
+                      : pattern_match(pattern, value + i, length - i))
+            match = length - i;
+        } else {
+          match = match_at(pattern, literal, literal_length, value + i,
+                           length - i, 1);
+        }
+      }
+      if (match > 0 || (match == 0 && anchor)) {
+        size_t m = replacement_length < size - 1 - n ? replacement_length
+                                                     : size - 1 - n;
+        memcpy(out + n, replacement, m);
+        n += m;
+        i += match;
+        replaced = 1;
+        if (match > 0) continue;
+      }
+      if (i < length) out[n++] = value[i];
+      i++;
+    }
+    out[n] = '\0';
+    result = out;
+  }
+  pattern_free(pattern);
+  return result;
+}
+
+/* Evaluates the offset and length of ${v:offset:length} for a string or an
+ * array of size elements. Returns -1 on an arithmetic error. */
+static int slice(const char* op, size_t op_length, size_t size,
+                 simple_map* variables, size_t* start, size_t* count) {
+  size_t colon = find_unquoted(op, op_length, ':');
+  int64_t offset, length = size;
+  if (arith_eval(op, colon, variables, &offset) < 0) return -1;
+  if (colon < op_length &&
+      arith_eval(op + colon + 1, op_length - colon - 1, variables, &length) < 0)
+    return -1;
+  if (offset < 0) offset += size;
+  if (offset < 0 || offset > size) offset = size;
+  /* A negative length counts back from the end */
+  if (length < 0) length += size - offset;
+  if (length < 0) length = 0;
+  if (length > size - offset) length = size - offset;
+  *start = offset;
+  *count = length;
+  return 0;
+}
+
+/* Applies the operator after the name of ${...} to value. */
+static const char* apply_operator(const char* value, const char* op,
+                                  size_t op_length, simple_map* variables,
+                                  char* out, size_t size) {
+  if (op_length == 0) return value;
+  if (op[0] == ':') {
+    size_t start, count;
+    if (slice(op + 1, op_length - 1, strlen(value), variables, &start,
+              &count) < 0)
+      return NULL;
+    snprintf(out, size, "%.*s", (int)count, value + start);
+    return out;
+  }
+  if (strchr("#%/", op[0])) {
+    return match_operator(value, op, op_length, variables, out, size);
+  }
+  fprintf(stderr, "${...%.*s}: bad substitution\n", (int)op_length, op);
+  return NULL;
+}
+
+/* Expands the inside of ${...}: a name or an array element a[subscript],
+ * all the elements of an array with a[@] or a[*], followed by an operator.
+ * ${#...} gives the length or the number of elements, ${!a[@]} the keys
+ * of an array and ${!v} the variable named by v. The elements of "${a[@]}" become separate words. Returns -1
+ * on error. */
+static int expand_braced(struct parser* p, const char* text, size_t length,
+                         simple_map* variables, int quoted) {
+  char name[256];
+  char buffer[32];
+  char out[n_max];
+  int assignment = assigning(p);
+  int split = !quoted && !assignment;
+
+  char prefix = 0;
+  if (length > 1 && (text[0] == '#' || text[0] == '!')) {
+    prefix = text[0];
+    text++;
+    length--;
+  }
+  size_t n = 0;
+  if (length > 0 && (isalpha(text[0]) || text[0] == '_')) {
+    while (n < length && (isalnum(text[n]) || text[n] == '_')) n++;
+  } else if (length > 0 && isdigit(text[0])) {
+    while (n < length && isdigit(text[n])) n++;
+  } else if (length > 0) {
+    n = 1; /* $?, $$, $!, ... */
+  }
+  snprintf(name, sizeof(name), "%.*s", (int)n, text);
+  const char* subscript = NULL;
+  size_t subscript_length = 0;
+  const char* close;
+  if (n < length && text[n] == '[' &&
+      (close = memchr(text + n, ']', length - n)) != NULL) {
+    subscript = text + n + 1;
+    subscript_length = close - subscript;
+    n = close - text + 1;
+  }
+  const char* op = text + n;
+  size_t op_length = length - n;
+  struct array* a = array_find(name);
+  /* $@ and $* are the positional parameters as elements, $0 included */
+  char each = subscript ? *subscript : 0;
+  int positional = subscript == NULL && (strcmp(name, "@") == 0 ||
+                                         strcmp(name, "*") == 0);
+  if (positional) {
+    each = name[0];
+    a = NULL;
+  }
+  int all = positional ||
+            (subscript_length == 1 && (each == '@' || each == '*'));
+
+  const char* value = NULL;
+  if (subscript == NULL) {
+    if (!positional) value = lookup_variable(variables, name, buffer);
+  } else if (!all) {
+    char key[n_max];
+    if (a != NULL && array_is_associative(a))
+      expand_operand(subscript, subscript_length, variables, 0, key,
+                     sizeof(key));
+    else
+      snprintf(key, sizeof(key), "%.*s", (int)subscript_length, subscript);
+    if (a != NULL)
+      value = array_get(a, key, variables);
+    else if (strcmp(key, "0") == 0) /* A string is an array of one */
+      value = simple_map_get(variables, name);
+  } else if (a == NULL) {
+    value = simple_map_get(variables, name);
+  }
+  int elements = positional || (all && a != NULL);
+  size_t total = positional ? positional_count() : a ? array_count(a) : 0;
+
+  /* ${v:-word} and ${v:+word} test whether v is set and not empty,
+   * ${v-word} and ${v+word} only whether it is set */
+  size_t colon = op_length > 1 && op[0] == ':';
+  if (op_length > colon && (op[colon] == '-' || op[colon] == '+')) {
+    int set = elements ? total > 0 : colon ? value && *value : value != NULL;
+    if (set == (op[colon] == '+')) {
+      expand_operand(op + colon + 1, op_length - colon - 1, variables, 0, out,
+                     sizeof(out));
+      append_value(p, out, split);
+      return 0;
+    }
+    if (op[colon] == '+') return 0;
+    op_length = 0;
+  }
+
+  if (prefix == '#') {
+    size_t count = elements ? total
+                   : all    ? value != NULL
+                            : (value ? strlen(value) : 0);
+    sprintf(buffer, "%zu", count);
+    append_value(p, buffer, split);
+    return 0;
+  }
+  if (!elements) {
+    if (prefix == '!' && all) value = value ? "0" : NULL;
+    /* ${!v} is the variable named by v */
+    if (prefix == '!' && subscript == NULL && value != NULL) {
+      snprintf(name, sizeof(name), "%s", value);
+      value = lookup_variable(variables, name, buffer);
+    }
+    if (value == NULL) return 0;
+    value = apply_operator(value, op, op_length, variables, out, sizeof(out));
+    if (value == NULL) return -1;
+    append_value(p, value, split);
+    return 0;
+  }
+
+  /* ${a[@]:offset:length} takes a slice of the elements, other operators
+   * apply to every element. Positional parameters start at $1, unless a
+   * slice asks for $0. */
+  size_t first = positional, count = total;
+  size_t end = positional ? total + 1 : array_end(a);
+  if (op_length > 0 && op[0] == ':') {
+    if (slice(op + 1, op_length - 1, total + positional, variables, &first,
+              &count) < 0)
+      return -1;
+    op_length = 0;
+  }
+  /* "${a[*]}" is one word with the elements joined by spaces */
+  int separate = split || (each == '@' && !assignment);
+  size_t index = 0, added = 0;
+  for (size_t i = 0; i < end && added < count; i++) {
+    if (positional) {
+      value = i > 0 ? positional_get(i)
+                    : lookup_variable(variables, "0", buffer);
+      if (value == NULL) value = "";
+    } else {
+      value = array_at(a, i);
+    }
+    if (value == NULL || index++ < first) continue;
+    if (prefix == '!' && !positional) value = array_key(a, i, buffer);
+    value = apply_operator(value, op, op_length, variables, out, sizeof(out));
+    if (value == NULL) return -1;
+    if (added++ > 0) {
+      if (separate)
+        finish_word(p);
+      else
+        append_value(p, " ", 0);
+    }
+    append_value(p, value, split);
+  }
+  /* "$@" without parameters is no word at all */
+  if (added == 0 && each == '@') p->empty = 0;
+  return 0;
+}
+
+/* Index of the } closing the ${ at line[i], or -1. */
+static int closing_brace(const char* line, int i) {
+  int depth = 0;
+  char quote = 0;
+  for (; line[i] != '\0'; i++) {
+    char c = line[i];
+    if (c == '\\' && quote != '\'' && line[i + 1] != '\0') {
+      i++;
+    } else if (quote) {
+      if (c == quote) quote = 0;
+    } else if (c == '\'' || c == '"') {
+      quote = c;
+    } else if (c == '{') {
+      depth++;
+    } else if (c == '}' && --depth == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* Expands $name, ${...}, $?, $! or $((expr)) starting at line[i]. Returns
+ * the index of the last character used, or -1 on error. */
+static int expand(struct parser* p, const char* line, int i,
+                  size_t line_length, simple_map* variables, int quoted) {
+  char name[256];
+  char buffer[32];
+  const char* value = NULL;
+  int end;
+  char next = line[i + 1];
+  if (next == '(' && line[i + 2] == '(') {
+    int close = matching_paren(line, i + 1, line_length);
+    if (close < 0 || line[close - 1] != ')') return -1;
+    int64_t result;
+    if (arith_eval(line + i + 3, close - i - 4, variables, &result) < 0)
+      return -1;
+    sprintf(buffer, "%" PRId64, result);
+    value = buffer;
+    end = close;
+  } else if (next == '{') {
+    int close = closing_brace(line, i + 1);
+    if (close < 0 ||
+        expand_braced(p, line + i + 2, close - i - 2, variables, quoted) < 0)
+      return -1;
+    return close;
+  } else {
+    int start = i + 1;
+    if (isalpha(next) || next == '_') {
+      for (end = start; isalnum(line[end]) || line[end] == '_'; end++)
+        ;
+    } else if (next == '@' || next == '*') {
+      if (expand_braced(p, line + start, 1, variables, quoted) < 0) return -1;
+      return start;
+    } else if (next != '\0' && strchr("?$!#0123456789", next)) {
+      end = start + 1;
+    } else {
+      append_value(p, "$", 0);
+      return i;
+    }
+    snprintf(name, sizeof(name), "%.*s", end - start, line + start);
+    value = lookup_variable(variables, name, buffer);
+    end--;
+  }
+
+  if (value != NULL) append_value(p, value, !quoted && !assigning(p));
+  return end;
+}
+
+/* A command line is split into parts first: words, operators, process
+ * substitutions and ((...)). Splitting only looks at the text, so a line
+ * run many times is split once and its words are expanded on every run. */
+enum part_type {
+  PART_WORD,
+  PART_LITERAL, /* A word with nothing to expand, copied as it is */
+  PART_PIPE,
+  PART_INPUT,
+  PART_OUTPUT,
+  PART_APPEND,
+  PART_BACKGROUND,
+  PART_PROCSUB,   /* Command of <(...), or of >(...) when output is set */
+  PART_LET,       /* Expression of ((...)) */
+  PART_ARRAY_END, /* ) closing NAME=(... */
+  PART_AND,
+  PART_OR,
+  PART_SEMICOLON,
+  PART_ERROR, /* Unbalanced parentheses, the command before it still runs */
+};
+
+/* A part is line[start..end) */
+struct part {
+  int type;
+  int start;
+  int end;
+  int output;
+};
 
+struct parts {
+  struct part* items;
+  size_t length;
+  size_t size;
+  arena* arena; /* Where items live, or NULL for the heap */
+};
+
+struct split_line {
+  char* text;
+  struct parts parts;
+};
+
+static void add_part(struct parts* parts, int type, int start, int end) {
+  if (parts->length == parts->size) {
+    size_t size = parts->size ? parts->size * 2 : 16;
+    if (parts->arena == NULL) {
+      parts->items = realloc(parts->items, sizeof(struct part) * size);
+    } else {
+      struct part* grown = arena_alloc(parts->arena, sizeof(struct part) * size);
+      if (parts->length > 0)
+        memcpy(grown, parts->items, sizeof(struct part) * parts->length);
+      parts->items = grown;
+    }
+    parts->size = size;
+  }
+  struct part part = {type, start, end, 0};
+  parts->items[parts->length++] = part;
+}
+
+/* Index after the $ expansion at line[i], the end of the line when its
+ * parentheses or braces aren't closed so expanding it fails. */
+static int skip_expansion(const char* line, int i, size_t line_length) {
+  int close = -1;
+  if (line[i + 1] == '(' && line[i + 2] == '(') {
+    close = matching_paren(line, i + 1, line_length);
+    if (close >= 0 && line[close - 1] != ')') close = -1;
+  } else if (line[i + 1] == '{') {
+    close = closing_brace(line, i + 1);
+  } else {
+    return i + 1;
+  }
+  return close < 0 ? line_length : close + 1;
+}
+
+/* Index after the word at line[i], which ends before a blank, an operator
+ * or the ) of an array assignment. Sets array when the word is NAME=( and
+ * literal when it has no quotes, expansions, patterns or assignment. */
+static int skip_word(const char* line, int i, size_t line_length,
+                     int first, int* array, int* literal) {
+  int start = i;
+  *literal = 1;
+  while (i < line_length) {
+    char c = line[i];
+    if (c == '\'' || c == '"') {
+      *literal = 0;
+      for (i++; i < line_length && line[i] != c; i++) {
+        if (c == '"' && line[i] == '\\' && i + 1 < line_length)
+          i++;
+        else if (c == '"' && line[i] == '$')
+          i = skip_expansion(line, i, line_length) - 1;
+      }
+      i++;
+    } else if (c == '\\') {
+      *literal = 0;
+      i += 2;
+    } else if (c == '$') {
+      *literal = 0;
+      i = skip_expansion(line, i, line_length);
+    } else if (isspace(c) || strchr(";|&<>", c) || (c == ')' && *array)) {
+      break;
+    } else if (c == '=' && first && i > start && line[i + 1] == '(') {
+      *literal = 0;
+      *array = 1;
+      return i + 2;
+    } else {
+      if (strchr("*?[{=", c)) *literal = 0;
+      i++;
+    }
+  }
+  return i < line_length ? i : line_length;
+}
+
+/* Splits line from i into parts. Unless whole is set, splitting stops
+ * after the first && , || or ;. */
+static void split_parts(const char* line, int i, struct parts* parts,
+                        int whole) {
+  size_t line_length = strlen(line);
+  int words = 0;    /* Words of the current command, for NAME=value */
+  int filename = 0; /* The next word is the file of a redirection */
+  int array = 0;    /* Inside the parentheses of NAME=(...) */
+  int word_end = -1;
+  while (i < line_length) {
+    char c = line[i];
+    char next = line[i + 1];
+    int type = -1, start = i, end = i + 1;
+    if (isspace(c)) {
+      i++;
+      continue;
+    } else if (c == ';') {
+      type = PART_SEMICOLON;
+    } else if (c == '|' && next == '|') {
+      type = PART_OR;
+      end++;
+    } else if (c == '|') {
+      type = PART_PIPE;
+    } else if (c == '&' && next == '&') {
+      type = PART_AND;
+      end++;
+    } else if (c == '&') {
+      type = PART_BACKGROUND;
+    } else if ((c == '<' || c == '>') && next == '(' && word_end != i) {
+      int close = matching_paren(line, i + 1, line_length);
+      if (close < 0) {
+        add_part(parts, PART_ERROR, i, line_length);
+        return;
+      }
+      add_part(parts, PART_PROCSUB, i + 2, close);
+      parts->items[parts->length - 1].output = c == '>';
+      if (!filename) words++;
+      filename = 0;
+      i = close + 1;
+      continue;
+    } else if (c == '(' && next == '(' && words == 0) {
+      int close = matching_paren(line, i, line_length);
+      if (close < 0 || line[close - 1] != ')') {
+        add_part(parts, PART_ERROR, i, line_length);
+        return;
+      }
+      add_part(parts, PART_LET, i + 2, close - 1);
+      words += 2;
+      i = close + 1;
+      continue;
+    } else if (c == '<') {
+      type = PART_INPUT;
+    } else if (c == '>' && next == '>') {
+      type = PART_APPEND;
+      end++;
+    } else if (c == '>') {
+      type = PART_OUTPUT;
+    } else if (c == ')' && array) {
+      type = PART_ARRAY_END;
+      array = 0;
+    }
+    if (type >= 0) {
+      add_part(parts, type, start, end);
+      i = end;
+      if (type == PART_INPUT || type == PART_OUTPUT || type == PART_APPEND) {
+        filename = 1;
+      } else if (type != PART_ARRAY_END && type != PART_BACKGROUND) {
+        words = 0;
+        if (!whole && type != PART_PIPE) return;
+      }
+      continue;
+    }
+    int literal;
+    end = skip_word(line, i, line_length, words == 0 && !filename, &array,
+                    &literal);
+    add_part(parts, literal && end - i < n_max ? PART_LITERAL : PART_WORD, i,
+             end);
+    if (!filename) words++;
+    filename = 0;
+    i = word_end = end;
+  }
+}
+
+/* Adds the word part to the command: quotes are removed and $ expansions
+ * replaced. Returns -1 if an expansion fails. */
+static int add_word(struct parser* p, const char* line, size_t line_length,
+                    struct part* part, simple_map* variables, int* array) {
   const int MODE_NORMAL = 0,
         MODE_SQUOTE = 1,
         MODE_DQUOTE = 2;
   int mode = MODE_NORMAL;
+  struct command* cmds = p->cmds;
 
-  char** cmd = NULL;
-  size_t cmd_len = 0;
-  int input_filename = 0;
-  int output_filename = 0;
-  int env_var = 0;
-
-  for (; i < line_length; i++) {
+  if (part->type == PART_LITERAL) {
+    p->n = part->end - part->start;
+    memcpy(p->token, line + part->start, p->n);
+    finish_word(p);
+    return 0;
+  }
+  for (int i = part->start; i < part->end; i++) {
     char c = line[i];
-    
+
     if (mode == MODE_NORMAL) {
       if (c == '\'') {
         mode = MODE_SQUOTE;
+        p->empty = 1;
       } else if (c == '"') {
         mode = MODE_DQUOTE;
+        p->empty = 1;
       } else if (c == '\\') {
         if (i + 1 < line_length) {
-          token[n++] = line[++i];
+          add_char(p, line[++i], QUOTED);
         }
-      } else if (isspace(c) || i == line_length - 1) {
-        if (n > 0) {
-          if (input_filename == 1) {
-            input_filename = 0;
-            cmds->inp_file = (char*)copy_word(token, n);
-          } else if (output_filename == 1) {
-            output_filename = 0;
-            cmds->out_file = (char*)copy_word(token, n);
-          } else if (env_var == 1) {
-            /* variable expansion */
-            env_var = 0;
-            char* var_name = (char*)copy_word(token, n);
-            char* var_value = simple_map_get(variables, var_name);
-            if (var_value == NULL) var_value = getenv(var_name);
-            if (var_value == NULL) {
-              free(var_name);
-              return NULL;
-            }
-            size_t value_length = strlen(var_value);
-            char tmp[1024];
-            strcpy(tmp, line + i); // Save string after variable.
-            strcpy((char*)line + i - strlen(var_name) - 1, var_value);
-            strcpy((char*)line + i - strlen(var_name) - 1 + value_length, tmp);
-            i -= strlen(var_name) + 1 + 1; // Rerun changed positions
-            line_length = strlen(line);
-            free(var_name);
-          } else {
-            void *word = copy_word(token, n);
-            vector_push(&cmd, &cmd_len, word);
-          }
-          n = 0;
-        }
-      } else if (c == '|' && line[i + 1] == '|') {
-        cmds->log_operator = 1;
-        cmds->logical_index = i + 2;
-        break;
-      } else if (c == '|') { // Pipe support.
-        /* There must be some command before and after pipe operator */
-        vector_push(&cmd, &cmd_len, NULL); // Append NULL terminator.
-        vector_push(&cmds->cmds, &cmds->cmds_length, cmd);
-        cmd = NULL;
-        cmd_len = 0;
-        n = 0;
-      } else if (c == '<') {
-        /* There must be some command before redirect operator */
-        input_filename = 1;
-      } else if (c == '>' && line[i + 1] == '>') {
-        /* There must be some command before and after redirect operator */
-        output_filename = 1;
-        cmds->append_to_file = 1;
-        i++;
-      } else if (c == '>') {
-        /* There must be some command before redirect operator */
-        output_filename = 1;
-      } else if (c == '&' && line[i + 1] == '&') {
-        cmds->log_operator = 0;
-        cmds->logical_index = i + 2;
-        break;
-      } else if (c == '&') {
-        /* This operator must be at the and of the line and separated with spaces */
-        cmds->background = 1;
       } else if (c == '$') {
-        env_var = 1;
-      } else if (c == '=') {
+        i = expand(p, line, i, line_length, variables, 0);
+      } else if (c == '=' && p->cmd_len == 0 && p->n > 0 &&
+                 cmds->env_var_definition == 0) {
+        /* Only the first word of a command defines a variable, NAME=(...)
+         * assigns the words in parentheses to an array */
         cmds->env_var_definition = 1;
-        void* variable_name = copy_word(token, n);
-        vector_push(&cmd, &cmd_len, variable_name);
-        n = 0;
+        void* variable_name = copy_word(p->token, p->n);
+        vector_push(&p->cmd, &p->cmd_len, variable_name);
+        p->n = 0;
+        p->glob = p->brace = 0;
+        if (line[i + 1] == '(') {
+          cmds->env_var_definition = 2;
+          *array = 1;
+          i++;
+        }
       } else {
-        token[n++] = c;
+        add_char(p, c, UNQUOTED);
       }
     } else if (mode == MODE_SQUOTE) {
+      /* Everything up to the next ' is literal, \ included */
       if (c == '\'') {
         mode = MODE_NORMAL;
-      } else if (c == '\\') {
-        if (i + 1 < line_length) {
-          token[n++] = line[++i];
-        }
       } else {
-        token[n++] = c;
+        add_char(p, c, QUOTED);
       }
     } else if (mode == MODE_DQUOTE) {
       if (c == '"') {
         mode = MODE_NORMAL;
-      } else if (c == '\\') {
-        if (i + 1 < line_length) {
-          token[n++] = line[++i];
-        }
+      } else if (c == '\\' && line[i + 1] == '\n') {
+        i++;
+      } else if (c == '\\' && line[i + 1] != '\0' &&
+                 strchr("$`\"\\", line[i + 1])) {
+        /* Other backslashes are kept, like the one of "\n" */
+        add_char(p, line[++i], QUOTED);
+      } else if (c == '$') {
+        i = expand(p, line, i, line_length, variables, 1);
       } else {
-        token[n++] = c;
+        add_char(p, c, QUOTED);
       }
     }
-    if (n + 1 >= n_max) abort();
+    if (i < 0) return -1; /* Expansion failed */
+    if (p->n + 1 >= n_max) abort();
   }
+  finish_word(p);
+  return 0;
+}
 
-  if (cmd_len > 0) {
-    vector_push(&cmd, &cmd_len, NULL); // Append NULL terminator.
-    vector_push(&cmds->cmds, &cmds->cmds_length, cmd);
+/* Builds the command from the parts starting at first, up to the next
+ * && , || or ;. Sets *next to the index of that operator. */
+static struct command* expand_parts(const char* line, struct parts* parts,
+                                    size_t first, arena_mark mark,
+                                    simple_map* variables, size_t* next) {
+  static char token[4096];
+  static char quoted[4096];
+  size_t line_length = strlen(line);
+
+  struct command* cmds = arena_alloc(&command_arena, sizeof(struct command));
+  cmds->mark = mark;
+  cmds->cmds_length = 0;
+  cmds->cmds = NULL;
+  cmds->inp_file = NULL;
+  cmds->out_file = NULL;
+  cmds->append_to_file = 0;
+  cmds->background = 0;
+  cmds->env_var_definition = 0;
+  cmds->log_operator = -1;
+  cmds->logical_index = 0;
+  cmds->procsubs_length = 0;
+  cmds->procsubs = NULL;
+  cmds->lazy_length = 0;
+  cmds->lazy = NULL;
+
+  struct parser parser = {cmds, NULL, 0, token, quoted, 0, 0, 0, 0, 0, 0};
+  struct parser* p = &parser;
+  int array_words = 0; /* Inside the parentheses of NAME=(...) */
+  int failed = 0;
+
+  size_t k = first;
+  for (; k < parts->length && !failed; k++) {
+    struct part* part = &parts->items[k];
+    int type = part->type;
+    if (type == PART_AND || type == PART_OR || type == PART_SEMICOLON) {
+      cmds->log_operator = type == PART_AND ? 0 : type == PART_OR ? 1 : 2;
+      break;
+    }
+    switch (type) {
+      case PART_WORD:
+      case PART_LITERAL:
+        failed = add_word(p, line, line_length, part, variables,
+                          &array_words) < 0;
+        break;
+      case PART_PIPE:
+        /* There must be some command before and after pipe operator */
+        vector_push(&p->cmd, &p->cmd_len, NULL); // Append NULL terminator.
+        vector_push(&cmds->cmds, &cmds->cmds_length, p->cmd);
+        p->cmd = NULL;
+        p->cmd_len = 0;
+        break;
+      case PART_INPUT:
+        p->input_filename = 1;
+        break;
+      case PART_APPEND:
+        cmds->append_to_file = 1;
+        /* fall through */
+      case PART_OUTPUT:
+        p->output_filename = 1;
+        break;
+      case PART_BACKGROUND:
+        cmds->background = 1;
+        break;
+      case PART_PROCSUB: {
+        /* Process substitution, argument is filled in before execution */
+        struct process_substitution* ps =
+            arena_alloc(&command_arena, sizeof(struct process_substitution));
+        ps->cmd_index = cmds->cmds_length;
+        ps->arg_index = p->cmd_len;
+        ps->output = part->output;
+        ps->line = copy_word(line + part->start, part->end - part->start);
+        ps->redirection = p->input_filename || p->output_filename;
+        vector_push(&cmds->procsubs, &cmds->procsubs_length, ps);
+        if (p->input_filename == 1) {
+          p->input_filename = 0;
+          cmds->inp_file = arena_strdup(&command_arena, "/dev/fd/?");
+        } else if (p->output_filename == 1) {
+          p->output_filename = 0;
+          cmds->out_file = arena_strdup(&command_arena, "/dev/fd/?");
+        } else {
+          vector_push(&p->cmd, &p->cmd_len,
+                      arena_strdup(&command_arena, "/dev/fd/?"));
+        }
+        break;
+      }
+      case PART_LET:
+        /* ((expr)) is the same as let "expr" */
+        vector_push(&p->cmd, &p->cmd_len, arena_strdup(&command_arena, "let"));
+        vector_push(&p->cmd, &p->cmd_len,
+                    copy_word(line + part->start, part->end - part->start));
+        break;
+      case PART_ARRAY_END:
+        array_words = 0;
+        break;
+      case PART_ERROR:
+        failed = 1;
+        break;
+    }
+  }
+  *next = k;
+  if (failed) {
+    if (p->cmd) {
+      vector_push(&p->cmd, &p->cmd_len, NULL);
+      vector_push(&cmds->cmds, &cmds->cmds_length, p->cmd);
+    }
+    command_destroy(cmds);
+    return NULL;
+  }
+
+  if (p->cmd_len > 0) {
+    vector_push(&p->cmd, &p->cmd_len, NULL); // Append NULL terminator.
+    vector_push(&cmds->cmds, &cmds->cmds_length, p->cmd);
   }
   return cmds;
 }
 
+struct command* parse(const char *line, simple_map* variables, int i) {
+  if (line == NULL || strlen(line) == i) {
+    return NULL;
+  }
+  arena_mark mark = arena_save(&command_arena);
+  struct parts parts = {NULL, 0, 0, &command_arena};
+  split_parts(line, i, &parts, 0);
+  size_t next;
+  struct command* cmds = expand_parts(line, &parts, 0, mark, variables, &next);
+  /* The operator's end is where the next command starts */
+  if (cmds != NULL && next < parts.length) {
+    cmds->logical_index = parts.items[next].end;
+  }
+  return cmds;
+}
+
+struct split_line* split_line(const char* line) {
+  struct split_line* split = malloc(sizeof(struct split_line));
+  split->text = strdup(line);
+  struct parts parts = {NULL, 0, 0, NULL};
+  split->parts = parts;
+  split_parts(split->text, 0, &split->parts, 1);
+  return split;
+}
+
+void split_line_free(struct split_line* split) {
+  if (split == NULL) return;
+  free(split->text);
+  free(split->parts.items);
+  free(split);
+}
+
+struct command* parse_split(struct split_line* split, simple_map* variables,
+                            int index) {
+  if (index >= split->parts.length) return NULL;
+  size_t next;
+  struct command* cmds =
+      expand_parts(split->text, &split->parts, index,
+                   arena_save(&command_arena), variables, &next);
+  if (cmds != NULL && next + 1 < split->parts.length)
+    cmds->logical_index = next + 1;
+  return cmds;
+}
+
+char** expand_words(const char* text, simple_map* variables) {
+  char line[4096];
+  if (snprintf(line, sizeof(line), "%s\n", text) >= sizeof(line)) return NULL;
+  struct command* cmds = parse(line, variables, 0);
+  if (cmds == NULL) return NULL;
+  command_expand_lazy(cmds);
+  /* The words outlive the command, they are copied to the heap */
+  char** cmd = cmds->cmds_length > 0 ? cmds->cmds[0] : NULL;
+  size_t length = 0;
+  while (cmd && cmd[length]) length++;
+  char** words = malloc(sizeof(char*) * (length + 1));
+  for (size_t i = 0; i < length; i++) words[i] = strdup(cmd[i]);
+  words[length] = NULL;
+  command_destroy(cmds);
+  return words;
+}
+
+void command_expand_lazy(struct command* cmds) {
+  struct word_cursor cursor;
+  for (size_t i = 0; i < cmds->cmds_length; i++) {
+    size_t length = 0, lazy = 0;
+    while (cmds->cmds[i][length] != NULL) length++;
+    for (size_t k = 0; k < cmds->lazy_length; k++) {
+      if (cmds->lazy[k]->cmd_index != i) continue;
+      length += brace_count(cmds->lazy[k]->braces) - 1;
+      lazy++;
+    }
+    if (lazy == 0) continue;
+
+    /* The size is known, so the arguments are copied once */
+    char** args = arena_alloc(&command_arena, sizeof(char*) * (length + 1));
+    size_t n = 0;
+    const char* word;
+    command_cursor(cmds, i, 0, &cursor);
+    while ((word = command_next_word(&cursor)) != NULL)
+      args[n++] = word == cursor.word ? arena_strdup(&command_arena, word)
+                                      : (char*)word;
+    args[n] = NULL;
+    cmds->cmds[i] = args;
+  }
+  cmds->lazy_length = 0;
+}
+
+void command_cursor(struct command* cmds, size_t cmd_index, size_t arg_index,
+                    struct word_cursor* cursor) {
+  cursor->cmds = cmds;
+  cursor->cmd_index = cmd_index;
+  cursor->arg_index = arg_index;
+  cursor->lazy_index = 0;
+  cursor->generating = 0;
+  while (cursor->lazy_index < cmds->lazy_length &&
+         (cmds->lazy[cursor->lazy_index]->cmd_index < cmd_index ||
+          (cmds->lazy[cursor->lazy_index]->cmd_index == cmd_index &&
+           cmds->lazy[cursor->lazy_index]->arg_index < arg_index)))
+    cursor->lazy_index++;
+}
+
+const char* command_next_word(struct word_cursor* cursor) {
+  struct command* cmds = cursor->cmds;
+  while (1) {
+    if (cursor->generating) {
+      struct brace* braces = cmds->lazy[cursor->lazy_index - 1]->braces;
+      ssize_t n = brace_next(braces, cursor->word, cursor->quoted, n_max - 1);
+      if (n == 0) continue;
+      if (n > 0) {
+        cursor->word[n] = '\0';
+        return cursor->word;
+      }
+      cursor->generating = 0;
+    }
+    char* arg = cmds->cmds[cursor->cmd_index][cursor->arg_index];
+    if (arg == NULL) return NULL;
+    struct lazy_word* lazy = cursor->lazy_index < cmds->lazy_length
+                                 ? cmds->lazy[cursor->lazy_index]
+                                 : NULL;
+    cursor->arg_index++;
+    if (lazy == NULL || lazy->cmd_index != cursor->cmd_index ||
+        lazy->arg_index != cursor->arg_index - 1)
+      return arg;
+    brace_rewind(lazy->braces);
+    cursor->lazy_index++;
+    cursor->generating = 1;
+  }
+}
+
 char** command_get_cmd(struct command* cmds, size_t n) {
   if (cmds == NULL || n >= cmds->cmds_length) {
     return NULL;
@@ -178,23 +1166,6 @@ void command_destroy(struct command* cmds) {
   if (cmds == NULL) {
     return;
   }
-  for (int i = 0; i < cmds->cmds_length; i++) {
-    char** cmd = cmds->cmds[i];
-    int index = 0;
-    while(1) {
-      if (cmd[index] == NULL) break;
-      free(cmd[index++]);
-    }
-    free(cmd);
-  }
-  if (cmds->cmds) {
-    free(cmds->cmds);
-  }
-  if (cmds->inp_file) {
-    free(cmds->inp_file);
-  }
-  if (cmds->out_file) {
-    free(cmds->out_file);
-  }
-  free(cmds);
+  /* Releases the command and everything allocated for it since parse */
+  arena_rewind(&command_arena, cmds->mark);
 }
@@ -1,6 +1,25 @@
 #pragma once
+#include "arena.h"
 #include "simple_map.h"
 
+/* A process substitution <(...) or >(...) that must be spawned before the
+ * command runs. Its argument is replaced with /dev/fd/N of the pipe. */
+struct process_substitution {
+  size_t cmd_index; /* Which command of the pipeline it belongs to */
+  size_t arg_index; /* Which argument of that command it replaces */
+  int redirection;  /* Replaces the redirection file instead of an argument */
+  int output;       /* 0 for <(...), 1 for >(...) */
+  char* line;       /* Command line to run inside */
+};
+
+/* A brace expansion with too many words to generate while parsing. Its
+ * argument holds the unexpanded word until the words are needed. */
+struct lazy_word {
+  size_t cmd_index;
+  size_t arg_index;
+  struct brace* braces;
+};
+
 /* A struct that represents a list of commands splitted with special characters. (| ...) */
 struct command {
   size_t cmds_length; /* How many commands are there? */
@@ -9,16 +28,62 @@ struct command {
   char* out_file;
   int append_to_file;
   int background;
-  int env_var_definition;
+  int env_var_definition; /* 1 for NAME=value, 2 for NAME=(words) */
   int logical_index; // logical operator index
-  int log_operator; // 0 is && and 1 is ||
+  int log_operator; // 0 is &&, 1 is || and 2 is ;
+  size_t procsubs_length;
+  struct process_substitution** procsubs;
+  size_t lazy_length;
+  struct lazy_word** lazy;
+  arena_mark mark; /* Where the command starts in command_arena */
 };
 
-/* Parse line entered in terminal. */
+/* Parse line entered in terminal. The command and its words are allocated
+ * in command_arena. */
 struct command* parse(const char* line, simple_map* variables, int index);
 
+/* A command line split into words and operators, for lines that run many
+ * times. Only the expansion of its words is left for every run. */
+struct split_line;
+
+/* Splits line, the result is allocated in heap. */
+struct split_line* split_line(const char* line);
+
+void split_line_free(struct split_line* split);
+
+/* Like parse, but index and logical_index count the parts of the split
+ * line instead of characters. */
+struct command* parse_split(struct split_line* split, simple_map* variables,
+                            int index);
+
+/* Expands variables in text and splits it into words, the result is NULL
+ * terminated and every word is allocated in heap. */
+char** expand_words(const char* text, simple_map* variables);
+
+/* Generates the words of lazy brace expansions into the arguments. */
+void command_expand_lazy(struct command* cmds);
+
+/* Goes through the arguments of one command, generating the words of lazy
+ * brace expansions one at a time. */
+struct word_cursor {
+  struct command* cmds;
+  size_t cmd_index;
+  size_t arg_index;
+  size_t lazy_index;  /* First lazy word not generated yet */
+  int generating;     /* The lazy word before lazy_index isn't finished */
+  char word[4096];
+  char quoted[4096];
+};
+
+void command_cursor(struct command* cmds, size_t cmd_index, size_t arg_index,
+                    struct word_cursor* cursor);
+
+/* Next argument, valid until the following call, or NULL at the end. */
+const char* command_next_word(struct word_cursor* cursor);
+
 /* Get me the Nth command (zero-indexed) */
 char** command_get_cmd(struct command* cmds, size_t n);
 
-/* Free the memory */
+/* Free the memory of the command and of everything allocated in
+ * command_arena after it, commands must be destroyed in reverse order. */
 void command_destroy(struct command* cmds);
@@ -3,7 +3,7 @@
 #include <search.h>
 
 void grow(vector *v) {
-	v->allocLen += v->initAlloc;
+	v->allocLen *= 2;
 	v->elems = realloc(v->elems, v->allocLen * v->elemSize);
 	assert(v->elems != NULL);
 }
@@ -25,7 +25,7 @@ void VectorDispose(vector *v) {
 	if(v->free != NULL) {
 		for(int i = 0; i < v->logLen; i++) {
 			void* tmp = (char*)v->elems + i * v->elemSize;
-			v->free(tmp);
+			(v->free)(tmp);
 		}
 	}
 	free(v->elems);
@@ -43,7 +43,7 @@ void *VectorNth(const vector *v, int position) {
 void VectorReplace(vector *v, const void *elemAddr, int position) {
 	assert(position >= 0 && position < v->logLen);
 	if(v->free != NULL)
-		v->free((char*)v->elems + position * v->elemSize);
+		(v->free)((char*)v->elems + position * v->elemSize);
 	memcpy((char*)v->elems + position * v->elemSize, elemAddr, v->elemSize);
 }
 
@@ -64,7 +64,7 @@ void VectorAppend(vector *v, const void *elemAddr) {
 void VectorDelete(vector *v, int position) {
 	assert(position >= 0 && position < v->logLen);
 	if(v->free != NULL)
-		v->free((char*)v->elems + position * v->elemSize);
+		(v->free)((char*)v->elems + position * v->elemSize);
 	if(position != v->logLen - 1)
 		memmove((char*)v->elems + position * v->elemSize, (char*)v->elems + (position + 1) * v->elemSize, (v->logLen - position - 1) * v->elemSize);
 	v->logLen--;
@@ -98,19 +98,18 @@ typedef struct {
  * NULL for the ArrayFreeFunction if the elements don't require any special handling.
  *
  * The initialAllocation parameter specifies the initial allocated length 
- * of the vector, as well as the dynamic reallocation increment for those times when the 
- * vector needs to grow.  Rather than growing the vector one element at a time as 
- * elements are added (inefficient), you will grow the vector 
- * in chunks of initialAllocation size.  The allocated length is the number
+ * of the vector.  Rather than growing the vector one element at a time as 
+ * elements are added (inefficient), the allocated length doubles whenever
+ * it is all used, so appending costs O(1) amortized however large the vector
+ * gets.  The allocated length is the number
  * of elements for which space has been allocated: the logical length 
  * is the number of those slots currently being used.
  * 
  * A new vector pre-allocates space for initialAllocation elements, but the
  * logical length is zero.  As elements are added, those allocated slots fill
- * up, and when the initial allocation is all used, grow the vector by another 
- * initialAllocation elements.  You will continue growing the vector in chunks
- * like this as needed.  Thus the allocated length will always be a multiple
- * of initialAllocation.  Don't worry about using realloc to shrink the vector's 
+ * up, and when the initial allocation is all used, the vector grows to twice
+ * its allocated length.  Thus the allocated length will always be
+ * initialAllocation times a power of two.  Don't worry about using realloc to shrink the vector's 
  * allocation if a bunch of elements get deleted.  It turns out that 
  * many implementations of realloc don't even pay attention to such a request, 
  * so there is little point in asking.  Just leave the vector over-allocated and no
@@ -0,0 +1,179 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "ipc.h"
+#include "zygote.h"
+
+/* Descriptors sent with a request: standard input, output, error and the
+ * shell's working directory */
+#define SPAWN_FDS 4
+
+/* Launch request, followed by path, argv and envp strings, then by every
+ * resource limit when limits is set. The child starts in the shell's
+ * directory with its umask. */
+struct spawn_request {
+  int32_t argc;
+  int32_t envc;
+  int32_t pgid;
+  uint32_t payload_length;
+  uint32_t umask;
+  int32_t limits;
+};
+
+static int zygote_socket = -1;
+static pid_t zygote_pid = -1;
+/* Whether ulimit changed a limit the zygote doesn't have yet */
+static bool limits_changed = false;
+
+/* Child side of a spawn, runs in the process created by clone. */
+static void exec_child(char* path, char** argv, char** envp, int* fds,
+                       pid_t pgid, mode_t mask) {
+  setpgid(0, pgid);
+  if (fchdir(fds[3]) != 0) {
+    fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+    _exit(127);
+  }
+  umask(mask);
+  for (int i = 0; i < 3; i++) dup2(fds[i], i);
+  int signals[] = {SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU, SIGCHLD};
+  for (int i = 0; i < sizeof(signals) / sizeof(int); i++)
+    signal(signals[i], SIG_DFL);
+  execve(path, argv, envp);
+  fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+  _exit(127);
+}
+
+static void zygote_loop(int sock) {
+  struct spawn_request request;
+  int fds[SPAWN_FDS];
+  while (receive_with_fds(sock, &request, sizeof(request), fds,
+                          SPAWN_FDS) == 0) {
+    char* payload = malloc(request.payload_length);
+    char** argv = malloc(sizeof(char*) * (request.argc + 1));
+    char** envp = malloc(sizeof(char*) * (request.envc + 1));
+    if (read_all(sock, payload, request.payload_length) < 0) _exit(1);
+    if (request.limits) {
+      /* The zygote takes the limits itself, later children inherit them */
+      struct rlimit limits[RLIM_NLIMITS];
+      if (read_all(sock, limits, sizeof(limits)) < 0) _exit(1);
+      for (int i = 0; i < RLIM_NLIMITS; i++) setrlimit(i, &limits[i]);
+    }
+
+    char* p = payload;
+    char* path = p;
+    p += strlen(p) + 1;
+    for (int i = 0; i < request.argc; i++, p += strlen(p) + 1) argv[i] = p;
+    argv[request.argc] = NULL;
+    for (int i = 0; i < request.envc; i++, p += strlen(p) + 1) envp[i] = p;
+    envp[request.envc] = NULL;
+
+    /* The new process becomes a sibling, so the shell can wait for it. */
+    int32_t pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, 0, 0, 0);
+    if (pid == 0)
+      exec_child(path, argv, envp, fds, request.pgid, request.umask);
+
+    for (int i = 0; i < SPAWN_FDS; i++) close(fds[i]);
+    free(payload);
+    free(argv);
+    free(envp);
+    if (write_all(sock, &pid, sizeof(pid)) < 0) break;
+  }
+  _exit(0);
+}
+
+int zygote_start() {
+  int sockets[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) < 0)
+    return -1;
+  pid_t pid = fork();
+  if (pid < 0) {
+    close(sockets[0]);
+    close(sockets[1]);
+    return -1;
+  } else if (pid == 0) { /* Zygote */
+    close(sockets[0]);
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGCHLD, SIG_DFL);
+    zygote_loop(sockets[1]);
+  }
+  close(sockets[1]);
+  zygote_socket = sockets[0];
+  zygote_pid = pid;
+  return 0;
+}
+
+bool zygote_active() { return zygote_socket != -1; }
+
+static int send_limits() {
+  struct rlimit limits[RLIM_NLIMITS];
+  for (int i = 0; i < RLIM_NLIMITS; i++) getrlimit(i, &limits[i]);
+  return write_all(zygote_socket, limits, sizeof(limits));
+}
+
+pid_t zygote_spawn(const char* path, char** argv, char** envp, int inp_fd,
+                   int out_fd, int err_fd, pid_t pgid) {
+  if (zygote_socket == -1) return -1;
+
+  int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (cwd < 0) return -1;
+  mode_t mask = umask(0);
+  umask(mask);
+  struct spawn_request request = {0, 0, pgid, strlen(path) + 1, mask,
+                                  limits_changed};
+  for (; argv[request.argc]; request.argc++)
+    request.payload_length += strlen(argv[request.argc]) + 1;
+  for (; envp[request.envc]; request.envc++)
+    request.payload_length += strlen(envp[request.envc]) + 1;
+
+  char* payload = malloc(request.payload_length);
+  char* p = stpcpy(payload, path) + 1;
+  for (int i = 0; i < request.argc; i++) p = stpcpy(p, argv[i]) + 1;
+  for (int i = 0; i < request.envc; i++) p = stpcpy(p, envp[i]) + 1;
+
+  int fds[SPAWN_FDS] = {inp_fd, out_fd, err_fd, cwd};
+  int32_t pid = -1;
+  if (send_with_fds(zygote_socket, &request, sizeof(request), fds,
+                    SPAWN_FDS) < 0 ||
+      write_all(zygote_socket, payload, request.payload_length) < 0 ||
+      (request.limits && send_limits() < 0) ||
+      read_all(zygote_socket, &pid, sizeof(pid)) < 0) {
+    fprintf(stderr, "zygote: lost connection, using fork\n");
+    zygote_stop();
+    pid = -1;
+  }
+  limits_changed = false;
+  close(cwd);
+  free(payload);
+  return pid;
+}
+
+void zygote_limits_changed() { limits_changed = true; }
+
+void zygote_stop() {
+  if (zygote_socket == -1) return;
+  close(zygote_socket);
+  zygote_socket = -1;
+  waitpid(zygote_pid, NULL, 0);
+  zygote_pid = -1;
+}
+
+void zygote_detach() {
+  if (zygote_socket == -1) return;
+  close(zygote_socket);
+  zygote_socket = -1;
+  zygote_pid = -1;
+}
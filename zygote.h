@@ -0,0 +1,29 @@
+#pragma once
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* Zygote is a small helper process forked at startup. It launches programs
+ * on behalf of the shell, so spawn time doesn't depend on the shell's heap.
+ * Children are created with CLONE_PARENT, they are children of the shell. */
+
+/* Forks the helper, returns 0 on success. */
+int zygote_start();
+
+/* Whether the helper is running. */
+bool zygote_active();
+
+/* Launches program with given standard descriptors inside process group
+ * pgid (0 creates a new group), in the shell's directory and with its umask
+ * and resource limits. Returns pid of the child or -1. */
+pid_t zygote_spawn(const char* path, char** argv, char** envp, int inp_fd,
+                   int out_fd, int err_fd, pid_t pgid);
+
+/* Tells the helper to take the shell's resource limits with the next
+ * launch, after ulimit changed them. */
+void zygote_limits_changed();
+
+/* Stops the helper. */
+void zygote_stop();
+
+/* Forgets the helper in a forked copy of the shell, without stopping it. */
+void zygote_detach();